@@ -0,0 +1,885 @@
+/**
+ * @file aesdbench.c
+ * @brief Load generator for aesdsocket
+ *
+ * Opens a number of concurrent connections to the server, each sending
+ * newline terminated packets and waiting for the reply that follows them,
+ * then reports packets per second, reply throughput and round trip
+ * latency percentiles.
+ *
+ * With -r every round opens a fresh connection, measuring connection
+ * setup and teardown along with the round trip.
+ *
+ * With -k each batch is written in chunks of that many bytes, so long
+ * packets reach the server in small pieces the way slow clients send them.
+ *
+ * A reply is complete once the received stream ends with the last packet
+ * this connection sent, which is exact when the reply is a snapshot taken
+ * right after the append. If other writers land between the append and
+ * the snapshot, the reply is accepted once the packet has been seen and
+ * the socket stays quiet for QUIET_MS.
+ *
+ * With -z each connection asks for compressed replies first and decodes
+ * the frames as they arrive; the report adds the bytes that came over
+ * the wire against what they decoded to. With -t packets are filled with
+ * log-like text rather than one repeated byte, so they compress like
+ * real records do.
+ *
+ * With -o the last reply the first connection received, decoded with -z,
+ * is written to a file, so scripts can compare what different server
+ * options answered. With -x a single line, such as a seek command, is
+ * sent instead of the workload and its reply written to standard output.
+ *
+ * With -C no server is involved: the codec compressed replies and -z
+ * segments use is run over a file, or over generated records shaped like
+ * the data file's, reporting its ratio and throughput. Blocks are checked
+ * to survive the round trip, and damaged ones to be rejected or decoded
+ * within bounds.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "lz.h"
+
+#define DEFAULT_PORT 9000
+#define RECV_SIZE (64 * 1024)
+#define QUIET_MS 200
+#define TIMEOUT_MS 30000
+#define COMPRESS_COMMAND "AESDCHAR_COMPRESS\n"
+// Generated codec input with -C, and how long each measurement runs
+#define CODEC_DATA_SIZE (16 * 1024 * 1024)
+#define CODEC_MIN_NS 500000000ULL
+// Damaged copies decoded of every compressed block with -C, and the bytes
+// past the output the decoder must leave alone
+#define CODEC_DAMAGE_TRIALS 16
+#define CODEC_GUARD 64
+// A timestamp line among every this many generated records, as the
+// server appends one every few seconds
+#define TIMESTAMP_EVERY 100
+
+struct bench_options {
+    const char *host;
+    int port;
+    int connections;
+    int packets;
+    size_t packet_size;
+    int pipeline;
+    size_t chunk_size;
+    bool reconnect;
+    bool compress;
+    bool text;
+    // With -o, where the first connection's last reply goes
+    const char *output;
+};
+
+struct bench_worker {
+    pthread_t thread_id;
+    int id;
+    const struct bench_options *opts;
+    uint64_t *latencies_ns;
+    int rounds;
+    uint64_t bytes_received;
+    // With -z: bytes the frames decoded to, and frame bytes not yet decoded
+    uint64_t bytes_decoded;
+    char *wire;
+    size_t wire_len;
+    // Receives every reply byte with -o, rewound each round; -1 otherwise
+    int capture_fd;
+    bool failed;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int connect_to_server(const struct bench_options *opts)
+{
+    struct sockaddr_in addr;
+    int one = 1;
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1) {
+        perror("socket");
+        return -1;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(opts->port);
+    if (inet_pton(AF_INET, opts->host, &addr.sin_addr) != 1) {
+        fprintf(stderr, "Invalid address %s\n", opts->host);
+        close(fd);
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        perror("connect");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Fill @param len bytes with log-like fields, no newline among them
+ */
+static void fill_text(char *dst, size_t len, unsigned int *seed)
+{
+    static const char *const states[] = { "ok", "idle", "warn", "busy" };
+    char field[96];
+
+    while (len > 0) {
+        unsigned int r = rand_r(seed);
+        int n = snprintf(field, sizeof(field), "sensor=%02u temp=%u.%02u hum=%u state=%s ",
+                         r % 16, 15 + r % 20, (r >> 8) % 100, 30 + (r >> 16) % 50, states[(r >> 24) % 4]);
+        size_t piece = (size_t)n < len ? (size_t)n : len;
+        memcpy(dst, field, piece);
+        dst += piece;
+        len -= piece;
+    }
+}
+
+/**
+ * Fill @param packet with a unique, newline terminated packet, padded
+ * with log-like text if @param text
+ */
+static void make_packet(char *packet, size_t size, int worker, int seq, bool text)
+{
+    int prefix = snprintf(packet, size, "b%d-%d-", worker, seq);
+    if (prefix < 0 || (size_t)prefix >= size) {
+        prefix = 0;
+    }
+    if (text) {
+        unsigned int seed = worker * 7919u + seq;
+        fill_text(packet + prefix, size - prefix - 1, &seed);
+    } else {
+        memset(packet + prefix, 'x', size - prefix - 1);
+    }
+    packet[size - 1] = '\n';
+}
+
+/**
+ * Send everything, at most @param chunk bytes per send() (0 for no limit)
+ */
+static int send_all(int fd, const char *data, size_t len, size_t chunk)
+{
+    while (len > 0) {
+        size_t piece = chunk > 0 && chunk < len ? chunk : len;
+        ssize_t sent = send(fd, data, piece, MSG_NOSIGNAL);
+        if (sent == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("send");
+            return -1;
+        }
+        data += sent;
+        len -= sent;
+    }
+    return 0;
+}
+
+/**
+ * Write everything to @param fd
+ */
+static int write_all(int fd, const char *data, size_t len)
+{
+    while (len > 0) {
+        ssize_t written = write(fd, data, len);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("write");
+            return -1;
+        }
+        data += written;
+        len -= written;
+    }
+    return 0;
+}
+
+/**
+ * @return true if a whole frame is waiting to be decoded
+ */
+static bool frame_ready(const struct bench_worker *worker)
+{
+    struct lz_frame_header header;
+
+    if (worker->wire_len < sizeof(header)) {
+        return false;
+    }
+    memcpy(&header, worker->wire, sizeof(header));
+    return worker->wire_len - sizeof(header) >= ntohl(header.stored_len);
+}
+
+/**
+ * Receive reply bytes into @param out, which holds RECV_SIZE. With -z
+ * the next frame is decoded, receiving only if none is waiting.
+ * @return the bytes stored (with -z 0 until a frame is complete), or -1
+ * on error
+ */
+static ssize_t receive_reply(struct bench_worker *worker, int fd, char *out)
+{
+    struct lz_frame_header header;
+
+    if (!worker->opts->compress || !frame_ready(worker)) {
+        char *into = worker->opts->compress ? worker->wire + worker->wire_len : out;
+        size_t space = worker->opts->compress ? 2 * LZ_FRAME_MAX - worker->wire_len : RECV_SIZE;
+        ssize_t bytes = recv(fd, into, space, 0);
+        if (bytes <= 0) {
+            fprintf(stderr, "Connection closed while waiting for reply\n");
+            return -1;
+        }
+        worker->bytes_received += bytes;
+        if (!worker->opts->compress) {
+            return bytes;
+        }
+        worker->wire_len += bytes;
+        if (!frame_ready(worker)) {
+            return 0;
+        }
+    }
+
+    memcpy(&header, worker->wire, sizeof(header));
+    size_t raw_len = ntohl(header.raw_len);
+    size_t stored_len = ntohl(header.stored_len);
+    const char *payload = worker->wire + sizeof(header);
+    if (raw_len > LZ_BLOCK_SIZE || stored_len > raw_len) {
+        fprintf(stderr, "Invalid reply frame\n");
+        return -1;
+    }
+    if (stored_len == raw_len) {
+        memcpy(out, payload, raw_len);
+    } else if (lz_decompress(payload, stored_len, out, raw_len) != (ssize_t)raw_len) {
+        fprintf(stderr, "Corrupt reply frame\n");
+        return -1;
+    }
+    worker->wire_len -= sizeof(header) + stored_len;
+    memmove(worker->wire, payload + stored_len, worker->wire_len);
+    worker->bytes_decoded += raw_len;
+    return raw_len;
+}
+
+/**
+ * Ask for compressed replies and wait for the empty frame that
+ * acknowledges it
+ * @return 0 on success, -1 if the server does not support them
+ */
+static int negotiate_compression(struct bench_worker *worker, int fd)
+{
+    struct lz_frame_header ack;
+    size_t have = 0;
+
+    worker->wire_len = 0;
+    if (send_all(fd, COMPRESS_COMMAND, strlen(COMPRESS_COMMAND), 0) == -1) {
+        return -1;
+    }
+    while (have < sizeof(ack)) {
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        ssize_t bytes = poll(&pfd, 1, TIMEOUT_MS) == 1 ? recv(fd, (char *)&ack + have, sizeof(ack) - have, 0) : -1;
+        if (bytes <= 0) {
+            fprintf(stderr, "No reply to %.*s\n", (int)strlen(COMPRESS_COMMAND) - 1, COMPRESS_COMMAND);
+            return -1;
+        }
+        have += bytes;
+    }
+    if (ack.raw_len != 0 || ack.stored_len != 0) {
+        fprintf(stderr, "Server does not support compressed replies\n");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Read until the stream ends with @param tail (the last packet sent).
+ * @param rx must hold RECV_SIZE plus twice the tail.
+ */
+static int await_reply(struct bench_worker *worker, int fd, char *rx, const char *tail, size_t tail_len)
+{
+    size_t rx_size = RECV_SIZE + 2 * tail_len;
+    size_t have = 0;
+    bool seen = false;
+
+    for (;;) {
+        // A frame already received is decoded without waiting
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        int ready = worker->opts->compress && frame_ready(worker) ? 1 : poll(&pfd, 1, seen ? QUIET_MS : TIMEOUT_MS);
+        if (ready == 0) {
+            if (seen) {
+                return 0;
+            }
+            fprintf(stderr, "Timed out waiting for reply\n");
+            return -1;
+        }
+        if (ready == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            return -1;
+        }
+
+        // Keep the last tail_len bytes so matches can span reads; only
+        // when full, so each byte is moved a bounded number of times
+        if (have + RECV_SIZE > rx_size) {
+            memmove(rx, rx + have - tail_len, tail_len);
+            have = tail_len;
+        }
+
+        ssize_t bytes = receive_reply(worker, fd, rx + have);
+        if (bytes == -1) {
+            return -1;
+        }
+        size_t scan = have;
+        have += bytes;
+        if (worker->capture_fd != -1 && write_all(worker->capture_fd, rx + scan, bytes) == -1) {
+            return -1;
+        }
+
+        // A packet's only newline is its last byte, so matches end at one
+        char *newline = memchr(rx + scan, '\n', have - scan);
+        while (newline != NULL) {
+            size_t end = newline - rx + 1;
+            if (end >= tail_len && memcmp(rx + end - tail_len, tail, tail_len) == 0) {
+                seen = true;
+                if (end == have) {
+                    return 0;
+                }
+            }
+            newline = memchr(newline + 1, '\n', have - end);
+        }
+    }
+}
+
+static void *worker_run(void *arg)
+{
+    struct bench_worker *worker = arg;
+    const struct bench_options *opts = worker->opts;
+    size_t batch_len = opts->packet_size * opts->pipeline;
+    char *batch = malloc(batch_len);
+    char *rx = malloc(RECV_SIZE + 2 * opts->packet_size);
+    worker->wire = opts->compress ? malloc(2 * LZ_FRAME_MAX) : NULL;
+
+    int fd = connect_to_server(opts);
+    if (fd == -1 || batch == NULL || rx == NULL || (opts->compress && worker->wire == NULL) ||
+        (opts->compress && negotiate_compression(worker, fd) == -1)) {
+        worker->failed = true;
+        goto out;
+    }
+
+    for (int seq = 0; seq < opts->packets; seq += opts->pipeline) {
+        int count = opts->packets - seq < opts->pipeline ? opts->packets - seq : opts->pipeline;
+
+        for (int i = 0; i < count; i++) {
+            make_packet(batch + i * opts->packet_size, opts->packet_size, worker->id, seq + i, opts->text);
+        }
+
+        // Only the last reply is kept
+        if (worker->capture_fd != -1 &&
+            (ftruncate(worker->capture_fd, 0) == -1 || lseek(worker->capture_fd, 0, SEEK_SET) == -1)) {
+            perror(opts->output);
+            worker->failed = true;
+            break;
+        }
+
+        uint64_t start = now_ns();
+        if (opts->reconnect && seq > 0) {
+            close(fd);
+            fd = connect_to_server(opts);
+            if (fd == -1 || (opts->compress && negotiate_compression(worker, fd) == -1)) {
+                worker->failed = true;
+                break;
+            }
+        }
+        if (send_all(fd, batch, count * opts->packet_size, opts->chunk_size) == -1 ||
+            await_reply(worker, fd, rx, batch + (count - 1) * opts->packet_size,
+                        opts->packet_size) == -1) {
+            worker->failed = true;
+            break;
+        }
+        worker->latencies_ns[worker->rounds++] = now_ns() - start;
+    }
+
+out:
+    if (fd != -1) {
+        close(fd);
+    }
+    free(batch);
+    free(rx);
+    free(worker->wire);
+    return NULL;
+}
+
+/**
+ * Send @param line and a newline on one connection, asking for compressed
+ * replies first with -z, and copy the reply to standard output until the
+ * socket stays quiet for QUIET_MS
+ * @return 0 on success, -1 on error
+ */
+static int run_command(const struct bench_options *opts, const char *line)
+{
+    struct bench_worker worker = { .opts = opts, .capture_fd = -1 };
+    char *rx = malloc(RECV_SIZE);
+    bool received = false;
+    int ret = -1;
+
+    worker.wire = opts->compress ? malloc(2 * LZ_FRAME_MAX) : NULL;
+    int fd = connect_to_server(opts);
+    if (fd == -1 || rx == NULL || (opts->compress && worker.wire == NULL) ||
+        (opts->compress && negotiate_compression(&worker, fd) == -1) ||
+        send_all(fd, line, strlen(line), 0) == -1 || send_all(fd, "\n", 1, 0) == -1) {
+        goto out;
+    }
+
+    for (;;) {
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        int ready = opts->compress && frame_ready(&worker) ? 1 : poll(&pfd, 1, received ? QUIET_MS : TIMEOUT_MS);
+        if (ready == 0) {
+            if (received) {
+                ret = 0;
+            } else {
+                fprintf(stderr, "Timed out waiting for reply\n");
+            }
+            break;
+        }
+        if (ready == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            break;
+        }
+        ssize_t bytes = receive_reply(&worker, fd, rx);
+        if (bytes == -1 || write_all(STDOUT_FILENO, rx, bytes) == -1) {
+            break;
+        }
+        received = true;
+    }
+
+out:
+    if (fd != -1) {
+        close(fd);
+    }
+    free(rx);
+    free(worker.wire);
+    return ret;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile_us(const uint64_t *sorted, size_t count, double pct)
+{
+    if (count == 0) {
+        return 0.0;
+    }
+    size_t index = (size_t)(pct / 100.0 * (count - 1) + 0.5);
+    return sorted[index] / 1000.0;
+}
+
+/**
+ * Fill @param data with records like the data file's: packets of
+ * @param size padded with log-like text, and a timestamp line now and then
+ */
+static void make_records(char *data, size_t len, size_t size)
+{
+    char *packet = malloc(size);
+    time_t now = time(NULL);
+    size_t pos = 0;
+
+    for (int seq = 0; packet != NULL && pos < len; seq++) {
+        char record[128];
+        size_t record_len = size;
+        const char *src = packet;
+        if (seq % TIMESTAMP_EVERY == TIMESTAMP_EVERY - 1) {
+            struct tm tm_info;
+            time_t stamp = now + seq / TIMESTAMP_EVERY * 10;
+            localtime_r(&stamp, &tm_info);
+            record_len = strftime(record, sizeof(record), "timestamp:%a, %d %b %Y %H:%M:%S %z\n", &tm_info);
+            src = record;
+        } else {
+            make_packet(packet, size, seq % 8, seq, true);
+        }
+        if (record_len > len - pos) {
+            record_len = len - pos;
+        }
+        memcpy(data + pos, src, record_len);
+        pos += record_len;
+    }
+    free(packet);
+}
+
+/**
+ * Load @param path, or generate records of @param size if it is NULL
+ * @return the data, which the caller frees, or NULL on error
+ */
+static char *codec_input(const char *path, size_t size, size_t *len)
+{
+    if (path == NULL) {
+        char *data = malloc(CODEC_DATA_SIZE);
+        if (data != NULL) {
+            make_records(data, CODEC_DATA_SIZE, size);
+            *len = CODEC_DATA_SIZE;
+        }
+        return data;
+    }
+
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        perror(path);
+        if (fd != -1) {
+            close(fd);
+        }
+        return NULL;
+    }
+    char *data = malloc(st.st_size > 0 ? st.st_size : 1);
+    size_t have = 0;
+    while (data != NULL && have < (size_t)st.st_size) {
+        ssize_t bytes = read(fd, data + have, st.st_size - have);
+        if (bytes <= 0) {
+            perror(path);
+            free(data);
+            data = NULL;
+            break;
+        }
+        have += bytes;
+    }
+    close(fd);
+    *len = have;
+    return data;
+}
+
+/**
+ * Damage every compressed frame in @param packed and decode it again. A
+ * block cut in half or given too little room must be rejected; one with
+ * bits flipped must be rejected or at least decoded within its buffer,
+ * as blocks carry no checksum and only a wrong length gives them away.
+ * @return 0 on success, -1 if a damaged block got past the decoder
+ */
+static int codec_check_damage(const char *packed, size_t block_count)
+{
+    char *damaged = malloc(LZ_BLOCK_SIZE);
+    char *out = malloc(LZ_BLOCK_SIZE + CODEC_GUARD);
+    char guard[CODEC_GUARD];
+    unsigned int seed = 1;
+    size_t checked = 0;
+    size_t rejected = 0;
+    int ret = -1;
+
+    memset(guard, 0x5a, sizeof(guard));
+    if (damaged == NULL || out == NULL) {
+        goto out;
+    }
+    for (size_t i = 0; i < block_count; i++) {
+        struct lz_frame_header header;
+        const char *frame = packed + i * LZ_FRAME_MAX;
+        memcpy(&header, frame, sizeof(header));
+        size_t raw = ntohl(header.raw_len);
+        size_t stored = ntohl(header.stored_len);
+        const char *payload = frame + sizeof(header);
+        if (stored == raw) {
+            // Stored as it is: nothing to decode
+            continue;
+        }
+
+        if (lz_decompress(payload, stored / 2, out, raw) == (ssize_t)raw ||
+            lz_decompress(payload, stored, out, raw - 1) != -1) {
+            fprintf(stderr, "Block %zu cut short or given too little room was not rejected\n", i);
+            goto out;
+        }
+        for (int trial = 0; trial < CODEC_DAMAGE_TRIALS; trial++) {
+            memcpy(damaged, payload, stored);
+            for (int flip = 0; flip < 4; flip++) {
+                damaged[rand_r(&seed) % stored] ^= 1 << rand_r(&seed) % 8;
+            }
+            memcpy(out + raw, guard, sizeof(guard));
+            ssize_t decoded = lz_decompress(damaged, stored, out, raw);
+            if (decoded < -1 || decoded > (ssize_t)raw || memcmp(out + raw, guard, sizeof(guard)) != 0) {
+                fprintf(stderr, "Damaged block %zu decoded out of bounds\n", i);
+                goto out;
+            }
+            checked++;
+            rejected += decoded != (ssize_t)raw;
+        }
+    }
+
+    printf("damaged blocks=%zu rejected=%zu\n", checked, rejected);
+    ret = 0;
+out:
+    free(damaged);
+    free(out);
+    return ret;
+}
+
+/**
+ * Compress and decompress the input in LZ_BLOCK_SIZE blocks, repeating
+ * each pass until it has run for CODEC_MIN_NS, and check the round trip
+ * and how damaged blocks are handled
+ * @return 0 on success, -1 on error
+ */
+static int codec_bench(const char *path, size_t size)
+{
+    size_t len = 0;
+    char *data = codec_input(path, size, &len);
+    size_t block_count = (len + LZ_BLOCK_SIZE - 1) / LZ_BLOCK_SIZE;
+    char *packed = malloc(block_count * LZ_FRAME_MAX + 1);
+    size_t *packed_len = malloc(block_count * sizeof(size_t) + 1);
+    char *out = malloc(LZ_BLOCK_SIZE);
+    int ret = -1;
+
+    if (data == NULL || packed == NULL || packed_len == NULL || out == NULL) {
+        goto out;
+    }
+
+    size_t stored = 0;
+    int passes = 0;
+    uint64_t start = now_ns();
+    do {
+        stored = 0;
+        for (size_t i = 0; i < block_count; i++) {
+            size_t raw = len - i * LZ_BLOCK_SIZE < LZ_BLOCK_SIZE ? len - i * LZ_BLOCK_SIZE : LZ_BLOCK_SIZE;
+            packed_len[i] = lz_frame_encode(data + i * LZ_BLOCK_SIZE, raw, packed + i * LZ_FRAME_MAX);
+            stored += packed_len[i];
+        }
+        passes++;
+    } while (now_ns() - start < CODEC_MIN_NS);
+    double compress_s = (now_ns() - start) / 1e9 / passes;
+
+    passes = 0;
+    start = now_ns();
+    do {
+        for (size_t i = 0; i < block_count; i++) {
+            struct lz_frame_header header;
+            const char *frame = packed + i * LZ_FRAME_MAX;
+            memcpy(&header, frame, sizeof(header));
+            size_t raw = ntohl(header.raw_len);
+            size_t stored_len = ntohl(header.stored_len);
+            ssize_t decoded = raw;
+            if (stored_len == raw) {
+                memcpy(out, frame + sizeof(header), raw);
+            } else {
+                decoded = lz_decompress(frame + sizeof(header), stored_len, out, LZ_BLOCK_SIZE);
+            }
+            if (decoded != (ssize_t)raw || memcmp(out, data + i * LZ_BLOCK_SIZE, raw) != 0) {
+                fprintf(stderr, "Block %zu did not survive the round trip\n", i);
+                goto out;
+            }
+        }
+        passes++;
+    } while (now_ns() - start < CODEC_MIN_NS);
+    double decompress_s = (now_ns() - start) / 1e9 / passes;
+
+    printf("input=%s bytes=%zu blocks=%zu\n", path != NULL ? path : "generated", len, block_count);
+    printf("framed bytes=%zu ratio=%.2f\n", stored, stored > 0 ? (double)len / stored : 0.0);
+    printf("compress MB/s=%.1f decompress MB/s=%.1f\n", len / compress_s / 1e6, len / decompress_s / 1e6);
+    ret = codec_check_damage(packed, block_count);
+out:
+    free(data);
+    free(packed);
+    free(packed_len);
+    free(out);
+    return ret;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-H host] [-P port] [-c connections] [-n packets] [-s size] [-w pipeline] [-k chunk] [-r] [-t] [-z] [-o file]\n"
+            "       %s [-H host] [-P port] [-z] -x line\n"
+            "       %s -C [-s size] [file]\n"
+            "  -c  concurrent connections (default 1)\n"
+            "  -n  packets per connection (default 1000)\n"
+            "  -s  packet size in bytes including the newline (default 64)\n"
+            "  -w  packets sent back to back before waiting for a reply (default 1)\n"
+            "  -k  bytes per send() call (default: whole batch at once)\n"
+            "  -r  open a new connection for every round\n"
+            "  -t  fill packets with log-like text instead of one repeated byte\n"
+            "  -z  ask for compressed replies and decode them\n"
+            "  -o  write the first connection's last reply to file\n"
+            "  -x  send only line, such as a command, and write its reply to standard output\n"
+            "  -C  benchmark and check the reply codec on file, or on generated records of -s bytes\n",
+            prog, prog, prog);
+}
+
+int main(int argc, char *argv[])
+{
+    struct bench_options opts = {
+        .host = "127.0.0.1",
+        .port = DEFAULT_PORT,
+        .connections = 1,
+        .packets = 1000,
+        .packet_size = 64,
+        .pipeline = 1,
+        .chunk_size = 0,
+        .reconnect = false,
+        .compress = false,
+        .text = false,
+        .output = NULL,
+    };
+    const char *command = NULL;
+    bool codec_only = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "H:P:c:n:s:w:k:rtzo:x:C")) != -1) {
+        switch (opt) {
+            case 'H':
+                opts.host = optarg;
+                break;
+            case 'P':
+                opts.port = atoi(optarg);
+                break;
+            case 'c':
+                opts.connections = atoi(optarg);
+                break;
+            case 'n':
+                opts.packets = atoi(optarg);
+                break;
+            case 's':
+                opts.packet_size = strtoul(optarg, NULL, 10);
+                break;
+            case 'w':
+                opts.pipeline = atoi(optarg);
+                break;
+            case 'k':
+                opts.chunk_size = strtoul(optarg, NULL, 10);
+                break;
+            case 'r':
+                opts.reconnect = true;
+                break;
+            case 't':
+                opts.text = true;
+                break;
+            case 'z':
+                opts.compress = true;
+                break;
+            case 'o':
+                opts.output = optarg;
+                break;
+            case 'x':
+                command = optarg;
+                break;
+            case 'C':
+                codec_only = true;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (opts.connections < 1 || opts.packets < 1 || opts.pipeline < 1 || opts.packet_size < 16) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (codec_only) {
+        return codec_bench(optind < argc ? argv[optind] : NULL, opts.packet_size) == 0 ? 0 : 1;
+    }
+    if (command != NULL) {
+        return run_command(&opts, command) == 0 ? 0 : 1;
+    }
+
+    struct bench_worker *workers = calloc(opts.connections, sizeof(*workers));
+    if (workers == NULL) {
+        perror("calloc");
+        return 1;
+    }
+
+    int capture_fd = -1;
+    if (opts.output != NULL && (capture_fd = open(opts.output, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) {
+        perror(opts.output);
+        return 1;
+    }
+
+    int rounds_per_worker = (opts.packets + opts.pipeline - 1) / opts.pipeline;
+    for (int i = 0; i < opts.connections; i++) {
+        workers[i].id = i;
+        workers[i].opts = &opts;
+        workers[i].capture_fd = i == 0 ? capture_fd : -1;
+        workers[i].latencies_ns = calloc(rounds_per_worker, sizeof(uint64_t));
+        if (workers[i].latencies_ns == NULL) {
+            perror("calloc");
+            return 1;
+        }
+    }
+
+    uint64_t start = now_ns();
+    for (int i = 0; i < opts.connections; i++) {
+        if (pthread_create(&workers[i].thread_id, NULL, worker_run, &workers[i]) != 0) {
+            fprintf(stderr, "Failed to create worker thread\n");
+            return 1;
+        }
+    }
+
+    size_t total_rounds = 0;
+    uint64_t total_bytes = 0;
+    uint64_t total_decoded = 0;
+    bool failed = false;
+    for (int i = 0; i < opts.connections; i++) {
+        pthread_join(workers[i].thread_id, NULL);
+        total_rounds += workers[i].rounds;
+        total_bytes += workers[i].bytes_received;
+        total_decoded += workers[i].bytes_decoded;
+        failed |= workers[i].failed;
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+
+    uint64_t *all = malloc(total_rounds * sizeof(uint64_t) + 1);
+    size_t filled = 0;
+    for (int i = 0; i < opts.connections; i++) {
+        memcpy(all + filled, workers[i].latencies_ns, workers[i].rounds * sizeof(uint64_t));
+        filled += workers[i].rounds;
+        free(workers[i].latencies_ns);
+    }
+    qsort(all, filled, sizeof(uint64_t), compare_u64);
+
+    size_t packets = 0;
+    for (int i = 0; i < opts.connections; i++) {
+        int sent = workers[i].rounds * opts.pipeline;
+        packets += sent < opts.packets ? sent : opts.packets;
+    }
+
+    printf("connections=%d packets=%zu size=%zu pipeline=%d elapsed=%.3fs\n",
+           opts.connections, packets, opts.packet_size, opts.pipeline, elapsed);
+    printf("packets/s=%.0f reply MB/s=%.1f\n", packets / elapsed, total_bytes / elapsed / 1e6);
+    printf("round trip us: p50=%.1f p90=%.1f p99=%.1f p99.9=%.1f max=%.1f\n",
+           percentile_us(all, filled, 50), percentile_us(all, filled, 90),
+           percentile_us(all, filled, 99), percentile_us(all, filled, 99.9),
+           percentile_us(all, filled, 100));
+    if (opts.compress) {
+        printf("compressed replies: wire bytes=%llu decoded bytes=%llu ratio=%.2f\n",
+               (unsigned long long)total_bytes, (unsigned long long)total_decoded,
+               total_bytes > 0 ? (double)total_decoded / total_bytes : 0.0);
+    }
+
+    free(all);
+    free(workers);
+    if (capture_fd != -1) {
+        close(capture_fd);
+    }
+    return failed ? 1 : 0;
+}
@@ -4,9 +4,48 @@
  *
  * Opens a stream socket on port 9000, accepts connections, receives data,
  * appends to /var/tmp/aesdsocketdata, and sends the file content back.
+ * The data file is reopened on SIGHUP so it can be rotated.
+ * With -w a dedicated writer thread appends records in batches.
+ * With -b partial packets larger than the given size are staged in a
+ * file rather than memory until their newline arrives.
+ * With -f record or -f group replies are sent only once the data they
+ * cover has been fdatasync()ed, per record or per group commit.
  * Supports daemon mode with -d argument.
- * Supports multiple simultaneous connections with threading.
+ * Supports multiple simultaneous connections with threading, with an
+ * edge-triggered epoll event loop selected with -m epoll, or with a single
+ * io_uring driven thread selected with -m uring, or with a fixed pool of
+ * work-stealing worker threads selected with -m pool. With -m epoll -r
+ * every event loop accepts from its own SO_REUSEPORT listening socket.
+ * With -i each reply carries only the data file bytes appended since the
+ * previous reply to that client, instead of the whole file.
+ * With -p all complete packets from one read are appended together and
+ * answered with a single reply.
+ * A client that sends AESDCHAR_SUBSCRIBE is no longer answered per packet:
+ * it is pushed every record committed from then on until it disconnects.
+ * With -s ring only the last 10 records (or the count given) are kept, in
+ * memory, and replies are served from there without touching the disk;
+ * -s device writes them to an aesdchar device and -s file:path to a data
+ * file other than /var/tmp/aesdsocketdata.
+ * With -s segments the data file is split into segment files of 1 MiB (or
+ * the size given), and with -k the oldest are deleted once the rest hold
+ * enough bytes or records, or once they are old enough; replies and seeks
+ * then cover only the segments kept.
+ * With -P the data file (or segments) is kept at exit and picked up
+ * again at startup, the data file along with a checksummed sidecar index
+ * that is mapped rather than rebuilt and repaired after a crash.
+ * With -z sealed segments are compressed in the background and replies
+ * from them decompressed as they are read. A client that sends
+ * AESDCHAR_COMPRESS gets every later reply as compressed frames.
+ * With -M the newest data file bytes, up to the given size rounded up to
+ * whole 2 MiB chunks, are mirrored in memory and replies sent from there
+ * rather than from the file.
+ * With -a the data file is grown in fallocate()d extents of the given
+ * size rather than by each append, and truncated back to its records
+ * on shutdown, or on the next start with -a after a crash.
  * Appends timestamp every 10 seconds.
+ * A housekeeper thread appends the timestamps from a timerfd, joins
+ * finished connection threads straight away and, on SIGUSR1, logs
+ * connection, thread, fd and RSS counts.
  */
 
 #include <stdio.h>
@@ -19,68 +58,124 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <stdbool.h>
 #include <pthread.h>
 #include <time.h>
 #include <sys/queue.h>
+#include <sys/sendfile.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <poll.h>
+#include <dirent.h>
+#include <stdint.h>
 
-#define PORT 9000
-#define DATA_FILE "/var/tmp/aesdsocketdata"
-#define BUFFER_SIZE 1024
-#define TIMESTAMP_INTERVAL 10
+#include "aesdsocket.h"
+#include "lz.h"
 
 // Thread data structure
 typedef struct thread_data {
     pthread_t thread_id;
     int client_fd;
     struct sockaddr_in client_addr;
-    bool thread_complete;
-    SLIST_ENTRY(thread_data) entries;
+    // Linked into thread_list_head while running, then finished_threads
+    LIST_ENTRY(thread_data) entries;
+    STAILQ_ENTRY(thread_data) finished_entries;
 } thread_data_t;
 
-// Global variables for signal handling
-static int server_fd = -1;
-static volatile sig_atomic_t caught_signal = 0;
+// Runtime configuration
+struct server_config config = {
+    .engine = ENGINE_THREAD,
+    .loop_threads = 0,
+    .writer_thread = false,
+    .durability = DURABILITY_NONE,
+    .group_records = GROUP_COMMIT_RECORDS,
+    .group_usec = GROUP_COMMIT_USEC,
+    .spill_threshold = 0,
+    .listen_backlog = SOMAXCONN,
+    .reuseport_shards = false,
+    .delta_replies = false,
+    .batch_packets = false,
+    .storage = STORAGE_FILE,
+    .storage_path = DATA_FILE,
+    .ring_records = RING_RECORDS,
+    .segment_bytes = SEGMENT_BYTES,
+    .retain_bytes = 0,
+    .retain_records = 0,
+    .retain_seconds = 0,
+    .persistent = false,
+    .compress_segments = false,
+    .mirror_bytes = 0,
+    .prealloc_bytes = 0,
+};
+
+const struct storage_ops *storage = &file_storage;
 
-// Mutex for file access synchronization
-static pthread_mutex_t file_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Global variables for signal handling
+int server_fd = -1;
+volatile sig_atomic_t caught_signal = 0;
 
-// Thread list head
-static SLIST_HEAD(thread_list_head, thread_data) thread_list_head;
+// Running connection threads, and finished ones waiting to be joined
+static LIST_HEAD(thread_list_head, thread_data) thread_list_head;
+static STAILQ_HEAD(finished_list_head, thread_data) finished_threads;
 static pthread_mutex_t thread_list_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t threads_done = PTHREAD_COND_INITIALIZER;
+static unsigned long active_connections;
+static unsigned long reaped_connections;
+
+// Housekeeper thread, woken through housekeeper_fd when there is work for it
+static pthread_t housekeeper_thread;
+static int housekeeper_fd = -1;
+static bool housekeeper_stopping;
+static volatile sig_atomic_t stats_requested = 0;
 
 // Timer
-static timer_t timerid;
+static int timer_fd = -1;
 
+// Last formatted timestamp and the second it was formatted for
+static time_t timestamp_second = -1;
+static char timestamp[200];
+static size_t timestamp_len;
 
 /**
- * Timer signal handler - appends timestamp to file
+ * Format the timestamp line for @param now, reusing the previous result
+ * within the same second. Only called from the housekeeper thread.
  */
-void timer_handler(union sigval sv)
+static const char *format_timestamp(time_t now, size_t *len)
 {
-    time_t now;
-    struct tm *tm_info;
-    char timestamp[200];
-    
-    time(&now);
-    tm_info = localtime(&now);
+    struct tm tm_info;
     
-    // RFC 2822 compliant format
-    strftime(timestamp, sizeof(timestamp), "timestamp:%a, %d %b %Y %H:%M:%S %z\n", tm_info);
+    if (now != timestamp_second) {
+        localtime_r(&now, &tm_info);
+        // RFC 2822 compliant format
+        timestamp_len = strftime(timestamp, sizeof(timestamp),
+                                 "timestamp:%a, %d %b %Y %H:%M:%S %z\n", &tm_info);
+        timestamp_second = now;
+    }
     
-    pthread_mutex_lock(&file_mutex);
+    *len = timestamp_len;
+    return timestamp;
+}
+
+/**
+ * Timer expiry - appends timestamp to file
+ */
+static void timer_handler(void)
+{
+    uint64_t expirations;
+    size_t len;
     
-    FILE *fp = fopen(DATA_FILE, "a");
-    if (fp != NULL) {
-        fputs(timestamp, fp);
-        fclose(fp);
-    } else {
-        syslog(LOG_ERR, "Failed to open file for timestamp: %s", strerror(errno));
+    if (read(timer_fd, &expirations, sizeof(expirations)) == -1) {
+        // Disarmed or already read since poll() returned
+        return;
     }
     
-    pthread_mutex_unlock(&file_mutex);
+    const char *line = format_timestamp(time(NULL), &len);
+    if (append_packet(line, len, NULL) == -1) {
+        syslog(LOG_ERR, "Failed to append timestamp");
+    }
 }
 
 /**
@@ -88,15 +183,10 @@ void timer_handler(union sigval sv)
  */
 int init_timer(void)
 {
-    struct sigevent sev;
     struct itimerspec its;
     
-    memset(&sev, 0, sizeof(sev));
-    sev.sigev_notify = SIGEV_THREAD;
-    sev.sigev_notify_function = timer_handler;
-    sev.sigev_value.sival_ptr = &timerid;
-    
-    if (timer_create(CLOCK_REALTIME, &sev, &timerid) == -1) {
+    timer_fd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer_fd == -1) {
         syslog(LOG_ERR, "Failed to create timer: %s", strerror(errno));
         return -1;
     }
@@ -107,9 +197,10 @@ int init_timer(void)
     its.it_interval.tv_sec = TIMESTAMP_INTERVAL;
     its.it_interval.tv_nsec = 0;
     
-    if (timer_settime(timerid, 0, &its, NULL) == -1) {
+    if (timerfd_settime(timer_fd, 0, &its, NULL) == -1) {
         syslog(LOG_ERR, "Failed to set timer: %s", strerror(errno));
-        timer_delete(timerid);
+        close(timer_fd);
+        timer_fd = -1;
         return -1;
     }
     
@@ -117,12 +208,23 @@ int init_timer(void)
 }
 
 /**
- * Signal handler for SIGINT and SIGTERM
+ * Signal handler for SIGINT, SIGTERM, SIGHUP and SIGUSR1
  */
 void signal_handler(int signo)
 {
-    if (signo == SIGINT || signo == SIGTERM) {
-        syslog(LOG_INFO, "Caught signal, exiting");
+    if (signo == SIGHUP) {
+        // Data file was rotated: reopen it before the next append
+        reopen_requested = 1;
+    } else if (signo == SIGUSR1) {
+        // The housekeeper logs the counts: write() is async-signal-safe
+        stats_requested = 1;
+        if (housekeeper_fd != -1) {
+            uint64_t one = 1;
+            ssize_t ret = write(housekeeper_fd, &one, sizeof(one));
+            (void)ret;
+        }
+    } else if (signo == SIGINT || signo == SIGTERM) {
+        // Logged from cleanup_and_exit(): syslog() is not async-signal-safe
         caught_signal = 1;
         
         // Shutdown server socket to unblock accept()
@@ -133,7 +235,7 @@ void signal_handler(int signo)
 }
 
 /**
- * Setup signal handlers for SIGINT and SIGTERM
+ * Setup signal handlers for SIGINT, SIGTERM, SIGHUP and SIGUSR1
  */
 int setup_signal_handlers(void)
 {
@@ -143,6 +245,15 @@ int setup_signal_handlers(void)
     sigemptyset(&sa.sa_mask);
     sa.sa_flags = 0;
 
+    // sendfile() has no MSG_NOSIGNAL, a client closing mid-reply must not kill us
+    struct sigaction ignore;
+    memset(&ignore, 0, sizeof(ignore));
+    ignore.sa_handler = SIG_IGN;
+    if (sigaction(SIGPIPE, &ignore, NULL) == -1) {
+        perror("sigaction SIGPIPE");
+        return -1;
+    }
+
     if (sigaction(SIGINT, &sa, NULL) == -1) {
         perror("sigaction SIGINT");
         return -1;
@@ -153,9 +264,201 @@ int setup_signal_handlers(void)
         return -1;
     }
 
+    // Rotation must not interrupt blocking calls in the engines
+    sa.sa_flags = SA_RESTART;
+    if (sigaction(SIGHUP, &sa, NULL) == -1) {
+        perror("sigaction SIGHUP");
+        return -1;
+    }
+
+    if (sigaction(SIGUSR1, &sa, NULL) == -1) {
+        perror("sigaction SIGUSR1");
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Called by a connection thread as its last step: close the client socket
+ * unless it was handed over (@param close_socket false) and queue the
+ * thread for the housekeeper to join
+ */
+static void thread_finished(thread_data_t *thread_data, bool close_socket)
+{
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&thread_list_mutex);
+    LIST_REMOVE(thread_data, entries);
+    active_connections--;
+    // Closed under the lock so shutdown in cleanup_and_exit() cannot hit a reused fd
+    if (close_socket) {
+        close(thread_data->client_fd);
+    }
+    STAILQ_INSERT_TAIL(&finished_threads, thread_data, finished_entries);
+    if (LIST_EMPTY(&thread_list_head)) {
+        pthread_cond_broadcast(&threads_done);
+    }
+    pthread_mutex_unlock(&thread_list_mutex);
+
+    if (write(housekeeper_fd, &one, sizeof(one)) == -1) {
+        syslog(LOG_ERR, "Failed to wake housekeeper: %s", strerror(errno));
+    }
+}
+
+/**
+ * Log the open connection, thread and descriptor counts and resident memory
+ */
+static void log_server_stats(void)
+{
+    char line[256];
+    long rss_kb = -1;
+    long threads = -1;
+    int fds = -1;
+
+    FILE *status = fopen("/proc/self/status", "r");
+    if (status != NULL) {
+        while (fgets(line, sizeof(line), status) != NULL) {
+            sscanf(line, "VmRSS: %ld", &rss_kb);
+            sscanf(line, "Threads: %ld", &threads);
+        }
+        fclose(status);
+    }
+
+    DIR *fd_dir = opendir("/proc/self/fd");
+    if (fd_dir != NULL) {
+        struct dirent *entry;
+        fds = 0;
+        while ((entry = readdir(fd_dir)) != NULL) {
+            if (entry->d_name[0] != '.') {
+                fds++;
+            }
+        }
+        // Not counting the descriptor used to list them
+        fds--;
+        closedir(fd_dir);
+    }
+
+    pthread_mutex_lock(&thread_list_mutex);
+    unsigned long active = active_connections;
+    unsigned long reaped = reaped_connections;
+    pthread_mutex_unlock(&thread_list_mutex);
+
+    syslog(LOG_INFO, "Stats: %lu connection threads, %lu reaped, %ld threads, %d fds, %ld kB resident",
+           active, reaped, threads, fds, rss_kb);
+}
+
+/**
+ * Housekeeper thread: appends a timestamp whenever the timer expires and
+ * joins finished connection threads as soon as they exit, freeing their
+ * stacks without waiting for the next accept()
+ */
+static void *housekeeper_run(void *arg)
+{
+    struct pollfd fds[2] = {
+        { .fd = housekeeper_fd, .events = POLLIN },
+        { .fd = timer_fd, .events = POLLIN },
+    };
+
+    (void)arg;
+
+    for (;;) {
+        if (poll(fds, 2, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            syslog(LOG_ERR, "Failed to wait for housekeeping: %s", strerror(errno));
+            break;
+        }
+
+        if (fds[1].revents & POLLIN) {
+            timer_handler();
+        }
+        if (!(fds[0].revents & POLLIN)) {
+            continue;
+        }
+
+        uint64_t count;
+        if (read(housekeeper_fd, &count, sizeof(count)) == -1 && errno != EINTR) {
+            syslog(LOG_ERR, "Failed to wait for finished threads: %s", strerror(errno));
+            break;
+        }
+
+        pthread_mutex_lock(&thread_list_mutex);
+        while (!STAILQ_EMPTY(&finished_threads)) {
+            thread_data_t *thread_item = STAILQ_FIRST(&finished_threads);
+            STAILQ_REMOVE_HEAD(&finished_threads, finished_entries);
+            pthread_mutex_unlock(&thread_list_mutex);
+
+            pthread_join(thread_item->thread_id, NULL);
+            free(thread_item);
+
+            pthread_mutex_lock(&thread_list_mutex);
+            reaped_connections++;
+        }
+        bool stopping = housekeeper_stopping;
+        pthread_mutex_unlock(&thread_list_mutex);
+
+        if (stats_requested) {
+            stats_requested = 0;
+            log_server_stats();
+        }
+        if (stopping) {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Start the housekeeper thread
+ * @return 0 on success, -1 on failure
+ */
+static int housekeeper_start(void)
+{
+    housekeeper_fd = eventfd(0, EFD_CLOEXEC);
+    if (housekeeper_fd == -1) {
+        syslog(LOG_ERR, "Failed to create eventfd: %s", strerror(errno));
+        return -1;
+    }
+
+    if (pthread_create(&housekeeper_thread, NULL, housekeeper_run, NULL) != 0) {
+        syslog(LOG_ERR, "Failed to create housekeeper thread");
+        close(housekeeper_fd);
+        housekeeper_fd = -1;
+        return -1;
+    }
+
     return 0;
 }
 
+/**
+ * Join whatever has finished and stop the housekeeper thread
+ */
+static void housekeeper_stop(void)
+{
+    uint64_t one = 1;
+
+    if (housekeeper_fd == -1) {
+        return;
+    }
+
+    pthread_mutex_lock(&thread_list_mutex);
+    housekeeper_stopping = true;
+    pthread_mutex_unlock(&thread_list_mutex);
+
+    if (write(housekeeper_fd, &one, sizeof(one)) == -1) {
+        syslog(LOG_ERR, "Failed to wake housekeeper: %s", strerror(errno));
+    }
+    pthread_join(housekeeper_thread, NULL);
+
+    // The signal handler may still write to it until closed
+    int fd = housekeeper_fd;
+    housekeeper_fd = -1;
+    close(fd);
+}
+
 /**
  * Cleanup resources and exit
  */
@@ -163,86 +466,261 @@ void cleanup_and_exit(void)
 {
     thread_data_t *thread_item;
     
+    if (caught_signal) {
+        syslog(LOG_INFO, "Caught signal, exiting");
+    }
+    
     // Stop timer
-    timer_delete(timerid);
+    if (timer_fd != -1) {
+        struct itimerspec disarm = {0};
+        timerfd_settime(timer_fd, 0, &disarm, NULL);
+    }
     
-    // Join all threads
+    // Wake every connection thread and wait for all of them to finish;
+    // the housekeeper joins them as they do
     pthread_mutex_lock(&thread_list_mutex);
-    SLIST_FOREACH(thread_item, &thread_list_head, entries) {
-        if (!thread_item->thread_complete) {
-            shutdown(thread_item->client_fd, SHUT_RDWR);
-        }
+    LIST_FOREACH(thread_item, &thread_list_head, entries) {
+        shutdown(thread_item->client_fd, SHUT_RDWR);
+    }
+    while (!LIST_EMPTY(&thread_list_head)) {
+        pthread_cond_wait(&threads_done, &thread_list_mutex);
     }
     pthread_mutex_unlock(&thread_list_mutex);
     
-    // Wait for all threads to complete
-    pthread_mutex_lock(&thread_list_mutex);
-    while (!SLIST_EMPTY(&thread_list_head)) {
-        thread_item = SLIST_FIRST(&thread_list_head);
-        pthread_mutex_unlock(&thread_list_mutex);
-        
-        pthread_join(thread_item->thread_id, NULL);
-        
-        pthread_mutex_lock(&thread_list_mutex);
-        SLIST_REMOVE_HEAD(&thread_list_head, entries);
-        close(thread_item->client_fd);
-        free(thread_item);
+    housekeeper_stop();
+    if (timer_fd != -1) {
+        close(timer_fd);
+        timer_fd = -1;
     }
-    pthread_mutex_unlock(&thread_list_mutex);
     
     if (server_fd != -1) {
         close(server_fd);
         server_fd = -1;
     }
     
-    // Delete the data file
-    unlink(DATA_FILE);
+    // Commit anything still queued before the file goes away
+    log_writer_stop();
+    subscribe_stop();
+    
+    // Delete the data file, unless it is to be kept for the next run
+    if (storage->remove != NULL && !config.persistent) {
+        storage->remove();
+    }
+    data_file_close();
     
-    pthread_mutex_destroy(&file_mutex);
     pthread_mutex_destroy(&thread_list_mutex);
+    pthread_cond_destroy(&threads_done);
     
     closelog();
 }
 
 /**
- * Send the contents of the data file to the client
+ * Send @param len bytes from @param buf, advancing *offset by as many as
+ * the socket took
  */
-int send_file_to_client(int client_socket)
+static int send_chunk(int client_socket, const char *buf, size_t len, off_t *offset)
 {
-    pthread_mutex_lock(&file_mutex);
-    
-    FILE *fp = fopen(DATA_FILE, "r");
-    if (fp == NULL) {
-        syslog(LOG_ERR, "Failed to open %s: %s", DATA_FILE, strerror(errno));
-        pthread_mutex_unlock(&file_mutex);
+    ssize_t bytes_sent;
+
+    while ((bytes_sent = send(client_socket, buf, len, 0)) == -1 && errno == EINTR) {
+        // Retry
+    }
+    if (bytes_sent == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 1;
+        }
+        syslog(LOG_ERR, "Failed to send data: %s", strerror(errno));
         return -1;
     }
+    *offset += bytes_sent;
+    return 0;
+}
 
-    char buffer[BUFFER_SIZE];
-    size_t bytes_read;
-    
-    while ((bytes_read = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
-        ssize_t bytes_sent = 0;
-        ssize_t total_sent = 0;
-        
-        while (total_sent < bytes_read) {
-            bytes_sent = send(client_socket, buffer + total_sent, 
-                            bytes_read - total_sent, 0);
-            if (bytes_sent == -1) {
-                syslog(LOG_ERR, "Failed to send data: %s", strerror(errno));
-                fclose(fp);
-                pthread_mutex_unlock(&file_mutex);
-                return -1;
+/**
+ * Send the next chunk of [*offset, *end) copied out of the store,
+ * advancing *offset. The bytes are copied out first, as a store keeping
+ * only recent records may overwrite them meanwhile.
+ */
+static int send_read_chunk(int client_socket, off_t *offset, off_t *end)
+{
+    char buf[STORAGE_COPY_SIZE];
+
+    ssize_t len = storage->read(offset, end, buf, sizeof(buf));
+    if (len <= 0) {
+        return len;
+    }
+    return send_chunk(client_socket, buf, len, offset);
+}
+
+int reply_codec_start(struct reply_codec *codec, int client_socket)
+{
+    struct lz_frame_header ack = {0};
+    int one = 1;
+
+    if (codec->frame == NULL && (codec->frame = malloc(LZ_FRAME_MAX)) == NULL) {
+        syslog(LOG_ERR, "Failed to allocate reply frame: %s", strerror(errno));
+        return -1;
+    }
+    // Frames are whole blocks already, so as with batched replies Nagle
+    // would only hold back the last one of each reply
+    if (setsockopt(client_socket, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) == -1) {
+        syslog(LOG_ERR, "Failed to set socket options: %s", strerror(errno));
+        return -1;
+    }
+    memcpy(codec->frame, &ack, sizeof(ack));
+    codec->frame_len = sizeof(ack);
+    codec->frame_sent = 0;
+    codec->enabled = true;
+    return 0;
+}
+
+void reply_codec_release(struct reply_codec *codec)
+{
+    free(codec->frame);
+    memset(codec, 0, sizeof(*codec));
+}
+
+ssize_t reply_frame_next(off_t *offset, off_t *end, char *frame, size_t raw_max)
+{
+    char raw[LZ_BLOCK_SIZE];
+
+    ssize_t len = storage->read(offset, end, raw, raw_max < sizeof(raw) ? raw_max : sizeof(raw));
+    if (len <= 0) {
+        return len;
+    }
+    *offset += len;
+    return lz_frame_encode(raw, len, frame);
+}
+
+/**
+ * Send [*offset, *end) as compressed frames, finishing the frame a full
+ * socket interrupted first. Frames are cut a block at a time, so *offset
+ * runs up to a block ahead of what the client has received.
+ */
+static int send_frames(int client_socket, off_t *offset, off_t *end, struct reply_codec *codec)
+{
+    for (;;) {
+        if (codec->frame_sent == codec->frame_len) {
+            ssize_t frame_len = reply_frame_next(offset, end, codec->frame, LZ_BLOCK_SIZE);
+            codec->frame_len = frame_len > 0 ? (size_t)frame_len : 0;
+            codec->frame_sent = 0;
+            if (frame_len <= 0) {
+                return frame_len;
+            }
+        }
+
+        ssize_t bytes_sent = send(client_socket, codec->frame + codec->frame_sent,
+                                  codec->frame_len - codec->frame_sent, 0);
+        if (bytes_sent == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 1;
+            }
+            if (errno == EINTR) {
+                continue;
             }
-            total_sent += bytes_sent;
+            syslog(LOG_ERR, "Failed to send data: %s", strerror(errno));
+            return -1;
         }
+        codec->frame_sent += bytes_sent;
     }
-    
-    fclose(fp);
-    pthread_mutex_unlock(&file_mutex);
+}
+
+/**
+ * Send [*offset, *end) of the store with sendfile(), advancing *offset.
+ * Each call sends from one descriptor, so a range spanning several
+ * segment files goes out one segment at a time.
+ */
+int send_file_range(int client_socket, off_t *offset, off_t *end, struct reply_codec *codec)
+{
+    if (*offset > *end) {
+        *offset = 0;
+    }
+    if (codec != NULL && codec->enabled) {
+        return send_frames(client_socket, offset, end, codec);
+    }
+
+    while (*offset < *end) {
+        off_t file_pos;
+        size_t len;
+
+        // Straight from memory the store holds the bytes in, if it does
+        const char *held = storage->get_mem != NULL ? storage->get_mem(offset, end, &len) : NULL;
+        if (held != NULL) {
+            off_t chunk_start = *offset;
+            int ret = send_chunk(client_socket, held, len, offset);
+            storage->put_mem(held);
+            if (ret != 0 || *offset == chunk_start) {
+                return ret;
+            }
+            continue;
+        }
+
+        int data_fd = storage->get_fd(offset, end, &file_pos, &len);
+        if (data_fd == -1) {
+            // Only this chunk: the bytes after it may have a descriptor
+            off_t chunk_start = *offset;
+            int ret = send_read_chunk(client_socket, offset, end);
+            if (ret != 0 || *offset == chunk_start) {
+                return ret;
+            }
+            continue;
+        }
+        if (len == 0) {
+            // *offset moved up to *end: nothing is left to send
+            storage->put_fd(data_fd);
+            break;
+        }
+
+        ssize_t bytes_sent = sendfile(client_socket, data_fd, &file_pos, len);
+        storage->put_fd(data_fd);
+        if (bytes_sent == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 1;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            syslog(LOG_ERR, "Failed to send data: %s", strerror(errno));
+            return -1;
+        }
+        if (bytes_sent == 0) {
+            syslog(LOG_ERR, "Failed to send data: %s shorter than expected", config.storage_path);
+            return -1;
+        }
+        *offset += bytes_sent;
+    }
+
     return 0;
 }
 
+/**
+ * Start of the next reply to a client after one ending at @param end.
+ * Replies are sent without any lock: bytes below a committed length never
+ * change, so a slow client does not hold up appends.
+ */
+off_t reply_next_start(off_t end)
+{
+    return config.delta_replies ? end : 0;
+}
+
+/**
+ * Look up the reply to a seek command in the record index
+ */
+off_t seekto_reply_start(const struct aesd_seekto *seekto, off_t *end)
+{
+    off_t start;
+
+    if (data_file_seek(seekto->write_cmd, seekto->write_cmd_offset, &start) == -1) {
+        syslog(LOG_WARNING, "Seek to record %u offset %u is out of range",
+               seekto->write_cmd, seekto->write_cmd_offset);
+        *end = data_file_length();
+        return *end;
+    }
+    // Read after the lookup, so the reply covers the record sought
+    *end = data_file_length();
+    return start;
+}
+
 /**
  * Handle a client connection (thread function)
  */
@@ -257,15 +735,20 @@ void *handle_client(void *arg)
     
     syslog(LOG_INFO, "Accepted connection from %s", client_ip);
     
-    char *buffer = NULL;
-    size_t buffer_size = 0;
-    size_t buffer_used = 0;
-    char recv_buffer[BUFFER_SIZE];
+    struct recv_buffer rx = {0};
+    struct reply_codec codec = {0};
+    off_t reply_pos = 0;
     ssize_t bytes_received;
     
     // Receive data until connection closes
     while (!caught_signal) {
-        bytes_received = recv(client_socket, recv_buffer, sizeof(recv_buffer), 0);
+        size_t space;
+        char *recv_pos = recv_buffer_reserve(&rx, BUFFER_SIZE, &space);
+        if (recv_pos == NULL) {
+            break;
+        }
+
+        bytes_received = recv(client_socket, recv_pos, space, 0);
         
         if (bytes_received < 0) {
             syslog(LOG_ERR, "Failed to receive data: %s", strerror(errno));
@@ -274,62 +757,82 @@ void *handle_client(void *arg)
             // Connection closed by client
             break;
         }
-        
-        // Expand buffer if needed
-        if (buffer_used + bytes_received > buffer_size) {
-            size_t new_size = buffer_size + BUFFER_SIZE;
-            char *new_buffer = realloc(buffer, new_size);
-            if (new_buffer == NULL) {
-                syslog(LOG_ERR, "Failed to allocate memory: %s", strerror(errno));
-                break;
-            }
-            buffer = new_buffer;
-            buffer_size = new_size;
+        if (recv_buffer_produce(&rx, bytes_received) == -1) {
+            break;
         }
         
-        // Copy received data to buffer
-        memcpy(buffer + buffer_used, recv_buffer, bytes_received);
-        buffer_used += bytes_received;
-        
-        // Check for newline character - process all complete packets
-        char *newline_pos;
-        while ((newline_pos = memchr(buffer, '\n', buffer_used)) != NULL) {
-            // Calculate packet size including newline
-            size_t packet_size = newline_pos - buffer + 1;
+        // Process all complete packets
+        const char *packet;
+        size_t packet_size;
+        while ((packet = recv_buffer_next_packet(&rx, &packet_size)) != NULL) {
+            if (recv_buffer_packet_is(&rx, packet, packet_size, SUBSCRIBE_COMMAND)) {
+                // Anything sent after the command is ignored from now on
+                recv_buffer_release(&rx);
+                thread_finished(thread_data, false);
+                subscribe_follow(client_socket, client_ip, data_file_length(), codec.enabled);
+                reply_codec_release(&codec);
+                return NULL;
+            }
+
+            if (recv_buffer_packet_is(&rx, packet, packet_size, COMPRESS_COMMAND)) {
+                off_t ack_pos = 0;
+                off_t ack_end = 0;
+                if (reply_codec_start(&codec, client_socket) == -1 ||
+                    send_file_range(client_socket, &ack_pos, &ack_end, &codec) == -1) {
+                    recv_buffer_release(&rx);
+                    reply_codec_release(&codec);
+                    syslog(LOG_INFO, "Closed connection from %s", client_ip);
+                    thread_finished(thread_data, true);
+                    return NULL;
+                }
+                recv_buffer_consume(&rx, packet_size);
+                continue;
+            }
             
-            // Write packet to file with mutex protection
-            pthread_mutex_lock(&file_mutex);
-            FILE *fp = fopen(DATA_FILE, "a");
-            if (fp != NULL) {
-                size_t written = fwrite(buffer, 1, packet_size, fp);
-                if (written != packet_size) {
-                    syslog(LOG_ERR, "Failed to write to file: %s", strerror(errno));
+            // A seek is answered from the record index and not appended
+            struct aesd_seekto seekto;
+            if (recv_buffer_parse_seekto(&rx, packet, packet_size, &seekto)) {
+                off_t seek_end;
+                off_t seek_pos = seekto_reply_start(&seekto, &seek_end);
+                if (send_file_range(client_socket, &seek_pos, &seek_end, &codec) == -1) {
+                    recv_buffer_release(&rx);
+                    reply_codec_release(&codec);
+                    syslog(LOG_INFO, "Closed connection from %s", client_ip);
+                    thread_finished(thread_data, true);
+                    return NULL;
                 }
-                fclose(fp);
-            } else {
-                syslog(LOG_ERR, "Failed to open %s: %s", DATA_FILE, strerror(errno));
+                reply_pos = reply_next_start(seek_end);
+                recv_buffer_consume(&rx, packet_size);
+                continue;
             }
-            pthread_mutex_unlock(&file_mutex);
             
-            // Send file content back to client
-            if (send_file_to_client(client_socket) == -1) {
-                free(buffer);
+            // Write packet (and any start of it staged in a file) to the
+            // data file, remembering the length it committed
+            struct log_record record = {
+                .data = packet,
+                .len = packet_size,
+            };
+            record.spill_fd = recv_buffer_take_spill(&rx, &record.spill_len);
+            off_t file_len = log_submit_wait(&record) == 0 ? record.end : data_file_length();
+            
+            // Send file content up to and including this packet back to client
+            if (send_file_range(client_socket, &reply_pos, &file_len, &codec) == -1) {
+                recv_buffer_release(&rx);
+                reply_codec_release(&codec);
                 syslog(LOG_INFO, "Closed connection from %s", client_ip);
-                thread_data->thread_complete = true;
+                thread_finished(thread_data, true);
                 return NULL;
             }
             
-            // Move remaining data to beginning of buffer
-            buffer_used -= packet_size;
-            if (buffer_used > 0) {
-                memmove(buffer, buffer + packet_size, buffer_used);
-            }
+            reply_pos = reply_next_start(file_len);
+            recv_buffer_consume(&rx, packet_size);
         }
     }
     
-    free(buffer);
+    recv_buffer_release(&rx);
+    reply_codec_release(&codec);
     syslog(LOG_INFO, "Closed connection from %s", client_ip);
-    thread_data->thread_complete = true;
+    thread_finished(thread_data, true);
     
     return NULL;
 }
@@ -376,6 +879,144 @@ int daemonize(void)
     return 0;
 }
 
+/**
+ * Parse a decimal option argument no larger than @param max
+ * @return 0 with the number stored in @param value, or -1 if the argument
+ * is not such a number
+ */
+int parse_number(const char *arg, unsigned long long max, unsigned long long *value)
+{
+    char *end;
+
+    // strtoull() would take leading blanks and a minus sign
+    if (*arg < '0' || *arg > '9') {
+        return -1;
+    }
+    errno = 0;
+    unsigned long long number = strtoull(arg, &end, 10);
+    if (errno == ERANGE || *end != '\0' || number > max) {
+        return -1;
+    }
+    *value = number;
+    return 0;
+}
+
+/**
+ * Parse the -s argument: file[:path], segments[:bytes], device[:path] or
+ * ring[:records]
+ * @return 0 on success, -1 if the argument is not understood
+ */
+int parse_storage(const char *arg)
+{
+    unsigned long long number;
+
+    if (strncmp(arg, "file", 4) == 0 && (arg[4] == '\0' || arg[4] == ':')) {
+        config.storage = STORAGE_FILE;
+        config.storage_path = arg[4] == ':' ? arg + 5 : DATA_FILE;
+        return *config.storage_path != '\0' ? 0 : -1;
+    }
+    if (strncmp(arg, "segments", 8) == 0 && (arg[8] == '\0' || arg[8] == ':')) {
+        config.storage = STORAGE_SEGMENTS;
+        config.storage_path = DATA_FILE;
+        if (arg[8] == ':') {
+            if (parse_number(arg + 9, SIZE_MAX, &number) == -1 || number == 0) {
+                return -1;
+            }
+            config.segment_bytes = number;
+        }
+        return 0;
+    }
+    if (strncmp(arg, "device", 6) == 0 && (arg[6] == '\0' || arg[6] == ':')) {
+        config.storage = STORAGE_DEVICE;
+        config.storage_path = arg[6] == ':' ? arg + 7 : AESD_DEVICE;
+        return *config.storage_path != '\0' ? 0 : -1;
+    }
+    if (strncmp(arg, "ring", 4) != 0 || (arg[4] != '\0' && arg[4] != ':')) {
+        return -1;
+    }
+
+    config.storage = STORAGE_RING;
+    config.storage_path = "memory";
+    if (arg[4] == ':') {
+        if (parse_number(arg + 5, UINT_MAX, &number) == -1 || number == 0) {
+            return -1;
+        }
+        config.ring_records = number;
+    }
+    return 0;
+}
+
+/**
+ * Parse one -k argument: bytes:N, records:N or age:SECONDS
+ * @return 0 on success, -1 if the argument is not understood
+ */
+int parse_retention(const char *arg)
+{
+    const char *value = strchr(arg, ':');
+    unsigned long long limit;
+
+    if (value == NULL || parse_number(value + 1, SIZE_MAX, &limit) == -1 || limit == 0) {
+        return -1;
+    }
+
+    if (strncmp(arg, "bytes:", 6) == 0) {
+        config.retain_bytes = limit;
+    } else if (strncmp(arg, "records:", 8) == 0) {
+        config.retain_records = limit;
+    } else if (strncmp(arg, "age:", 4) == 0 && limit <= UINT_MAX) {
+        config.retain_seconds = limit;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Parse the -f argument: none, record, or group[:records[:usec]]
+ * @return 0 on success, -1 if the argument is not understood
+ */
+int parse_durability(const char *arg)
+{
+    unsigned long long number;
+
+    if (strcmp(arg, "none") == 0) {
+        config.durability = DURABILITY_NONE;
+        return 0;
+    }
+    if (strcmp(arg, "record") == 0) {
+        config.durability = DURABILITY_RECORD;
+        return 0;
+    }
+    if (strncmp(arg, "group", 5) != 0 || (arg[5] != '\0' && arg[5] != ':')) {
+        return -1;
+    }
+
+    config.durability = DURABILITY_GROUP;
+    if (arg[5] == ':') {
+        // Room for any number that fits, so a longer one is rejected anyway
+        char records_arg[24];
+        const char *usec_arg = strchr(arg + 6, ':');
+        size_t records_len = usec_arg != NULL ? (size_t)(usec_arg - (arg + 6)) : strlen(arg + 6);
+
+        if (records_len >= sizeof(records_arg)) {
+            return -1;
+        }
+        memcpy(records_arg, arg + 6, records_len);
+        records_arg[records_len] = '\0';
+        if (parse_number(records_arg, UINT_MAX, &number) == -1 || number == 0) {
+            return -1;
+        }
+        config.group_records = number;
+        if (usec_arg != NULL) {
+            if (parse_number(usec_arg + 1, UINT_MAX, &number) == -1) {
+                return -1;
+            }
+            config.group_usec = number;
+        }
+    }
+    return 0;
+}
+
 int main(int argc, char *argv[])
 {
     bool daemon_mode = false;
@@ -383,25 +1024,191 @@ int main(int argc, char *argv[])
     struct sockaddr_in server_addr, client_addr;
     socklen_t client_addr_len;
     int reuse = 1;
+    unsigned long long number;
     
-    // Initialize thread list
-    SLIST_INIT(&thread_list_head);
+    // Initialize thread lists
+    LIST_INIT(&thread_list_head);
+    STAILQ_INIT(&finished_threads);
     
     // Open syslog
     openlog("aesdsocket", LOG_PID | LOG_CONS, LOG_USER);
     
     // Parse command line arguments
-    while ((opt = getopt(argc, argv, "d")) != -1) {
+    while ((opt = getopt(argc, argv, "a:b:df:ik:m:M:pPq:rs:t:wz")) != -1) {
         switch (opt) {
+            case 'a':
+                if (parse_number(optarg, SIZE_MAX, &number) == -1) {
+                    fprintf(stderr, "Invalid extent size: %s\n", optarg);
+                    closelog();
+                    return -1;
+                }
+                config.prealloc_bytes = number;
+                break;
+            case 'b':
+                if (parse_number(optarg, SIZE_MAX, &number) == -1) {
+                    fprintf(stderr, "Invalid spill threshold: %s\n", optarg);
+                    closelog();
+                    return -1;
+                }
+                config.spill_threshold = number;
+                break;
             case 'd':
                 daemon_mode = true;
                 break;
+            case 'f':
+                if (parse_durability(optarg) == -1) {
+                    fprintf(stderr, "Unknown durability mode: %s\n", optarg);
+                    closelog();
+                    return -1;
+                }
+                break;
+            case 'i':
+                config.delta_replies = true;
+                break;
+            case 'k':
+                if (parse_retention(optarg) == -1) {
+                    fprintf(stderr, "Unknown retention: %s\n", optarg);
+                    closelog();
+                    return -1;
+                }
+                break;
+            case 'm':
+                if (strcmp(optarg, "thread") == 0) {
+                    config.engine = ENGINE_THREAD;
+                } else if (strcmp(optarg, "epoll") == 0) {
+                    config.engine = ENGINE_EPOLL;
+                } else if (strcmp(optarg, "uring") == 0) {
+                    config.engine = ENGINE_URING;
+                } else if (strcmp(optarg, "pool") == 0) {
+                    config.engine = ENGINE_POOL;
+                } else {
+                    fprintf(stderr, "Unknown engine: %s\n", optarg);
+                    closelog();
+                    return -1;
+                }
+                break;
+            case 'M':
+                if (parse_number(optarg, SIZE_MAX, &number) == -1) {
+                    fprintf(stderr, "Invalid mirror size: %s\n", optarg);
+                    closelog();
+                    return -1;
+                }
+                config.mirror_bytes = number;
+                break;
+            case 'p':
+                config.batch_packets = true;
+                break;
+            case 'P':
+                config.persistent = true;
+                break;
+            case 'q':
+                if (parse_number(optarg, INT_MAX, &number) == -1) {
+                    fprintf(stderr, "Invalid backlog: %s\n", optarg);
+                    closelog();
+                    return -1;
+                }
+                config.listen_backlog = (int)number;
+                break;
+            case 'r':
+                config.reuseport_shards = true;
+                break;
+            case 's':
+                if (parse_storage(optarg) == -1) {
+                    fprintf(stderr, "Unknown storage: %s\n", optarg);
+                    closelog();
+                    return -1;
+                }
+                break;
+            case 't':
+                if (parse_number(optarg, INT_MAX, &number) == -1) {
+                    fprintf(stderr, "Invalid thread count: %s\n", optarg);
+                    closelog();
+                    return -1;
+                }
+                config.loop_threads = (int)number;
+                break;
+            case 'w':
+                config.writer_thread = true;
+                break;
+            case 'z':
+                config.compress_segments = true;
+                break;
             default:
-                fprintf(stderr, "Usage: %s [-d]\n", argv[0]);
+                fprintf(stderr, "Usage: %s [-a extent_bytes] [-b spill_bytes] [-d] "
+                        "[-f none|record|group[:records[:usec]]] [-i] [-k bytes:N|records:N|age:seconds] "
+                        "[-m thread|epoll|uring|pool] [-M mirror_bytes] [-p] [-P] [-q backlog] [-r] "
+                        "[-s file[:path]|segments[:bytes]|device[:path]|ring[:records]] [-t threads] [-w] [-z]\n",
+                        argv[0]);
                 closelog();
                 return -1;
         }
     }
+
+    // Only the epoll engine runs one accepting loop per core
+    if (config.reuseport_shards && config.engine != ENGINE_EPOLL) {
+        fprintf(stderr, "-r requires -m epoll\n");
+        closelog();
+        return -1;
+    }
+    if (config.storage == STORAGE_SEGMENTS) {
+        storage = &segment_storage;
+    } else if (config.storage == STORAGE_DEVICE) {
+        storage = &device_storage;
+    } else if (config.storage == STORAGE_RING) {
+        storage = &ring_storage;
+    }
+    // Only files can be synced
+    if (storage->sync == NULL && config.durability != DURABILITY_NONE) {
+        fprintf(stderr, "-f requires -s file or -s segments\n");
+        closelog();
+        return -1;
+    }
+    // Only files outlive the server
+    if (config.persistent && config.storage != STORAGE_FILE && config.storage != STORAGE_SEGMENTS) {
+        fprintf(stderr, "-P requires -s file or -s segments\n");
+        closelog();
+        return -1;
+    }
+    // Only segments are ever dropped
+    if (config.storage != STORAGE_SEGMENTS &&
+        (config.retain_bytes > 0 || config.retain_records > 0 || config.retain_seconds > 0)) {
+        fprintf(stderr, "-k requires -s segments\n");
+        closelog();
+        return -1;
+    }
+    if (config.compress_segments && config.storage != STORAGE_SEGMENTS) {
+        fprintf(stderr, "-z requires -s segments\n");
+        closelog();
+        return -1;
+    }
+    if (config.mirror_bytes > 0 && config.storage != STORAGE_FILE) {
+        fprintf(stderr, "-M requires -s file\n");
+        closelog();
+        return -1;
+    }
+    if (config.mirror_bytes > 0 && config.mirror_bytes < MIRROR_CHUNK_SIZE) {
+        fprintf(stderr, "-M needs at least %d bytes, one mirror chunk\n", MIRROR_CHUNK_SIZE);
+        closelog();
+        return -1;
+    }
+    if (config.prealloc_bytes > 0 && config.storage != STORAGE_FILE) {
+        fprintf(stderr, "-a requires -s file\n");
+        closelog();
+        return -1;
+    }
+    if (config.listen_backlog <= 0) {
+        config.listen_backlog = SOMAXCONN;
+    }
+
+    // Group commit needs someone to gather the group: the writer thread
+    if (config.durability == DURABILITY_GROUP) {
+        config.writer_thread = true;
+    }
+
+    if (config.loop_threads <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        config.loop_threads = cpus > 0 ? (int)cpus : 1;
+    }
     
     // Setup signal handlers
     if (setup_signal_handlers() == -1) {
@@ -417,8 +1224,14 @@ int main(int argc, char *argv[])
         return -1;
     }
     
-    // Set socket options to reuse address
-    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) == -1) {
+    // Set socket options to reuse address, and port when sharding listeners.
+    // Batched replies are already coalesced, so accepted sockets inherit
+    // TCP_NODELAY rather than have Nagle hold back the tail of a reply.
+    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) == -1 ||
+        (config.reuseport_shards &&
+         setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) == -1) ||
+        (config.batch_packets &&
+         setsockopt(server_fd, IPPROTO_TCP, TCP_NODELAY, &reuse, sizeof(reuse)) == -1)) {
         syslog(LOG_ERR, "Failed to set socket options: %s", strerror(errno));
         close(server_fd);
         closelog();
@@ -447,20 +1260,62 @@ int main(int argc, char *argv[])
         }
     }
     
+    // Open the descriptors every engine appends through and replies from
+    if (data_file_open() == -1) {
+        close(server_fd);
+        closelog();
+        return -1;
+    }
+    
+    if (config.writer_thread && log_writer_start() == -1) {
+        data_file_close();
+        close(server_fd);
+        closelog();
+        return -1;
+    }
+    
     // Initialize timer for timestamps
     if (init_timer() == -1) {
+        log_writer_stop();
+        data_file_close();
         close(server_fd);
         closelog();
         return -1;
     }
     
+    // Append timestamps and join connection threads as they finish
+    if (housekeeper_start() == -1) {
+        cleanup_and_exit();
+        return -1;
+    }
+    
     // Listen for connections
-    if (listen(server_fd, 10) == -1) {
+    if (listen(server_fd, config.listen_backlog) == -1) {
         syslog(LOG_ERR, "Failed to listen: %s", strerror(errno));
         cleanup_and_exit();
         return -1;
     }
     
+    // Hand the listening socket to the event loop engine if requested
+    if (config.engine == ENGINE_EPOLL) {
+        int ret = epoll_engine_run();
+        cleanup_and_exit();
+        return ret;
+    }
+    if (config.engine == ENGINE_POOL) {
+        int ret = pool_engine_run();
+        cleanup_and_exit();
+        return ret;
+    }
+    if (config.engine == ENGINE_URING) {
+        int ret = uring_engine_run();
+        if (ret != URING_UNAVAILABLE) {
+            cleanup_and_exit();
+            return ret;
+        }
+        syslog(LOG_WARNING, "io_uring unavailable, using thread per connection");
+    }
+    
     // Accept connections in a loop
     while (!caught_signal) {
         client_addr_len = sizeof(client_addr);
@@ -484,34 +1339,22 @@ int main(int argc, char *argv[])
         
         thread_data->client_fd = client_fd;
         thread_data->client_addr = client_addr;
-        thread_data->thread_complete = false;
+        
+        // Register before the thread starts so it can always unlink itself
+        pthread_mutex_lock(&thread_list_mutex);
+        LIST_INSERT_HEAD(&thread_list_head, thread_data, entries);
+        active_connections++;
         
         // Create thread to handle client
         if (pthread_create(&thread_data->thread_id, NULL, handle_client, thread_data) != 0) {
             syslog(LOG_ERR, "Failed to create thread: %s", strerror(errno));
+            LIST_REMOVE(thread_data, entries);
+            active_connections--;
+            pthread_mutex_unlock(&thread_list_mutex);
             close(client_fd);
             free(thread_data);
             continue;
         }
-        
-        // Add thread to list
-        pthread_mutex_lock(&thread_list_mutex);
-        SLIST_INSERT_HEAD(&thread_list_head, thread_data, entries);
-        pthread_mutex_unlock(&thread_list_mutex);
-        
-        // Clean up completed threads
-        pthread_mutex_lock(&thread_list_mutex);
-        thread_data_t *thread_item = SLIST_FIRST(&thread_list_head);
-        while (thread_item != NULL) {
-            thread_data_t *next = SLIST_NEXT(thread_item, entries);
-            if (thread_item->thread_complete) {
-                pthread_join(thread_item->thread_id, NULL);
-                SLIST_REMOVE(&thread_list_head, thread_item, thread_data, entries);
-                close(thread_item->client_fd);
-                free(thread_item);
-            }
-            thread_item = next;
-        }
         pthread_mutex_unlock(&thread_list_mutex);
     }
     
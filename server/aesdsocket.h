@@ -0,0 +1,630 @@
+/**
+ * @file aesdsocket.h
+ * @brief Shared declarations for the aesdsocket server
+ *
+ * The server core (aesdsocket.c) owns the listening socket, the data file
+ * and signal handling. Connection engines (thread-per-connection, epoll,
+ * io_uring, worker pool) use the helpers declared here so the wire protocol stays
+ * identical regardless of which engine is selected at startup.
+ * Subscribed clients are handed from the engines to the fan-out thread
+ * in subscribe.c. Records are kept by the store selected with -s: the
+ * data file (file_storage.c), a chain of fixed-size segment files
+ * (segment_storage.c), an aesdchar device (device_storage.c) or an
+ * in-memory circular buffer (circular_buffer.c), all behind struct
+ * storage_ops.
+ */
+
+#ifndef AESDSOCKET_H
+#define AESDSOCKET_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#define PORT 9000
+#define DATA_FILE "/var/tmp/aesdsocketdata"
+#define AESD_DEVICE "/dev/aesdchar"
+// Where oversized partial packets are staged, next to the data file
+#define SPILL_DIR "/var/tmp"
+#define BUFFER_SIZE 1024
+#define TIMESTAMP_INTERVAL 10
+
+// Packets starting with COMMAND_PREFIX may be commands rather than data
+#define COMMAND_PREFIX "AESDCHAR_"
+// Follow the data file: every record committed afterwards is pushed
+#define SUBSCRIBE_COMMAND COMMAND_PREFIX "SUBSCRIBE\n"
+// Reply from byte Y of record (line) X on: AESDCHAR_IOCSEEKTO:X,Y
+#define SEEKTO_COMMAND COMMAND_PREFIX "IOCSEEKTO:"
+// Send every later reply as compressed frames (see lz.h), acknowledged
+// with an empty frame
+#define COMPRESS_COMMAND COMMAND_PREFIX "COMPRESS\n"
+
+// Arguments of a seek command, as for the aesdchar ioctl
+struct aesd_seekto {
+    uint32_t write_cmd;
+    uint32_t write_cmd_offset;
+};
+
+// Connection engine selected with -m
+enum server_engine {
+    ENGINE_THREAD,
+    ENGINE_EPOLL,
+    ENGINE_URING,
+    ENGINE_POOL,
+};
+
+// When appended records are forced to stable storage, selected with -f
+enum durability_mode {
+    DURABILITY_NONE,    // left to the page cache
+    DURABILITY_RECORD,  // fdatasync() after every record
+    DURABILITY_GROUP,   // one fdatasync() per group of records
+};
+
+// Where records are kept, selected with -s
+enum storage_backend {
+    STORAGE_FILE,     // appended to a regular file
+    STORAGE_SEGMENTS, // appended to a chain of segment files, old ones dropped
+    STORAGE_DEVICE,   // written to an aesdchar device
+    STORAGE_RING,     // only the most recent ones, in memory
+};
+
+// Records held with -s ring unless a count is given
+#define RING_RECORDS 10
+// Bytes a segment file fills up to with -s segments unless a size is given
+#define SEGMENT_BYTES (1024 * BUFFER_SIZE)
+// Bytes copied out per send from a store with no sendfile() descriptor
+#define STORAGE_COPY_SIZE (64 * BUFFER_SIZE)
+// The -M mirror is kept in chunks of one transparent huge page
+#define MIRROR_CHUNK_SIZE (2 * 1024 * 1024)
+
+// Records appended per writev(); the kernel rejects more than IOV_MAX
+#define WRITER_BATCH IOV_MAX
+
+// Group commit defaults: sync after this many records or this long
+#define GROUP_COMMIT_RECORDS 64
+#define GROUP_COMMIT_USEC 1000
+
+// Returned by uring_engine_run() when the kernel cannot run the engine
+#define URING_UNAVAILABLE 1
+
+// Runtime configuration parsed from the command line
+struct server_config {
+    enum server_engine engine;
+    int loop_threads;
+    bool writer_thread;
+    enum durability_mode durability;
+    unsigned int group_records;
+    unsigned int group_usec;
+    // Partial packets growing past this many bytes are staged in a file
+    // instead of memory; 0 keeps them in memory
+    size_t spill_threshold;
+    // Pending connection queue length for each listening socket
+    int listen_backlog;
+    // Give every epoll loop its own SO_REUSEPORT listener, pinned to a core
+    bool reuseport_shards;
+    // Reply with only the part of the data file the client has not been sent
+    bool delta_replies;
+    // Append every complete packet from one read as one record, one reply
+    bool batch_packets;
+    enum storage_backend storage;
+    // File or device the store keeps records in
+    const char *storage_path;
+    // Records the circular buffer holds with -s ring
+    unsigned int ring_records;
+    // Size a segment grows to before the next one starts, with -s segments
+    size_t segment_bytes;
+    // Retention with -s segments, set with -k: the oldest segment is
+    // dropped once the rest hold at least retain_bytes bytes or
+    // retain_records records, or once its newest record is retain_seconds
+    // old. 0 leaves that limit off.
+    size_t retain_bytes;
+    size_t retain_records;
+    unsigned int retain_seconds;
+    // Keep the store across restarts (-P) instead of deleting it at exit
+    bool persistent;
+    // Compress sealed segments in the background, with -z
+    bool compress_segments;
+    // Most memory the file store mirrors its newest bytes in, with -M,
+    // rounded up to whole MIRROR_CHUNK_SIZE chunks; 0 serves every reply
+    // from the file
+    size_t mirror_bytes;
+    // Extent the file store grows the data file by ahead of its records,
+    // with -a; 0 leaves appends to grow it
+    size_t prealloc_bytes;
+};
+
+extern struct server_config config;
+
+// Shared server state owned by aesdsocket.c
+extern int server_fd;
+extern volatile sig_atomic_t caught_signal;
+
+// Data file state owned by log_writer.c
+extern volatile sig_atomic_t reopen_requested;
+
+/**
+ * One record on its way into the data file. The submitter owns the
+ * memory until complete() runs; data must stay valid until then. Under a
+ * durability mode a record completes only once it is on stable storage.
+ */
+struct log_record {
+    struct log_record *next;
+    // When spill_len is non-zero the record is the first spill_len bytes
+    // of spill_fd followed by data; the log writer closes spill_fd
+    int spill_fd;
+    size_t spill_len;
+    const char *data;
+    size_t len;
+    // Filled in before completion
+    size_t end;
+    int status;
+    // Called once committed, on the writer thread when one is running
+    void (*complete)(struct log_record *record);
+};
+
+// log_submit() results
+#define LOG_QUEUED 0
+#define LOG_COMPLETED 1
+
+/**
+ * Where records are kept. Positions count bytes ever appended; a store
+ * that only keeps the most recent records holds the tail of them. Only
+ * whoever owns the append path (file_mutex or the writer thread) calls
+ * open, reopen, close, remove, append and sync; seek, read, get_fd and
+ * put_fd may be called from any thread, but only ever see committed bytes.
+ */
+struct storage_ops {
+    const char *name;
+    // Open the store; the length it already holds is stored in *len
+    int (*open)(size_t *len);
+    // Reopen after SIGHUP rotated the store away; NULL if it cannot be
+    int (*reopen)(size_t *len);
+    void (*close)(void);
+    // Delete what the store keeps on disk at shutdown, before close; NULL
+    // if it keeps nothing there
+    void (*remove)(void);
+    // Append a FIFO chain of count records at position start.
+    // Returns the bytes stored, a prefix of the chain; less only on error
+    size_t (*append)(const struct log_record *first, int count, size_t start);
+    // Make everything appended durable; NULL if nothing can be synced
+    int (*sync)(void);
+    // Find byte offset of record record among committed ones, see data_file_seek()
+    int (*seek)(unsigned int record, unsigned int offset, off_t *pos);
+    // Copy up to len bytes from *pos, but below *end, into buf. A position
+    // older than anything held moves up to the oldest byte held; if that
+    // passes *end too, *end moves up to the committed length, so a reply
+    // whose records are all gone carries the ones held now. Returns the
+    // bytes copied, 0 once *pos reaches *end, or -1 if the bytes could not
+    // be read, which ends the reply
+    ssize_t (*read)(off_t *pos, off_t *end, char *buf, size_t len);
+    // Descriptor the bytes from *pos can be sent from with sendfile() or
+    // splice(), with the file offset of *pos stored in *file_pos and how
+    // many bytes it holds from there, up to *end, in *len. *pos and *end
+    // move as for read. Returns -1, moving nothing, if the bytes must go
+    // through read; otherwise hand the descriptor back to put_fd once the
+    // kernel is done with it
+    int (*get_fd)(off_t *pos, off_t *end, off_t *file_pos, size_t *len);
+    void (*put_fd)(int fd);
+    // Memory the bytes from *pos can be sent from directly, with how many
+    // it holds from there, up to *end, in *len; tried before get_fd. *pos
+    // and *end move as for read. Returns NULL, moving nothing, if the
+    // bytes are not in memory; otherwise hand the memory back to put_mem
+    // once sent. NULL for stores that keep no such copy
+    const char *(*get_mem)(off_t *pos, off_t *end, size_t *len);
+    void (*put_mem)(const char *bytes);
+};
+
+extern const struct storage_ops file_storage;
+extern const struct storage_ops segment_storage;
+extern const struct storage_ops device_storage;
+extern const struct storage_ops ring_storage;
+
+// Store selected with -s, owned by aesdsocket.c
+extern const struct storage_ops *storage;
+
+/**
+ * Write a FIFO chain of at most WRITER_BATCH records to @param fd with
+ * writev(), staged starts included, stopping at the first error.
+ * @return bytes written
+ */
+size_t storage_write_records(int fd, const struct log_record *first, int count);
+
+// Set in index_entry.flags for lines starting with "timestamp:"
+#define INDEX_TIMESTAMP 0x1u
+
+/**
+ * One line of the data file in the sidecar index kept with -P: where it
+ * starts, its length, the CRC-32 of its bytes and INDEX_TIMESTAMP for
+ * timestamp lines
+ */
+struct index_entry {
+    uint64_t start;
+    uint64_t len;
+    uint32_t crc;
+    uint32_t flags;
+};
+
+/**
+ * Where each line of a store kept in files starts, for seek commands.
+ * Lines are added by whoever owns the append path and looked up under
+ * mutex; record numbers count from the oldest line not trimmed away.
+ * Lines a sidecar index held at startup are looked up in it directly and
+ * never trimmed. Initialize with RECORD_INDEX_INITIALIZER.
+ */
+struct record_index {
+    pthread_mutex_t mutex;
+    // Lines indexed before startup, mapped from the sidecar
+    const struct index_entry *persisted;
+    size_t persisted_count;
+    size_t *starts;
+    size_t head;
+    size_t count;
+    size_t capacity;
+    // Position after the last byte indexed
+    size_t len;
+    // Whether the byte at len starts a line
+    bool line_start;
+};
+
+#define RECORD_INDEX_INITIALIZER { .mutex = PTHREAD_MUTEX_INITIALIZER, .line_start = true }
+
+/**
+ * Empty the index; the next byte indexed is at position @param start
+ */
+void record_index_reset(struct record_index *index, size_t start);
+
+/**
+ * Start the index from the @param count lines of a mapped sidecar, which
+ * cover the first @param len bytes; @param entries must stay mapped until
+ * the index is reset or freed
+ */
+void record_index_preload(struct record_index *index, const struct index_entry *entries,
+                          size_t count, size_t len);
+
+/**
+ * Index the lines of a record appended in full at @param start
+ * @return the lines it holds
+ */
+size_t record_index_add(struct record_index *index, const struct log_record *record, size_t start);
+
+/**
+ * Index the first @param size bytes of @param fd, which follow whatever
+ * was indexed so far; @param name is for error messages
+ * @return the lines started in them, or -1 on failure
+ */
+ssize_t record_index_scan(struct record_index *index, int fd, size_t size, const char *name);
+
+/**
+ * Index the @param len bytes in @param buf, which follow whatever was
+ * indexed so far
+ * @return the lines started in them, or -1 on failure
+ */
+ssize_t record_index_scan_buffer(struct record_index *index, const char *buf, size_t len);
+
+/**
+ * Drop the lines starting before position @param pos
+ */
+void record_index_trim(struct record_index *index, size_t pos);
+
+/**
+ * Look up byte @param offset of line @param record among committed ones
+ * @return 0 with the position stored in @param pos, or -1 if there is no
+ * such byte
+ */
+int record_index_seek(struct record_index *index, unsigned int record, unsigned int offset,
+                      off_t *pos);
+
+/**
+ * Free the index, leaving it empty
+ */
+void record_index_free(struct record_index *index);
+
+/**
+ * Open the sidecar index of the data file for -P, repairing the data file
+ * first: lines past the last entry whose bytes still match its checksum
+ * are indexed anew, and a torn partial line at the end is truncated away.
+ * @param data_fd is read from, @param append_fd truncated, and the
+ * sidecar mapped into @param index, which is emptied before the old
+ * mapping is let go.
+ * @return the length of the data file kept, or -1 on failure
+ */
+ssize_t index_file_open(int data_fd, int append_fd, struct record_index *index);
+
+/**
+ * Add the lines of a record appended in full at @param start to the
+ * sidecar; written out by index_file_flush()
+ */
+void index_file_add(const struct log_record *record, size_t start);
+
+/**
+ * Write out the lines added since the last flush
+ */
+void index_file_flush(void);
+
+/**
+ * Close the sidecar and unmap it; the index it was mapped into must have
+ * been reset or freed
+ */
+void index_file_close(void);
+
+/**
+ * Start mirroring the file store's appends in memory for -M, or start
+ * over after rotation, from position @param start on
+ * @return 0 on success, -1 on failure
+ */
+int mirror_open(size_t start);
+
+/**
+ * Copy the first @param len bytes of a FIFO chain of @param count records
+ * appended at @param start to the mirror, and publish them. Called only
+ * by whoever owns the append path.
+ */
+void mirror_append(const struct log_record *first, int count, size_t start, size_t len);
+
+/**
+ * Lend the mirrored bytes from @param pos, up to @param end, with how
+ * many there are in @param len
+ * @return the bytes, to be handed back to mirror_put(), or NULL if
+ * @param pos is not mirrored
+ */
+const char *mirror_get(off_t pos, off_t end, size_t *len);
+
+void mirror_put(const char *bytes);
+
+/**
+ * Stop mirroring and unmap the mirror
+ */
+void mirror_close(void);
+
+/**
+ * Bytes received from one client that are not yet framed into packets.
+ * Zero-initialized means empty with nothing allocated.
+ */
+struct recv_buffer {
+    char *data;
+    size_t size;
+    size_t start;
+    size_t used;
+    // Bytes from start already known to hold no newline
+    size_t scanned;
+    // Earlier bytes of the current packet staged in a file
+    int spill_fd;
+    size_t spill_len;
+};
+
+/**
+ * Make room for at least @param min_space more bytes, growing the buffer
+ * geometrically if needed.
+ * @return where to receive into, with the room available stored in
+ * @param space, or NULL if memory ran out
+ */
+char *recv_buffer_reserve(struct recv_buffer *buf, size_t min_space, size_t *space);
+
+/**
+ * Account for @param len bytes received into the reserved space. A
+ * partial packet that grew past config.spill_threshold is moved out to a
+ * staging file.
+ * @return 0 on success, -1 if staging failed
+ */
+int recv_buffer_produce(struct recv_buffer *buf, size_t len);
+
+/**
+ * Find the oldest complete packet, scanning each byte only once. With -p
+ * every complete packet buffered is returned as one run instead, cut
+ * short before any packet starting with COMMAND_PREFIX, which is always
+ * returned on its own.
+ * @return the packet, with its length including the newline stored in
+ * @param packet_size, or NULL if no complete packet has arrived. The
+ * packet stays valid until the buffer is next reserved or consumed.
+ */
+const char *recv_buffer_next_packet(struct recv_buffer *buf, size_t *packet_size);
+
+/**
+ * @return true if the packet last returned by recv_buffer_next_packet()
+ * is exactly @param text
+ */
+bool recv_buffer_packet_is(const struct recv_buffer *buf, const char *packet,
+                           size_t packet_size, const char *text);
+
+/**
+ * Parse the packet last returned by recv_buffer_next_packet() as a seek
+ * command
+ * @return true if it is one, with its arguments stored in @param seekto
+ */
+bool recv_buffer_parse_seekto(const struct recv_buffer *buf, const char *packet,
+                              size_t packet_size, struct aesd_seekto *seekto);
+
+/**
+ * Hand over the staged start of the packet last returned by
+ * recv_buffer_next_packet(), to go in a log_record ahead of the packet
+ * bytes still in memory.
+ * @return the staging file, with its length stored in @param spill_len,
+ * or -1 with a length of 0 if nothing was staged
+ */
+int recv_buffer_take_spill(struct recv_buffer *buf, size_t *spill_len);
+
+/**
+ * Drop @param len bytes from the front, releasing memory once idle
+ */
+void recv_buffer_consume(struct recv_buffer *buf, size_t len);
+
+/**
+ * Free the buffer and any staging file and leave it empty
+ */
+void recv_buffer_release(struct recv_buffer *buf);
+
+/**
+ * Open the selected store
+ * @return 0 on success, -1 on failure
+ */
+int data_file_open(void);
+
+/**
+ * Close the selected store
+ */
+void data_file_close(void);
+
+/**
+ * Start the dedicated writer thread; records submitted afterwards are
+ * appended by it in batches
+ * @return 0 on success, -1 on failure
+ */
+int log_writer_start(void);
+
+/**
+ * Append everything still queued and stop the writer thread
+ */
+void log_writer_stop(void);
+
+/**
+ * @return true if records are appended asynchronously by the writer thread
+ */
+bool log_writer_running(void);
+
+/**
+ * Submit a record for appending.
+ * @return LOG_COMPLETED if it was appended before returning (complete()
+ * is not called), or LOG_QUEUED if complete() will be called once the
+ * writer thread has committed it
+ */
+int log_submit(struct log_record *record);
+
+/**
+ * Submit a record and wait until it is committed; end and status are
+ * filled in on return
+ * @return the record's status: 0 on success, -1 on failure
+ */
+int log_submit_wait(struct log_record *record);
+
+/**
+ * Append one newline terminated packet to the data file, waiting until it
+ * is committed.
+ * On success stores the committed file length after the append in
+ * @param file_len; replies for this packet cover exactly that prefix.
+ * @return 0 on success, -1 on failure
+ */
+int append_packet(const char *data, size_t len, size_t *file_len);
+
+/**
+ * Find byte @param offset of record @param record (both counted from 0,
+ * records being the lines of the data file) among committed records.
+ * With -s ring records are the writes held, counted from the oldest, and
+ * with -s segments the lines held, likewise.
+ * @return 0 with the file position stored in @param pos, or -1 if there
+ * is no such byte
+ */
+int data_file_seek(unsigned int record, unsigned int offset, off_t *pos);
+
+/**
+ * Committed length of the data file. Safe to call without any lock; the
+ * returned prefix of the file is immutable, and durable unless the
+ * durability mode is DURABILITY_NONE. With -s ring it counts every byte
+ * ever appended, of which the circular buffer holds the tail.
+ */
+size_t data_file_length(void);
+
+/**
+ * How replies to one client are encoded. Zero-initialized means they are
+ * sent as they are; once the client sent COMPRESS_COMMAND they go out as
+ * frames, the one being sent kept here until the socket takes all of it.
+ */
+struct reply_codec {
+    bool enabled;
+    // LZ_FRAME_MAX bytes, allocated when compression starts
+    char *frame;
+    size_t frame_len;
+    size_t frame_sent;
+};
+
+/**
+ * Switch @param client_socket to compressed replies, queueing the
+ * acknowledgement as the first frame; send_file_range() sends it even for
+ * an empty range
+ * @return 0 on success, -1 on failure
+ */
+int reply_codec_start(struct reply_codec *codec, int client_socket);
+
+/**
+ * Free the frame buffer and go back to uncompressed replies
+ */
+void reply_codec_release(struct reply_codec *codec);
+
+/**
+ * Copy the next at most @param raw_max bytes of [*offset, *end) out of
+ * the store into a frame in @param frame, LZ_FRAME_MAX bytes, advancing
+ * *offset past them. *offset and *end move as for storage_ops.read.
+ * @return the frame length, 0 once *offset reaches *end, or -1 if the
+ * store failed to read the bytes
+ */
+ssize_t reply_frame_next(off_t *offset, off_t *end, char *frame, size_t raw_max);
+
+/**
+ * Send bytes [*offset, *end) of the store to the client with sendfile(),
+ * or copied out with its read op if it has no descriptor for that,
+ * advancing *offset as bytes go out. An offset past *end means the file
+ * was rotated since the previous reply, which is then sent from the
+ * start. Stores that keep only recent records may move *end up, see
+ * storage_ops.read. With @param codec enabled (it may be NULL) the bytes
+ * go out as frames instead, *offset advancing as each one is cut.
+ * @return 0 when complete, 1 if a non-blocking socket is full, -1 on error
+ */
+int send_file_range(int client_socket, off_t *offset, off_t *end, struct reply_codec *codec);
+
+/**
+ * Where the next reply to a client starts once a reply ending at
+ * @param end has been sent: 0, or with -i @param end itself
+ */
+off_t reply_next_start(off_t end);
+
+/**
+ * Resolve a seek command into its reply: the data file from the requested
+ * byte to the committed end, stored in @param end. A seek past the
+ * committed records gets an empty reply.
+ * @return where the reply starts
+ */
+off_t seekto_reply_start(const struct aesd_seekto *seekto, off_t *end);
+
+/**
+ * Hand a client that sent SUBSCRIBE_COMMAND to the fan-out thread, which
+ * takes ownership of @param client_fd (closing it on failure) and sends it
+ * every data file byte from @param offset on as records are committed,
+ * as frames if @param compressed.
+ * @return 0 on success, -1 on failure
+ */
+int subscribe_follow(int client_fd, const char *client_ip, size_t offset, bool compressed);
+
+/**
+ * Tell the fan-out thread the committed length advanced; free while
+ * nobody is subscribed. Called by the log writer after every commit.
+ */
+void subscribe_publish(void);
+
+/**
+ * Close every subscription and stop the fan-out thread
+ */
+void subscribe_stop(void);
+
+/**
+ * Run the epoll event loop engine until a signal is caught.
+ * @return 0 on clean shutdown, -1 if the engine could not be started
+ */
+int epoll_engine_run(void);
+
+/**
+ * Run the work-stealing worker pool engine until a signal is caught.
+ * @return 0 on clean shutdown, -1 if the engine could not be started
+ */
+int pool_engine_run(void);
+
+/**
+ * Run the io_uring engine until a signal is caught.
+ * @return 0 on clean shutdown, -1 on failure, or URING_UNAVAILABLE if
+ * io_uring is not supported and the caller should use another engine
+ */
+int uring_engine_run(void);
+
+#endif /* AESDSOCKET_H */
@@ -0,0 +1,308 @@
+/**
+ * @file circular_buffer.c
+ * @brief In-memory storage of the most recent writes for aesdsocket
+ *
+ * The store selected with -s ring: a circular buffer holding only the
+ * last config.ring_records records, as the aesdchar driver does.
+ * Positions keep counting bytes ever appended, exactly like data file
+ * offsets, so committed lengths, delta replies and subscriptions work
+ * unchanged; a position that has fallen out of the buffer simply
+ * resumes at the oldest record still held.
+ *
+ * The bytes live in one power-of-two arena addressed by position modulo
+ * its size, and the start of every held record in a table of
+ * ring_records slots. Only whoever owns the append path writes either.
+ * Readers take no lock: like a seqlock reader they copy first and then
+ * check that nothing they copied was overwritten meanwhile, retrying if
+ * it was. Before reusing bytes or a slot the writer announces the new
+ * oldest position and record, then writes. When the last
+ * ring_records records no longer fit, the writer moves them to an arena
+ * twice the size; the old arena is only freed with the buffer, so a
+ * reader still copying from it never touches freed memory.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <errno.h>
+#include <stdint.h>
+
+#include "aesdsocket.h"
+
+struct ring_arena {
+    char *bytes;
+    // Power of two
+    size_t size;
+    // Arenas grown out of, kept until the buffer is freed
+    struct ring_arena *retired;
+};
+
+// Current arena, replaced with a release store when it grows
+static struct ring_arena *arena = NULL;
+
+// Start position of record k in slot k % slot_count
+static size_t *record_starts = NULL;
+static unsigned int slot_count = 0;
+
+// Records whose slot the writer has claimed, and records fully written.
+// Slot k % slot_count holds record k only while records_begun <= k + slot_count.
+static uint64_t records_begun = 0;
+static uint64_t records_done = 0;
+
+// Position of the oldest byte held; bytes below it may be overwritten
+static size_t ring_tail = 0;
+
+/**
+ * Copy @param len bytes from @param src into the arena at @param pos
+ */
+static void arena_put(struct ring_arena *a, size_t pos, const char *src, size_t len)
+{
+    size_t at = pos & (a->size - 1);
+    size_t first = a->size - at < len ? a->size - at : len;
+
+    memcpy(a->bytes + at, src, first);
+    memcpy(a->bytes, src + first, len - first);
+}
+
+/**
+ * Copy @param len bytes at @param pos out of the arena into @param dst
+ */
+static void arena_get(const struct ring_arena *a, size_t pos, char *dst, size_t len)
+{
+    size_t at = pos & (a->size - 1);
+    size_t first = a->size - at < len ? a->size - at : len;
+
+    memcpy(dst, a->bytes + at, first);
+    memcpy(dst + first, a->bytes, len - first);
+}
+
+/**
+ * Allocate an arena of at least @param min_size bytes holding the bytes
+ * [from, to) of @param old, if any
+ */
+static struct ring_arena *arena_create(size_t min_size, const struct ring_arena *old,
+                                       size_t from, size_t to)
+{
+    struct ring_arena *a = malloc(sizeof(*a));
+    size_t size = BUFFER_SIZE;
+
+    while (size < min_size) {
+        size *= 2;
+    }
+    if (a == NULL || (a->bytes = malloc(size)) == NULL) {
+        syslog(LOG_ERR, "Failed to grow circular buffer: %s", strerror(errno));
+        free(a);
+        return NULL;
+    }
+    a->size = size;
+    a->retired = NULL;
+
+    // Wrap in the new arena as well as the old one
+    for (size_t pos = from; old != NULL && pos < to;) {
+        size_t at = pos & (old->size - 1);
+        size_t len = old->size - at < to - pos ? old->size - at : to - pos;
+        arena_put(a, pos, old->bytes + at, len);
+        pos += len;
+    }
+    return a;
+}
+
+static void ring_close(void)
+{
+    while (arena != NULL) {
+        struct ring_arena *retired = arena->retired;
+        free(arena->bytes);
+        free(arena);
+        arena = retired;
+    }
+    free(record_starts);
+    record_starts = NULL;
+    slot_count = 0;
+}
+
+static int ring_open(size_t *len)
+{
+    unsigned int records = config.ring_records;
+
+    record_starts = calloc(records, sizeof(*record_starts));
+    arena = arena_create(BUFFER_SIZE, NULL, 0, 0);
+    if (record_starts == NULL || arena == NULL) {
+        syslog(LOG_ERR, "Failed to allocate circular buffer");
+        ring_close();
+        return -1;
+    }
+    slot_count = records;
+    records_begun = 0;
+    records_done = 0;
+    ring_tail = 0;
+
+    *len = 0;
+    return 0;
+}
+
+/**
+ * Read the staged start of @param record into the arena at @param pos
+ * @return bytes read; less than spill_len only on error
+ */
+static size_t arena_put_spill(struct ring_arena *a, size_t pos, const struct log_record *record)
+{
+    size_t copied = 0;
+
+    while (copied < record->spill_len) {
+        size_t at = (pos + copied) & (a->size - 1);
+        size_t want = record->spill_len - copied;
+        ssize_t bytes = pread(record->spill_fd, a->bytes + at,
+                              a->size - at < want ? a->size - at : want, copied);
+        if (bytes <= 0) {
+            if (bytes == -1 && errno == EINTR) {
+                continue;
+            }
+            syslog(LOG_ERR, "Failed to read staging file: %s",
+                   bytes == 0 ? "unexpected end of file" : strerror(errno));
+            break;
+        }
+        copied += bytes;
+    }
+
+    return copied;
+}
+
+/**
+ * Copy one record in at @param start, evicting the oldest once full
+ * @return bytes stored; less than the record only on error
+ */
+static size_t ring_append_record(const struct log_record *record, size_t start)
+{
+    size_t size = record->spill_len + record->len;
+    uint64_t k = records_done;
+
+    // Appending record k evicts record k - slot_count
+    size_t tail = ring_tail;
+    if (k + 1 > slot_count) {
+        tail = slot_count == 1 ? start
+                                : __atomic_load_n(&record_starts[(k + 1) % slot_count], __ATOMIC_RELAXED);
+    }
+
+    if (start + size - tail > arena->size) {
+        struct ring_arena *grown = arena_create(start + size - tail, arena, tail, start);
+        if (grown == NULL) {
+            return 0;
+        }
+        grown->retired = arena;
+        __atomic_store_n(&arena, grown, __ATOMIC_RELEASE);
+    }
+
+    // Announce what is about to be overwritten before overwriting it
+    __atomic_store_n(&records_begun, k + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&ring_tail, tail, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    __atomic_store_n(&record_starts[k % slot_count], start, __ATOMIC_RELAXED);
+    size_t written = arena_put_spill(arena, start, record);
+    if (written == record->spill_len) {
+        arena_put(arena, start + written, record->data, record->len);
+        written += record->len;
+    }
+
+    __atomic_store_n(&records_done, k + 1, __ATOMIC_RELEASE);
+    return written;
+}
+
+static size_t ring_append(const struct log_record *first, int count, size_t start)
+{
+    size_t stored = 0;
+
+    for (const struct log_record *record = first; count > 0; count--, record = record->next) {
+        size_t bytes = ring_append_record(record, start + stored);
+        stored += bytes;
+        if (bytes < record->spill_len + record->len) {
+            break;
+        }
+    }
+
+    return stored;
+}
+
+static ssize_t ring_read(off_t *pos, off_t *end, char *buf, size_t len)
+{
+    for (;;) {
+        size_t tail = __atomic_load_n(&ring_tail, __ATOMIC_ACQUIRE);
+
+        if ((size_t)*pos < tail) {
+            *pos = tail;
+            // Rather than nothing, send what is held now
+            if ((size_t)*end <= tail) {
+                *end = data_file_length();
+            }
+        }
+        if (*pos >= *end) {
+            return 0;
+        }
+
+        // Loaded only once *end is final: an arena grown out of since then
+        // still holds every byte below it, but one loaded earlier may not
+        struct ring_arena *a = __atomic_load_n(&arena, __ATOMIC_ACQUIRE);
+        size_t bytes = (size_t)(*end - *pos) < len ? (size_t)(*end - *pos) : len;
+        arena_get(a, *pos, buf, bytes);
+
+        // Valid unless the writer moved the tail past what was copied
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if ((size_t)*pos >= __atomic_load_n(&ring_tail, __ATOMIC_RELAXED)) {
+            return bytes;
+        }
+    }
+}
+
+static int ring_seek(unsigned int record, unsigned int offset, off_t *pos)
+{
+    for (;;) {
+        size_t end = data_file_length();
+        uint64_t done = __atomic_load_n(&records_done, __ATOMIC_ACQUIRE);
+        uint64_t k = (done > slot_count ? done - slot_count : 0) + record;
+        if (k >= done) {
+            return -1;
+        }
+
+        size_t start = __atomic_load_n(&record_starts[k % slot_count], __ATOMIC_RELAXED);
+        size_t next = k + 1 < done
+                      ? __atomic_load_n(&record_starts[(k + 1) % slot_count], __ATOMIC_RELAXED)
+                      : end;
+
+        // Valid unless the writer claimed either slot meanwhile
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&records_begun, __ATOMIC_RELAXED) > k + slot_count) {
+            continue;
+        }
+
+        if (next > end) {
+            next = end;
+        }
+        if (start >= next || offset >= next - start) {
+            return -1;
+        }
+        *pos = start + offset;
+        return 0;
+    }
+}
+
+static int ring_get_fd(off_t *pos, off_t *end, off_t *file_pos, size_t *len)
+{
+    // Replies are always copied out of memory
+    (void)pos;
+    (void)end;
+    (void)file_pos;
+    (void)len;
+    return -1;
+}
+
+const struct storage_ops ring_storage = {
+    .name = "ring",
+    .open = ring_open,
+    .close = ring_close,
+    .append = ring_append,
+    .seek = ring_seek,
+    .read = ring_read,
+    .get_fd = ring_get_fd,
+};
@@ -0,0 +1,172 @@
+/**
+ * @file device_storage.c
+ * @brief aesdchar device storage for aesdsocket
+ *
+ * The store selected with -s device: records are written to an aesdchar
+ * style character device, AESD_DEVICE unless -s device:path names
+ * another, which keeps the most recent writes itself. Every record is
+ * one write() and so one entry of the device.
+ *
+ * Positions keep counting bytes ever appended, as for the other stores;
+ * the device holds the tail of them, as long as its own size says, and a
+ * position that has fallen out of it resumes at the oldest entry still
+ * held. Replies are read from the device into memory, as it cannot be
+ * sent from with sendfile(), and AESDCHAR_IOCSEEKTO is answered by the
+ * device's own seek ioctl. What the device holds changes with every
+ * append, so appends and reads take turns on device_mutex.
+ */
+
+#define _GNU_SOURCE
+#include <string.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/ioctl.h>
+
+#include "aesdsocket.h"
+
+// The aesdchar driver's seek ioctl
+#define AESD_IOC_MAGIC 0x16
+#define AESDCHAR_IOCSEEKTO _IOWR(AESD_IOC_MAGIC, 1, struct aesd_seekto)
+
+static pthread_mutex_t device_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int device_fd = -1;
+
+// Position after everything written to the device
+static size_t device_len = 0;
+
+/**
+ * Position of the oldest byte the device still holds. Called with
+ * device_mutex held.
+ */
+static size_t device_base(void)
+{
+    off_t held = lseek(device_fd, 0, SEEK_END);
+
+    if (held == -1) {
+        syslog(LOG_ERR, "Failed to size %s: %s", config.storage_path, strerror(errno));
+        return 0;
+    }
+    return (size_t)held < device_len ? device_len - held : 0;
+}
+
+static int device_open(size_t *len)
+{
+    device_fd = open(config.storage_path, O_RDWR | O_APPEND | O_CLOEXEC);
+    if (device_fd == -1) {
+        syslog(LOG_ERR, "Failed to open %s: %s", config.storage_path, strerror(errno));
+        return -1;
+    }
+
+    off_t held = lseek(device_fd, 0, SEEK_END);
+    device_len = held > 0 ? held : 0;
+
+    *len = device_len;
+    return 0;
+}
+
+static void device_close(void)
+{
+    if (device_fd != -1) {
+        close(device_fd);
+        device_fd = -1;
+    }
+}
+
+static size_t device_append(const struct log_record *first, int count, size_t start)
+{
+    pthread_mutex_lock(&device_mutex);
+    size_t written = storage_write_records(device_fd, first, count);
+    device_len = start + written;
+    pthread_mutex_unlock(&device_mutex);
+
+    return written;
+}
+
+static int device_seek(unsigned int record, unsigned int offset, off_t *pos)
+{
+    struct aesd_seekto seekto = {
+        .write_cmd = record,
+        .write_cmd_offset = offset,
+    };
+    int ret = -1;
+
+    pthread_mutex_lock(&device_mutex);
+    if (ioctl(device_fd, AESDCHAR_IOCSEEKTO, &seekto) == 0) {
+        off_t at = lseek(device_fd, 0, SEEK_CUR);
+        size_t base = device_base();
+        if (at != -1 && base + at < data_file_length()) {
+            *pos = base + at;
+            ret = 0;
+        }
+    } else if (errno != EINVAL) {
+        syslog(LOG_ERR, "Failed to seek %s: %s", config.storage_path, strerror(errno));
+    }
+    pthread_mutex_unlock(&device_mutex);
+
+    return ret;
+}
+
+static ssize_t device_read(off_t *pos, off_t *end, char *buf, size_t len)
+{
+    size_t copied = 0;
+
+    pthread_mutex_lock(&device_mutex);
+    size_t base = device_base();
+    if ((size_t)*pos < base) {
+        *pos = base;
+        // Rather than nothing, send what is held now
+        if ((size_t)*end <= base) {
+            *end = data_file_length();
+        }
+    }
+
+    size_t want = *pos < *end ? (size_t)(*end - *pos) : 0;
+    if (want > len) {
+        want = len;
+    }
+    // The driver returns at most one entry per read
+    while (copied < want) {
+        ssize_t bytes = pread(device_fd, buf + copied, want - copied, *pos - base + copied);
+        if (bytes <= 0) {
+            if (bytes == -1 && errno == EINTR) {
+                continue;
+            }
+            if (bytes == -1) {
+                syslog(LOG_ERR, "Failed to read %s: %s", config.storage_path, strerror(errno));
+                if (copied == 0) {
+                    pthread_mutex_unlock(&device_mutex);
+                    return -1;
+                }
+            }
+            break;
+        }
+        copied += bytes;
+    }
+    pthread_mutex_unlock(&device_mutex);
+
+    return copied;
+}
+
+static int device_get_fd(off_t *pos, off_t *end, off_t *file_pos, size_t *len)
+{
+    // The device cannot be sent from with sendfile()
+    (void)pos;
+    (void)end;
+    (void)file_pos;
+    (void)len;
+    return -1;
+}
+
+const struct storage_ops device_storage = {
+    .name = "device",
+    .open = device_open,
+    .close = device_close,
+    .append = device_append,
+    .seek = device_seek,
+    .read = device_read,
+    .get_fd = device_get_fd,
+};
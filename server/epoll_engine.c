@@ -0,0 +1,732 @@
+/**
+ * @file epoll_engine.c
+ * @brief Edge-triggered epoll event loop engine for aesdsocket
+ *
+ * A small, fixed number of loop threads share the non-blocking listening
+ * socket (EPOLLEXCLUSIVE so only one loop is woken per connection) and
+ * each owns the client sockets it accepted. Packets are framed
+ * incrementally as bytes arrive and every packet queues a reply covering
+ * the data file as it was right after that packet was appended, so the
+ * bytes on the wire match the thread-per-connection engine exactly.
+ *
+ * With -r each loop is pinned to a core and accepts from a listening
+ * socket of its own instead. The sockets form one SO_REUSEPORT group, so
+ * the kernel spreads incoming connections across per-loop accept queues
+ * and no loop ever contends for another's.
+ *
+ * When the log writer thread runs, appends complete asynchronously: the
+ * writer pushes committed replies onto the owning loop's completion stack
+ * and signals its eventfd, and the loop then releases them to the socket.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <syslog.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sched.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <poll.h>
+#include <sys/queue.h>
+
+#include "aesdsocket.h"
+
+#define MAX_EVENTS 64
+#define MAX_PENDING_REPLIES 16
+
+struct event_loop;
+
+// A reply still owed to the client: the data file up to the length its
+// packet's append committed (record.end). While the writer thread holds
+// the record the packet bytes live in data[]. A seek command queues a
+// reply with no record, resolved once it reaches the head of the queue;
+// so does a compress command, which switches the codec there.
+struct pending_reply {
+    struct log_record record;
+    struct epoll_conn *conn;
+    bool committed;
+    bool seek;
+    struct aesd_seekto seekto;
+    bool compress;
+    struct pending_reply *completed_next;
+    STAILQ_ENTRY(pending_reply) entries;
+    char data[];
+};
+
+// Per-connection state owned by exactly one loop thread
+struct epoll_conn {
+    int fd;
+    char client_ip[INET_ADDRSTRLEN];
+    struct event_loop *loop;
+
+    // Received bytes not yet framed into packets
+    struct recv_buffer rx;
+    bool rx_ready;
+    bool peer_closed;
+
+    // Sent SUBSCRIBE_COMMAND: handed to the fan-out thread from
+    // follow_from once its earlier replies are out
+    bool subscribing;
+    size_t follow_from;
+
+    // Replies queued in packet order, the head one sent up to reply_pos
+    STAILQ_HEAD(, pending_reply) replies;
+    unsigned int pending;
+    off_t reply_pos;
+    struct reply_codec codec;
+
+    // Records the writer thread has not handed back yet; a closed
+    // connection is freed only once this drops to zero
+    unsigned int uncommitted;
+    bool closed;
+    bool ready_queued;
+    SLIST_ENTRY(epoll_conn) ready_entries;
+
+    LIST_ENTRY(epoll_conn) entries;
+};
+
+struct event_loop {
+    pthread_t thread_id;
+    int epoll_fd;
+    // Shared server_fd, or with -r this loop's own listener
+    int listen_fd;
+    LIST_HEAD(, epoll_conn) conns;
+
+    // Committed replies pushed by the writer thread, signalled on notify_fd
+    struct pending_reply *completed;
+    int notify_fd;
+};
+
+// Written once at shutdown; level-triggered so every loop wakes up
+static int wake_fd = -1;
+
+/**
+ * Close a connection and release everything it owns once the writer
+ * thread no longer references any of its replies
+ */
+static void conn_close(struct epoll_conn *conn)
+{
+    struct pending_reply *reply;
+
+    if (!conn->closed) {
+        conn->closed = true;
+        close(conn->fd);
+        syslog(LOG_INFO, "Closed connection from %s", conn->client_ip);
+    }
+    if (conn->uncommitted > 0) {
+        return;
+    }
+
+    while ((reply = STAILQ_FIRST(&conn->replies)) != NULL) {
+        STAILQ_REMOVE_HEAD(&conn->replies, entries);
+        free(reply);
+    }
+
+    LIST_REMOVE(conn, entries);
+    recv_buffer_release(&conn->rx);
+    reply_codec_release(&conn->codec);
+    free(conn);
+}
+
+/**
+ * Writer thread callback: hand a committed reply back to its loop
+ */
+static void reply_committed(struct log_record *record)
+{
+    struct pending_reply *reply = (struct pending_reply *)record;
+    struct event_loop *loop = reply->conn->loop;
+    struct pending_reply *head = __atomic_load_n(&loop->completed, __ATOMIC_RELAXED);
+
+    do {
+        reply->completed_next = head;
+    } while (!__atomic_compare_exchange_n(&loop->completed, &head, reply, true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    // Only the push onto an empty stack needs to wake the loop
+    if (head == NULL) {
+        uint64_t one = 1;
+        if (write(loop->notify_fd, &one, sizeof(one)) == -1) {
+            syslog(LOG_ERR, "Failed to notify event loop: %s", strerror(errno));
+        }
+    }
+}
+
+/**
+ * Send as much of the queued replies as the socket accepts.
+ * @return 0 when the queue is empty, 1 if the socket is full, 2 if the
+ * next reply is still waiting for its append to commit, -1 on error
+ */
+static int conn_flush(struct epoll_conn *conn)
+{
+    struct pending_reply *reply;
+
+    while ((reply = STAILQ_FIRST(&conn->replies)) != NULL) {
+        if (!reply->committed) {
+            return 2;
+        }
+        if (reply->seek) {
+            off_t end;
+            conn->reply_pos = seekto_reply_start(&reply->seekto, &end);
+            reply->record.end = end;
+            reply->seek = false;
+        }
+        if (reply->compress) {
+            // Only the acknowledgement goes out for it
+            if (reply_codec_start(&conn->codec, conn->fd) == -1) {
+                return -1;
+            }
+            reply->record.end = conn->reply_pos;
+            reply->compress = false;
+        }
+
+        off_t end = reply->record.end;
+        int ret = send_file_range(conn->fd, &conn->reply_pos, &end, &conn->codec);
+        reply->record.end = end;
+        if (ret != 0) {
+            return ret;
+        }
+
+        conn->reply_pos = reply_next_start(reply->record.end);
+        if (reply->record.end > conn->follow_from) {
+            conn->follow_from = reply->record.end;
+        }
+        STAILQ_REMOVE_HEAD(&conn->replies, entries);
+        conn->pending--;
+        free(reply);
+    }
+
+    return 0;
+}
+
+/**
+ * Append every complete packet in the receive buffer and queue its reply.
+ * @return number of packets framed, or -1 on error
+ */
+static int conn_process_packets(struct epoll_conn *conn)
+{
+    int framed = 0;
+
+    const char *packet;
+    size_t packet_size;
+
+    while (conn->pending < MAX_PENDING_REPLIES && !conn->subscribing &&
+           (packet = recv_buffer_next_packet(&conn->rx, &packet_size)) != NULL) {
+        if (recv_buffer_packet_is(&conn->rx, packet, packet_size, SUBSCRIBE_COMMAND)) {
+            conn->subscribing = true;
+            conn->follow_from = data_file_length();
+            recv_buffer_consume(&conn->rx, packet_size);
+            break;
+        }
+
+        struct aesd_seekto seekto;
+        bool compress = recv_buffer_packet_is(&conn->rx, packet, packet_size, COMPRESS_COMMAND);
+        bool seek = !compress && recv_buffer_parse_seekto(&conn->rx, packet, packet_size, &seekto);
+
+        // The buffer is reused before a queued record is written, so copy it
+        size_t copy = log_writer_running() && !seek && !compress ? packet_size : 0;
+        struct pending_reply *reply = malloc(sizeof(*reply) + copy);
+        if (reply == NULL) {
+            syslog(LOG_ERR, "Failed to allocate reply: %s", strerror(errno));
+            return -1;
+        }
+        memset(reply, 0, sizeof(*reply));
+        reply->conn = conn;
+        if (seek || compress) {
+            // Nothing to append; answered in order, a seek from the
+            // record index
+            reply->committed = true;
+            reply->seek = seek;
+            if (seek) {
+                reply->seekto = seekto;
+            }
+            reply->compress = compress;
+            STAILQ_INSERT_TAIL(&conn->replies, reply, entries);
+            conn->pending++;
+            framed++;
+            recv_buffer_consume(&conn->rx, packet_size);
+            continue;
+        }
+        reply->record.data = packet;
+        reply->record.len = packet_size;
+        reply->record.complete = reply_committed;
+        reply->record.spill_fd = recv_buffer_take_spill(&conn->rx, &reply->record.spill_len);
+        if (copy > 0) {
+            memcpy(reply->data, packet, packet_size);
+            reply->record.data = reply->data;
+        }
+        STAILQ_INSERT_TAIL(&conn->replies, reply, entries);
+        conn->pending++;
+        framed++;
+
+        if (log_submit(&reply->record) == LOG_COMPLETED) {
+            reply->committed = true;
+        } else {
+            conn->uncommitted++;
+        }
+
+        recv_buffer_consume(&conn->rx, packet_size);
+    }
+
+    return framed;
+}
+
+/**
+ * Receive one chunk from the socket into the connection buffer.
+ * @return 0 on success (including EAGAIN and end of stream), -1 on error
+ */
+static int conn_read(struct epoll_conn *conn)
+{
+    size_t space;
+    char *recv_pos = recv_buffer_reserve(&conn->rx, BUFFER_SIZE, &space);
+    if (recv_pos == NULL) {
+        return -1;
+    }
+
+    ssize_t bytes_received = recv(conn->fd, recv_pos, space, 0);
+    if (bytes_received > 0) {
+        if (recv_buffer_produce(&conn->rx, bytes_received) == -1) {
+            return -1;
+        }
+    } else if (bytes_received == 0) {
+        conn->peer_closed = true;
+        conn->rx_ready = false;
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        conn->rx_ready = false;
+    } else if (errno != EINTR) {
+        syslog(LOG_ERR, "Failed to receive data: %s", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Pass a subscribed connection, all of its replies sent, to the fan-out
+ * thread. Only the connection state is left for conn_close() to free.
+ */
+static void conn_hand_off(struct epoll_conn *conn)
+{
+    if (epoll_ctl(conn->loop->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL) == -1) {
+        syslog(LOG_ERR, "Failed to unregister connection: %s", strerror(errno));
+    }
+    conn->closed = true;
+    subscribe_follow(conn->fd, conn->client_ip, conn->follow_from, conn->codec.enabled);
+}
+
+/**
+ * Drive a connection until it is blocked on the socket in both directions.
+ * @return 0 to keep the connection, -1 to close it
+ */
+static int conn_service(struct epoll_conn *conn)
+{
+    for (;;) {
+        int flushed = conn_flush(conn);
+        if (flushed == -1) {
+            return -1;
+        }
+
+        int framed = conn_process_packets(conn);
+        if (framed == -1) {
+            return -1;
+        }
+        if (framed > 0) {
+            continue;
+        }
+
+        // Socket is full or a reply awaits its commit: wait for EPOLLOUT
+        // or the writer's notification before taking more input
+        if (flushed != 0) {
+            return 0;
+        }
+
+        if (conn->subscribing) {
+            conn_hand_off(conn);
+            return -1;
+        }
+
+        // Every reply delivered, partial packets are dropped like the thread engine does
+        if (conn->peer_closed) {
+            return -1;
+        }
+
+        if (!conn->rx_ready) {
+            return 0;
+        }
+        if (conn_read(conn) == -1) {
+            return -1;
+        }
+    }
+}
+
+/**
+ * Accept every pending connection and register it with this loop
+ */
+static void accept_connections(struct event_loop *loop)
+{
+    for (;;) {
+        struct sockaddr_in client_addr;
+        socklen_t client_addr_len = sizeof(client_addr);
+        int client_fd = accept4(loop->listen_fd, (struct sockaddr *)&client_addr, &client_addr_len,
+                                SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK && !caught_signal) {
+                syslog(LOG_ERR, "Failed to accept connection: %s", strerror(errno));
+            }
+            return;
+        }
+
+        struct epoll_conn *conn = calloc(1, sizeof(*conn));
+        if (conn == NULL) {
+            syslog(LOG_ERR, "Failed to allocate connection: %s", strerror(errno));
+            close(client_fd);
+            continue;
+        }
+        conn->fd = client_fd;
+        conn->loop = loop;
+        conn->rx_ready = true;
+        STAILQ_INIT(&conn->replies);
+        inet_ntop(AF_INET, &client_addr.sin_addr, conn->client_ip, sizeof(conn->client_ip));
+
+        struct epoll_event ev = {
+            .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+            .data.ptr = conn,
+        };
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, client_fd, &ev) == -1) {
+            syslog(LOG_ERR, "Failed to register connection: %s", strerror(errno));
+            close(client_fd);
+            free(conn);
+            continue;
+        }
+
+        LIST_INSERT_HEAD(&loop->conns, conn, entries);
+        syslog(LOG_INFO, "Accepted connection from %s", conn->client_ip);
+    }
+}
+
+/**
+ * Release replies the writer thread has committed and service their
+ * connections
+ */
+static void loop_drain_completions(struct event_loop *loop)
+{
+    SLIST_HEAD(, epoll_conn) ready = SLIST_HEAD_INITIALIZER(ready);
+    struct epoll_conn *conn;
+    uint64_t count;
+
+    if (read(loop->notify_fd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+        syslog(LOG_ERR, "Failed to read loop notification: %s", strerror(errno));
+    }
+
+    struct pending_reply *reply = __atomic_exchange_n(&loop->completed, NULL, __ATOMIC_ACQUIRE);
+    while (reply != NULL) {
+        struct pending_reply *next = reply->completed_next;
+        reply->committed = true;
+        conn = reply->conn;
+        conn->uncommitted--;
+        if (!conn->ready_queued) {
+            conn->ready_queued = true;
+            SLIST_INSERT_HEAD(&ready, conn, ready_entries);
+        }
+        reply = next;
+    }
+
+    // Each connection once, after all of its replies have been marked
+    while ((conn = SLIST_FIRST(&ready)) != NULL) {
+        SLIST_REMOVE_HEAD(&ready, ready_entries);
+        conn->ready_queued = false;
+        if (conn->closed || conn_service(conn) == -1) {
+            conn_close(conn);
+        }
+    }
+}
+
+/**
+ * Event loop thread function
+ */
+static void *event_loop_run(void *arg)
+{
+    struct event_loop *loop = arg;
+    struct epoll_event events[MAX_EVENTS];
+    bool stopping = false;
+
+    while (!stopping && !caught_signal) {
+        int count = epoll_wait(loop->epoll_fd, events, MAX_EVENTS, -1);
+        if (count == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            syslog(LOG_ERR, "epoll_wait failed: %s", strerror(errno));
+            break;
+        }
+
+        bool notified = false;
+        for (int i = 0; i < count; i++) {
+            void *ptr = events[i].data.ptr;
+
+            if (ptr == &wake_fd) {
+                stopping = true;
+            } else if (ptr == &loop->listen_fd) {
+                accept_connections(loop);
+            } else if (ptr == &loop->notify_fd) {
+                notified = true;
+            } else {
+                struct epoll_conn *conn = ptr;
+                if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                    conn->rx_ready = true;
+                }
+                if (conn_service(conn) == -1) {
+                    conn_close(conn);
+                }
+            }
+        }
+
+        // Last, since it may free connections with events later in the batch
+        if (notified) {
+            loop_drain_completions(loop);
+        }
+    }
+
+    struct epoll_conn *conn = LIST_FIRST(&loop->conns);
+    while (conn != NULL) {
+        struct epoll_conn *next = LIST_NEXT(conn, entries);
+        conn_close(conn);
+        conn = next;
+    }
+
+    // Connections with records still queued are freed as the writer returns them
+    while (!LIST_EMPTY(&loop->conns)) {
+        struct pollfd pfd = { .fd = loop->notify_fd, .events = POLLIN };
+        if (poll(&pfd, 1, -1) == -1 && errno != EINTR) {
+            syslog(LOG_ERR, "Failed to wait for log writer: %s", strerror(errno));
+            break;
+        }
+        loop_drain_completions(loop);
+    }
+
+    return NULL;
+}
+
+/**
+ * Open another listening socket in server_fd's SO_REUSEPORT group
+ * @return the non-blocking socket, or -1 on failure
+ */
+static int open_shard_listener(void)
+{
+    struct sockaddr_in addr;
+    int reuse = 1;
+
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        syslog(LOG_ERR, "Failed to create socket: %s", strerror(errno));
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(PORT);
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) == -1 ||
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) == -1 ||
+        (config.batch_packets &&
+         setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &reuse, sizeof(reuse)) == -1) ||
+        bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        listen(fd, config.listen_backlog) == -1) {
+        syslog(LOG_ERR, "Failed to open listener shard on port %d: %s", PORT, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Pick the CPU for loop @param index among those we may run on
+ * @return the CPU number, or -1 if the affinity mask is unavailable
+ */
+static int loop_cpu(int index)
+{
+    cpu_set_t allowed;
+    int count;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1 ||
+        (count = CPU_COUNT(&allowed)) == 0) {
+        return -1;
+    }
+
+    int nth = index % count;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed) && nth-- == 0) {
+            return cpu;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Start a loop thread, pinned to its own core when listeners are sharded
+ * @return 0 on success, -1 on failure
+ */
+static int start_loop_thread(struct event_loop *loop, int index)
+{
+    pthread_attr_t attr;
+    int cpu = config.reuseport_shards ? loop_cpu(index) : -1;
+
+    pthread_attr_init(&attr);
+    if (cpu != -1) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+    }
+    int ret = pthread_create(&loop->thread_id, &attr, event_loop_run, loop);
+    pthread_attr_destroy(&attr);
+
+    return ret == 0 ? 0 : -1;
+}
+
+/**
+ * Close a loop's descriptors, including a listener shard it owns
+ */
+static void loop_close_fds(struct event_loop *loop)
+{
+    if (loop->listen_fd != server_fd) {
+        close(loop->listen_fd);
+    }
+    close(loop->notify_fd);
+    close(loop->epoll_fd);
+}
+
+int epoll_engine_run(void)
+{
+    int loop_count = config.loop_threads;
+    int started = 0;
+    int ret = 0;
+    sigset_t block_mask, orig_mask;
+
+    int flags = fcntl(server_fd, F_GETFL);
+    if (flags == -1 || fcntl(server_fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        syslog(LOG_ERR, "Failed to make listening socket non-blocking: %s", strerror(errno));
+        return -1;
+    }
+
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wake_fd == -1) {
+        syslog(LOG_ERR, "Failed to create eventfd: %s", strerror(errno));
+        return -1;
+    }
+
+    struct event_loop *loops = calloc(loop_count, sizeof(*loops));
+    if (loops == NULL) {
+        syslog(LOG_ERR, "Failed to allocate event loops: %s", strerror(errno));
+        close(wake_fd);
+        return -1;
+    }
+
+    // Loop threads inherit a mask with the termination signals blocked so
+    // they are always delivered to this thread
+    sigemptyset(&block_mask);
+    sigaddset(&block_mask, SIGINT);
+    sigaddset(&block_mask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &block_mask, &orig_mask);
+
+    for (started = 0; started < loop_count; started++) {
+        struct event_loop *loop = &loops[started];
+        LIST_INIT(&loop->conns);
+
+        // The first shard is the socket main() bound, so bind errors surface early
+        loop->listen_fd = server_fd;
+        if (config.reuseport_shards && started > 0) {
+            loop->listen_fd = open_shard_listener();
+            if (loop->listen_fd == -1) {
+                ret = -1;
+                break;
+            }
+        }
+
+        loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        loop->notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (loop->epoll_fd == -1 || loop->notify_fd == -1) {
+            syslog(LOG_ERR, "Failed to create event loop: %s", strerror(errno));
+            if (loop->epoll_fd != -1) {
+                close(loop->epoll_fd);
+            }
+            if (loop->notify_fd != -1) {
+                close(loop->notify_fd);
+            }
+            if (loop->listen_fd != server_fd) {
+                close(loop->listen_fd);
+            }
+            ret = -1;
+            break;
+        }
+
+        // A shared listener wakes only one loop per connection
+        struct epoll_event listen_ev = {
+            .events = config.reuseport_shards ? EPOLLIN : EPOLLIN | EPOLLEXCLUSIVE,
+            .data.ptr = &loop->listen_fd,
+        };
+        struct epoll_event wake_ev = {
+            .events = EPOLLIN,
+            .data.ptr = &wake_fd,
+        };
+        struct epoll_event notify_ev = {
+            .events = EPOLLIN,
+            .data.ptr = &loop->notify_fd,
+        };
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->listen_fd, &listen_ev) == -1 ||
+            epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, wake_fd, &wake_ev) == -1 ||
+            epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->notify_fd, &notify_ev) == -1) {
+            syslog(LOG_ERR, "Failed to register with epoll: %s", strerror(errno));
+            loop_close_fds(loop);
+            ret = -1;
+            break;
+        }
+
+        if (start_loop_thread(loop, started) == -1) {
+            syslog(LOG_ERR, "Failed to create event loop thread");
+            loop_close_fds(loop);
+            ret = -1;
+            break;
+        }
+    }
+
+    if (ret == 0) {
+        syslog(LOG_INFO, "Started %d epoll event loop threads%s", loop_count,
+               config.reuseport_shards ? " with SO_REUSEPORT listeners" : "");
+        while (!caught_signal) {
+            sigsuspend(&orig_mask);
+        }
+    }
+
+    // Wake every loop, then wait for them to drop their connections
+    uint64_t one = 1;
+    if (write(wake_fd, &one, sizeof(one)) == -1) {
+        syslog(LOG_ERR, "Failed to wake event loops: %s", strerror(errno));
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(loops[i].thread_id, NULL);
+        loop_close_fds(&loops[i]);
+    }
+
+    pthread_sigmask(SIG_SETMASK, &orig_mask, NULL);
+    free(loops);
+    close(wake_fd);
+    wake_fd = -1;
+
+    return ret;
+}
@@ -0,0 +1,485 @@
+/**
+ * @file file_storage.c
+ * @brief Data file storage for aesdsocket
+ *
+ * The default store. Records are appended to a regular file, DATA_FILE
+ * unless -s file:path names another, through a long-lived O_APPEND
+ * descriptor, and replies are sent from a second, read-only descriptor
+ * with sendfile() or splice(). Reopening after rotation keeps both
+ * descriptor numbers, so engines never notice.
+ *
+ * The store also records where each line of the file starts (see
+ * record_index.c), so AESDCHAR_IOCSEEKTO can turn "record X, byte Y" into
+ * a file position with one array lookup. Opening the file rebuilds the
+ * index from whatever the file holds, or with -P maps the sidecar index
+ * kept next to it (see index_file.c), repairing a torn tail first.
+ *
+ * With -M every append is also copied into memory (see mirror.c) and
+ * replies and reads of the newest bytes are served from there; older
+ * bytes, and any held before the file was opened, come from the file.
+ *
+ * With -a the file is grown ahead of the records in fallocate()d extents
+ * instead of by every append, and records are written at the end of the
+ * last one rather than through O_APPEND. The file is truncated back to
+ * its records on shutdown and when rotated away; after a crash, the
+ * zeros left past the last record are cut when the file is opened again.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "aesdsocket.h"
+
+// Bounce buffer for copying staged packet starts into the store
+#define SPILL_COPY_SIZE (64 * 1024)
+
+// Long-lived read-only descriptor replies are sent from
+static int data_fd = -1;
+
+// Long-lived O_APPEND descriptor records are written through, used only
+// by whoever owns the append path. With -a it is opened without O_APPEND
+// and its offset kept at records_len.
+static int append_fd = -1;
+
+// With -a: bytes appended, and bytes fallocate()d for the file to hold.
+// Preallocation stops if the file system refuses it.
+static size_t records_len = 0;
+static size_t allocated_len = 0;
+static bool prealloc_refused = false;
+
+// Where each line of the data file starts
+static struct record_index line_index = RECORD_INDEX_INITIALIZER;
+
+/**
+ * Cut the zeros past the last record of a file grown ahead of its records
+ * (-a) that was not truncated back, as no record ends with one. Only run
+ * with -a: without it the file was never grown, and a torn last line may
+ * end in zeros of its own.
+ * @return the length kept, or -1 on failure
+ */
+static ssize_t trim_preallocated(int read_fd, int truncate_fd, size_t len)
+{
+    char buf[SPILL_COPY_SIZE];
+    size_t end = len;
+
+    while (end > 0) {
+        size_t want = end < sizeof(buf) ? end : sizeof(buf);
+        ssize_t bytes = pread(read_fd, buf, want, end - want);
+        if (bytes == -1 && errno == EINTR) {
+            continue;
+        }
+        if (bytes != (ssize_t)want) {
+            syslog(LOG_ERR, "Failed to read %s: %s", config.storage_path,
+                   bytes == -1 ? strerror(errno) : "unexpected end of file");
+            return -1;
+        }
+        size_t kept = want;
+        while (kept > 0 && buf[kept - 1] == '\0') {
+            kept--;
+        }
+        end -= want - kept;
+        if (kept > 0) {
+            break;
+        }
+    }
+
+    if (end < len) {
+        if (ftruncate(truncate_fd, end) == -1) {
+            syslog(LOG_ERR, "Failed to truncate %s: %s", config.storage_path, strerror(errno));
+            return -1;
+        }
+        syslog(LOG_INFO, "Cut %zu preallocated bytes from the end of %s", len - end, config.storage_path);
+    }
+    return end;
+}
+
+/**
+ * Truncate the data file back to the records it holds, with -a
+ */
+static void truncate_preallocated(void)
+{
+    if (config.prealloc_bytes == 0 || append_fd == -1 || allocated_len <= records_len) {
+        return;
+    }
+    if (ftruncate(append_fd, records_len) == -1) {
+        syslog(LOG_ERR, "Failed to truncate %s: %s", config.storage_path, strerror(errno));
+        return;
+    }
+    allocated_len = records_len;
+}
+
+/**
+ * Point append_fd and data_fd at the newly opened file, keeping the
+ * descriptor numbers engines already hold. append_fd goes first: only
+ * the append path, which is running this, uses it, so it can be put back
+ * if data_fd cannot be moved.
+ * @return 0 on success, -1 with both still on the old file
+ */
+static int swap_descriptors(int new_append_fd, int new_data_fd)
+{
+    int old_append_fd = fcntl(append_fd, F_DUPFD_CLOEXEC, 0);
+    if (old_append_fd == -1) {
+        syslog(LOG_ERR, "Failed to reopen %s: %s", config.storage_path, strerror(errno));
+        return -1;
+    }
+    if (dup3(new_append_fd, append_fd, O_CLOEXEC) == -1) {
+        syslog(LOG_ERR, "Failed to reopen %s: %s", config.storage_path, strerror(errno));
+        close(old_append_fd);
+        return -1;
+    }
+    if (dup3(new_data_fd, data_fd, O_CLOEXEC) == -1) {
+        syslog(LOG_ERR, "Failed to reopen %s: %s", config.storage_path, strerror(errno));
+        if (dup3(old_append_fd, append_fd, O_CLOEXEC) == -1) {
+            syslog(LOG_ERR, "Failed to restore %s: %s", config.storage_path, strerror(errno));
+        }
+        close(old_append_fd);
+        return -1;
+    }
+    close(old_append_fd);
+    return 0;
+}
+
+static int file_open(size_t *len)
+{
+    struct stat st;
+
+    int append_flags = config.prealloc_bytes > 0 ? 0 : O_APPEND;
+    int new_append_fd = open(config.storage_path, O_WRONLY | append_flags | O_CREAT | O_CLOEXEC, 0644);
+    if (new_append_fd == -1) {
+        syslog(LOG_ERR, "Failed to open %s: %s", config.storage_path, strerror(errno));
+        return -1;
+    }
+    int new_data_fd = open(config.storage_path, O_RDONLY | O_CLOEXEC);
+    if (new_data_fd == -1 || fstat(new_append_fd, &st) == -1) {
+        syslog(LOG_ERR, "Failed to open %s: %s", config.storage_path, strerror(errno));
+        close(new_append_fd);
+        if (new_data_fd != -1) {
+            close(new_data_fd);
+        }
+        return -1;
+    }
+
+    if (config.prealloc_bytes > 0) {
+        ssize_t trimmed = trim_preallocated(new_data_fd, new_append_fd, st.st_size);
+        if (trimmed == -1) {
+            close(new_append_fd);
+            close(new_data_fd);
+            return -1;
+        }
+        st.st_size = trimmed;
+    }
+
+    // After rotation keep the descriptor numbers engines already hold,
+    // leaving the file rotated away with only its records
+    truncate_preallocated();
+    if (append_fd == -1) {
+        append_fd = new_append_fd;
+        data_fd = new_data_fd;
+    } else {
+        int ret = swap_descriptors(new_append_fd, new_data_fd);
+        close(new_append_fd);
+        close(new_data_fd);
+        if (ret == -1) {
+            return -1;
+        }
+    }
+    if (config.persistent) {
+        ssize_t kept = index_file_open(data_fd, append_fd, &line_index);
+        if (kept == -1) {
+            return -1;
+        }
+        *len = kept;
+    } else {
+        record_index_reset(&line_index, 0);
+        record_index_scan(&line_index, data_fd, st.st_size, config.storage_path);
+        *len = st.st_size;
+    }
+
+    if (config.prealloc_bytes > 0) {
+        records_len = *len;
+        allocated_len = *len;
+        if (lseek(append_fd, *len, SEEK_SET) == -1) {
+            syslog(LOG_ERR, "Failed to seek %s: %s", config.storage_path, strerror(errno));
+            return -1;
+        }
+    }
+    if (config.mirror_bytes > 0) {
+        return mirror_open(*len);
+    }
+    return 0;
+}
+
+static void file_close(void)
+{
+    truncate_preallocated();
+    if (data_fd != -1) {
+        close(data_fd);
+        data_fd = -1;
+    }
+    if (append_fd != -1) {
+        close(append_fd);
+        append_fd = -1;
+    }
+
+    record_index_free(&line_index);
+    if (config.persistent) {
+        index_file_close();
+    }
+    mirror_close();
+}
+
+static void file_remove(void)
+{
+    unlink(config.storage_path);
+}
+
+/**
+ * writev() the whole vector to @param fd, resuming after short writes.
+ * @return bytes written; less than the total only on error
+ */
+static size_t write_all(int fd, struct iovec *iov, int count)
+{
+    size_t total = 0;
+
+    while (count > 0) {
+        ssize_t bytes = writev(fd, iov, count);
+        if (bytes == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            syslog(LOG_ERR, "Failed to write to %s: %s", config.storage_path, strerror(errno));
+            break;
+        }
+        total += bytes;
+
+        while (count > 0 && (size_t)bytes >= iov->iov_len) {
+            bytes -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + bytes;
+            iov->iov_len -= bytes;
+        }
+    }
+
+    return total;
+}
+
+/**
+ * Copy the staged start of a record to @param fd through a bounce
+ * buffer. copy_file_range() and sendfile() both refuse O_APPEND targets.
+ * @return bytes appended; less than spill_len only on error
+ */
+static size_t write_spill(int fd, const struct log_record *record)
+{
+    static char copy_buf[SPILL_COPY_SIZE];
+    size_t copied = 0;
+
+    while (copied < record->spill_len) {
+        size_t want = record->spill_len - copied;
+        ssize_t bytes = pread(record->spill_fd, copy_buf,
+                              want < sizeof(copy_buf) ? want : sizeof(copy_buf), copied);
+        if (bytes <= 0) {
+            if (bytes == -1 && errno == EINTR) {
+                continue;
+            }
+            syslog(LOG_ERR, "Failed to read staging file: %s",
+                   bytes == 0 ? "unexpected end of file" : strerror(errno));
+            break;
+        }
+
+        struct iovec iov = { .iov_base = copy_buf, .iov_len = bytes };
+        size_t written = write_all(fd, &iov, 1);
+        copied += written;
+        if (written < (size_t)bytes) {
+            break;
+        }
+    }
+
+    return copied;
+}
+
+size_t storage_write_records(int fd, const struct log_record *first, int count)
+{
+    struct iovec iov[WRITER_BATCH];
+    int iov_count = 0;
+    size_t iov_len = 0;
+    size_t written = 0;
+    const struct log_record *record = first;
+
+    for (int i = 0; i < count; i++, record = record->next) {
+        if (record->spill_len > 0) {
+            // Flush what precedes the staged bytes, then stop after any error
+            // so the store holds a prefix of the chain
+            if (iov_count > 0) {
+                size_t bytes = write_all(fd, iov, iov_count);
+                written += bytes;
+                if (bytes < iov_len) {
+                    return written;
+                }
+            }
+            iov_count = 0;
+            iov_len = 0;
+            size_t bytes = write_spill(fd, record);
+            written += bytes;
+            if (bytes < record->spill_len) {
+                return written;
+            }
+        }
+        iov[iov_count].iov_base = (void *)record->data;
+        iov[iov_count].iov_len = record->len;
+        iov_count++;
+        iov_len += record->len;
+    }
+    if (iov_count > 0) {
+        written += write_all(fd, iov, iov_count);
+    }
+
+    return written;
+}
+
+/**
+ * With -a, make sure the file has room for @param len bytes at
+ * @param start, growing it to the next multiple of the extent size
+ */
+static void file_reserve(size_t start, size_t len)
+{
+    if (config.prealloc_bytes == 0 || prealloc_refused || start + len <= allocated_len) {
+        return;
+    }
+
+    size_t grown = (start + len + config.prealloc_bytes - 1) / config.prealloc_bytes * config.prealloc_bytes;
+    if (fallocate(append_fd, 0, allocated_len, grown - allocated_len) == -1) {
+        // Appends grow the file themselves from here on
+        syslog(LOG_ERR, "Failed to preallocate %s: %s", config.storage_path, strerror(errno));
+        prealloc_refused = true;
+        return;
+    }
+    allocated_len = grown;
+}
+
+static size_t file_append(const struct log_record *first, int count, size_t start)
+{
+    size_t chain_len = 0;
+    int i = 0;
+    for (const struct log_record *record = first; i < count; i++, record = record->next) {
+        chain_len += record->spill_len + record->len;
+    }
+    file_reserve(start, chain_len);
+
+    size_t written = storage_write_records(append_fd, first, count);
+    records_len = start + written;
+    if (config.mirror_bytes > 0) {
+        mirror_append(first, count, start, written);
+    }
+
+    // Index the records that made it to the file in full
+    size_t end = start;
+    for (const struct log_record *record = first; count > 0; count--, record = record->next) {
+        size_t size = record->spill_len + record->len;
+        if (end + size > start + written) {
+            break;
+        }
+        record_index_add(&line_index, record, end);
+        if (config.persistent) {
+            index_file_add(record, end);
+        }
+        end += size;
+    }
+    if (config.persistent) {
+        index_file_flush();
+    }
+
+    return written;
+}
+
+static int file_sync(void)
+{
+    if (fdatasync(append_fd) == -1) {
+        syslog(LOG_ERR, "Failed to sync %s: %s", config.storage_path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static int file_seek(unsigned int record, unsigned int offset, off_t *pos)
+{
+    return record_index_seek(&line_index, record, offset, pos);
+}
+
+static ssize_t file_read(off_t *pos, off_t *end, char *buf, size_t len)
+{
+    size_t want = *pos < *end ? (size_t)(*end - *pos) : 0;
+    size_t copied = 0;
+
+    if (want > len) {
+        want = len;
+    }
+    size_t held;
+    const char *mirrored = config.mirror_bytes > 0 ? mirror_get(*pos, *pos + want, &held) : NULL;
+    if (mirrored != NULL) {
+        memcpy(buf, mirrored, held);
+        mirror_put(mirrored);
+        return held;
+    }
+    while (copied < want) {
+        ssize_t bytes = pread(data_fd, buf + copied, want - copied, *pos + copied);
+        if (bytes <= 0) {
+            if (bytes == -1 && errno == EINTR) {
+                continue;
+            }
+            syslog(LOG_ERR, "Failed to read %s: %s", config.storage_path,
+                   bytes == 0 ? "unexpected end of file" : strerror(errno));
+            // What was read is sent; the next read fails again
+            return copied > 0 ? (ssize_t)copied : -1;
+        }
+        copied += bytes;
+    }
+
+    return copied;
+}
+
+static int file_get_fd(off_t *pos, off_t *end, off_t *file_pos, size_t *len)
+{
+    // Positions are offsets into the one file
+    *file_pos = *pos;
+    *len = *pos < *end ? (size_t)(*end - *pos) : 0;
+    return data_fd;
+}
+
+static void file_put_fd(int fd)
+{
+    // data_fd stays open until shutdown
+    (void)fd;
+}
+
+static const char *file_get_mem(off_t *pos, off_t *end, size_t *len)
+{
+    return config.mirror_bytes > 0 ? mirror_get(*pos, *end, len) : NULL;
+}
+
+const struct storage_ops file_storage = {
+    .name = "file",
+    .open = file_open,
+    .reopen = file_open,
+    .close = file_close,
+    .remove = file_remove,
+    .append = file_append,
+    .sync = file_sync,
+    .seek = file_seek,
+    .read = file_read,
+    .get_fd = file_get_fd,
+    .put_fd = file_put_fd,
+    .get_mem = file_get_mem,
+    .put_mem = mirror_put,
+};
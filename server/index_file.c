@@ -0,0 +1,389 @@
+/**
+ * @file index_file.c
+ * @brief Sidecar record index of the data file for -P
+ *
+ * With -P the data file outlives the server, and next to it, in
+ * <data file>.idx, the file store keeps one struct index_entry per line:
+ * its position, its length, the CRC-32 of its bytes, and whether it is a
+ * timestamp. The sidecar starts with a header naming its format and the
+ * data file's device and inode, so one left behind by a rotated-away
+ * file, or by an older server, is recognized and started over.
+ *
+ * Entries are appended after the lines they describe and are never
+ * synced: after a crash the sidecar may lag the data file, or run ahead
+ * of data that never reached the disk. Opening checks only the tail. The
+ * last entry lying within the data file whose bytes still match its
+ * checksum ends the trusted part; lines past it are indexed from the
+ * data file and a torn partial line at its end is truncated away. The
+ * sidecar is then mapped and seeks look lines up in it directly, so a
+ * restart costs a few reads however long the history.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "aesdsocket.h"
+
+// Bumped whenever struct index_entry changes, so older sidecars are rebuilt
+#define INDEX_FILE_MAGIC "AESDIDX2"
+#define INDEX_FILE_SUFFIX ".idx"
+// Entries gathered before one write()
+#define INDEX_FILE_BATCH 256
+// Data file bytes read per pread() while checking and recovering lines
+#define INDEX_READ_SIZE (64 * 1024)
+
+struct index_file_header {
+    char magic[8];
+    uint64_t dev;
+    uint64_t ino;
+};
+
+static int index_fd = -1;
+static void *index_map = NULL;
+static size_t index_map_len = 0;
+
+// Entries not yet written out
+static struct index_entry pending[INDEX_FILE_BATCH];
+static int pending_count = 0;
+
+static uint32_t crc_table[256];
+
+static void crc_init(void)
+{
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = crc & 1 ? (crc >> 1) ^ 0xedb88320 : crc >> 1;
+        }
+        crc_table[i] = crc;
+    }
+}
+
+/**
+ * Continue the CRC-32 @param crc (0 to start) over @param len bytes
+ */
+static uint32_t crc32_update(uint32_t crc, const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+
+    crc = ~crc;
+    while (len-- > 0) {
+        crc = crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+static bool is_timestamp(const char *line, size_t len)
+{
+    return len >= 10 && memcmp(line, "timestamp:", 10) == 0;
+}
+
+static void index_path(char *path, size_t size)
+{
+    snprintf(path, size, "%s%s", config.storage_path, INDEX_FILE_SUFFIX);
+}
+
+/**
+ * Queue an entry, writing the queue out when it is full
+ */
+static void pending_push(size_t start, size_t len, uint32_t crc, bool timestamp)
+{
+    pending[pending_count].start = start;
+    pending[pending_count].len = len;
+    pending[pending_count].crc = crc;
+    pending[pending_count].flags = timestamp ? INDEX_TIMESTAMP : 0;
+    if (++pending_count == INDEX_FILE_BATCH) {
+        index_file_flush();
+    }
+}
+
+void index_file_flush(void)
+{
+    size_t len = pending_count * sizeof(*pending);
+    const char *p = (const char *)pending;
+
+    // The data file is the record; a short sidecar is repaired at startup
+    while (len > 0 && index_fd != -1) {
+        ssize_t bytes = write(index_fd, p, len);
+        if (bytes == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            syslog(LOG_ERR, "Failed to write record index: %s", strerror(errno));
+            break;
+        }
+        p += bytes;
+        len -= bytes;
+    }
+    pending_count = 0;
+}
+
+void index_file_add(const struct log_record *record, size_t start)
+{
+    char buf[INDEX_READ_SIZE];
+    const char *line = record->data;
+    const char *end = record->data + record->len;
+    uint32_t crc = 0;
+    size_t line_len = 0;
+
+    // A staged start belongs to the first line; checksum it from its file
+    while (line_len < record->spill_len) {
+        size_t want = record->spill_len - line_len;
+        ssize_t bytes = pread(record->spill_fd, buf, want < sizeof(buf) ? want : sizeof(buf), line_len);
+        if (bytes <= 0) {
+            if (bytes == -1 && errno == EINTR) {
+                continue;
+            }
+            syslog(LOG_ERR, "Failed to read staging file: %s",
+                   bytes == 0 ? "unexpected end of file" : strerror(errno));
+            return;
+        }
+        crc = crc32_update(crc, buf, bytes);
+        line_len += bytes;
+    }
+
+    // Every record ends with a newline; with -p it may hold several lines
+    while (line < end) {
+        const char *newline = memchr(line, '\n', end - line);
+        size_t len = newline + 1 - line;
+        bool timestamp = line_len == 0 && is_timestamp(line, len);
+        crc = crc32_update(crc, line, len);
+        line_len += len;
+        pending_push(start, line_len, crc, timestamp);
+        start += line_len;
+        line += len;
+        crc = 0;
+        line_len = 0;
+    }
+}
+
+/**
+ * @return true if bytes [start, start + len) of the data file still have
+ * CRC-32 @param crc
+ */
+static bool range_matches(int data_fd, size_t start, size_t len, uint32_t crc)
+{
+    char buf[INDEX_READ_SIZE];
+    uint32_t actual = 0;
+    size_t done = 0;
+
+    while (done < len) {
+        size_t want = len - done;
+        ssize_t bytes = pread(data_fd, buf, want < sizeof(buf) ? want : sizeof(buf), start + done);
+        if (bytes <= 0) {
+            if (bytes == -1 && errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        actual = crc32_update(actual, buf, bytes);
+        done += bytes;
+    }
+    return actual == crc;
+}
+
+/**
+ * Index the lines of the data file from @param start to @param size into
+ * the sidecar
+ * @return where the last complete line ends, or -1 on failure
+ */
+static ssize_t recover_lines(int data_fd, size_t start, size_t size)
+{
+    char buf[INDEX_READ_SIZE];
+    size_t pos = start;
+    size_t line_pos = start;
+    uint32_t crc = 0;
+    bool timestamp = false;
+
+    while (pos < size) {
+        size_t want = size - pos < sizeof(buf) ? size - pos : sizeof(buf);
+        ssize_t bytes = pread(data_fd, buf, want, pos);
+        if (bytes <= 0) {
+            if (bytes == -1 && errno == EINTR) {
+                continue;
+            }
+            syslog(LOG_ERR, "Failed to read %s: %s", config.storage_path,
+                   bytes == 0 ? "unexpected end of file" : strerror(errno));
+            return -1;
+        }
+
+        const char *p = buf;
+        while (p < buf + bytes) {
+            if (pos + (p - buf) == line_pos) {
+                timestamp = is_timestamp(p, buf + bytes - p);
+            }
+            const char *newline = memchr(p, '\n', buf + bytes - p);
+            const char *line_end = newline != NULL ? newline + 1 : buf + bytes;
+            crc = crc32_update(crc, p, line_end - p);
+            p = line_end;
+            if (newline != NULL) {
+                size_t next = pos + (p - buf);
+                pending_push(line_pos, next - line_pos, crc, timestamp);
+                line_pos = next;
+                crc = 0;
+            }
+        }
+        pos += bytes;
+    }
+    index_file_flush();
+
+    return line_pos;
+}
+
+/**
+ * Open the sidecar, starting it over unless its header names the data
+ * file described by @param st
+ * @return the entries it holds, or -1 on failure
+ */
+static ssize_t index_file_prepare(const struct stat *st)
+{
+    char path[PATH_MAX];
+    struct index_file_header header;
+    struct stat index_st;
+
+    index_path(path, sizeof(path));
+    index_fd = open(path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (index_fd == -1 || fstat(index_fd, &index_st) == -1) {
+        syslog(LOG_ERR, "Failed to open %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    if (pread(index_fd, &header, sizeof(header), 0) == sizeof(header) &&
+        memcmp(header.magic, INDEX_FILE_MAGIC, sizeof(header.magic)) == 0 &&
+        header.dev == (uint64_t)st->st_dev && header.ino == (uint64_t)st->st_ino) {
+        return (index_st.st_size - sizeof(header)) / sizeof(struct index_entry);
+    }
+
+    if (index_st.st_size > 0) {
+        syslog(LOG_INFO, "Rebuilding %s: it does not belong to %s", path, config.storage_path);
+    }
+    memcpy(header.magic, INDEX_FILE_MAGIC, sizeof(header.magic));
+    header.dev = st->st_dev;
+    header.ino = st->st_ino;
+    if (ftruncate(index_fd, 0) == -1 || write(index_fd, &header, sizeof(header)) != sizeof(header)) {
+        syslog(LOG_ERR, "Failed to write %s: %s", path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+ssize_t index_file_open(int data_fd, int append_fd, struct record_index *index)
+{
+    struct stat st;
+
+    crc_init();
+    // The sidecar is about to be cut or started over; a seek into the old
+    // mapping past its new end would fault, so none may look there again
+    record_index_reset(index, 0);
+    if (index_map != NULL) {
+        munmap(index_map, index_map_len);
+        index_map = NULL;
+    }
+    if (index_fd != -1) {
+        close(index_fd);
+        index_fd = -1;
+    }
+    if (fstat(data_fd, &st) == -1) {
+        syslog(LOG_ERR, "Failed to open %s: %s", config.storage_path, strerror(errno));
+        return -1;
+    }
+    ssize_t count = index_file_prepare(&st);
+    if (count == -1) {
+        return -1;
+    }
+    size_t size = st.st_size;
+
+    // Entries are in file order: find the last one within the data file,
+    // then step back past any whose bytes do not match
+    const struct index_entry *entries = NULL;
+    void *check_map = NULL;
+    size_t check_len = sizeof(struct index_file_header) + count * sizeof(struct index_entry);
+    if (count > 0) {
+        check_map = mmap(NULL, check_len, PROT_READ, MAP_SHARED, index_fd, 0);
+        if (check_map == MAP_FAILED) {
+            syslog(LOG_ERR, "Failed to map record index: %s", strerror(errno));
+            return -1;
+        }
+        entries = (const struct index_entry *)((const char *)check_map + sizeof(struct index_file_header));
+    }
+    size_t lo = 0;
+    size_t hi = count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (entries[mid].start + entries[mid].len <= size) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    size_t good = lo;
+    while (good > 0 &&
+           !range_matches(data_fd, entries[good - 1].start, entries[good - 1].len,
+                          entries[good - 1].crc)) {
+        good--;
+    }
+    size_t good_end = good > 0 ? entries[good - 1].start + entries[good - 1].len : 0;
+    if (check_map != NULL) {
+        munmap(check_map, check_len);
+    }
+
+    // Drop the entries not trusted, index what follows the trusted part
+    // and cut off a torn last line
+    if (ftruncate(index_fd, sizeof(struct index_file_header) + good * sizeof(struct index_entry)) == -1) {
+        syslog(LOG_ERR, "Failed to truncate record index: %s", strerror(errno));
+        return -1;
+    }
+    ssize_t kept = recover_lines(data_fd, good_end, size);
+    if (kept == -1) {
+        return -1;
+    }
+    if ((size_t)kept < size) {
+        syslog(LOG_WARNING, "Truncating %zu torn bytes from %s", size - kept, config.storage_path);
+        if (ftruncate(append_fd, kept) == -1) {
+            syslog(LOG_ERR, "Failed to truncate %s: %s", config.storage_path, strerror(errno));
+            return -1;
+        }
+    }
+    if ((ssize_t)good < count || good_end < (size_t)kept) {
+        syslog(LOG_INFO, "Recovered %s: %zu of %zd indexed lines kept, %zu bytes reindexed",
+               config.storage_path, good, count, kept - good_end);
+    }
+
+    // Map the repaired sidecar for lookups
+    if (fstat(index_fd, &st) == -1) {
+        syslog(LOG_ERR, "Failed to map record index: %s", strerror(errno));
+        return -1;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, index_fd, 0);
+    if (map == MAP_FAILED) {
+        syslog(LOG_ERR, "Failed to map record index: %s", strerror(errno));
+        return -1;
+    }
+    index_map = map;
+    index_map_len = st.st_size;
+    record_index_preload(index, (const struct index_entry *)((const char *)map + sizeof(struct index_file_header)),
+                         (st.st_size - sizeof(struct index_file_header)) / sizeof(struct index_entry), kept);
+    return kept;
+}
+
+void index_file_close(void)
+{
+    index_file_flush();
+    if (index_map != NULL) {
+        munmap(index_map, index_map_len);
+        index_map = NULL;
+    }
+    if (index_fd != -1) {
+        close(index_fd);
+        index_fd = -1;
+    }
+}
@@ -0,0 +1,427 @@
+/**
+ * @file log_writer.c
+ * @brief Data file append path for aesdsocket
+ *
+ * Every record reaches the store selected with -s through log_submit().
+ * By default the submitting thread appends directly under file_mutex.
+ * With -w a dedicated writer thread owns the append path instead:
+ * producers push records onto a lock-free multi-producer single-consumer
+ * stack, and the writer takes the whole stack at once, restores arrival
+ * order and hands the batch to the store in one call (one writev() for
+ * the data file) before publishing the new committed length and
+ * completing each record.
+ *
+ * The durability mode (-f) decides when written records count as
+ * committed. With "record" every record is fdatasync()ed before it
+ * completes. With "group" the writer keeps appending while a group
+ * builds up and issues a single fdatasync() once it holds
+ * config.group_records records or its oldest record has waited
+ * config.group_usec microseconds, then completes the whole group.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/types.h>
+#include <sys/eventfd.h>
+
+#include "aesdsocket.h"
+
+// Serializes direct appends (and reopening); readers never take it
+static pthread_mutex_t file_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Length of the store covering only fully written records. Writers
+// advance it with a release store after the store's append returns, so a
+// reader that loads it with acquire semantics can read [0, length)
+// without a lock.
+static size_t committed_len = 0;
+
+// End of everything written so far, owned by whoever owns the append
+// path; ahead of committed_len only while a group waits for its sync
+static size_t written_len = 0;
+
+// Set by SIGHUP once the data file has been rotated away
+volatile sig_atomic_t reopen_requested = 0;
+
+// Producers push here; the writer thread swaps the whole stack out
+static struct log_record *queue_head = NULL;
+static int writer_wake_fd = -1;
+static pthread_t writer_thread;
+static bool writer_running = false;
+static volatile bool writer_stopping = false;
+
+// A record whose submitter waits for it to be committed
+struct sync_record {
+    struct log_record record;
+    sem_t done;
+};
+
+/**
+ * Publish everything written so far
+ */
+static void publish_written(void)
+{
+    __atomic_store_n(&committed_len, written_len, __ATOMIC_RELEASE);
+}
+
+int data_file_open(void)
+{
+    if (storage->open(&written_len) == -1) {
+        return -1;
+    }
+    publish_written();
+    return 0;
+}
+
+void data_file_close(void)
+{
+    storage->close();
+    pthread_mutex_destroy(&file_mutex);
+}
+
+size_t data_file_length(void)
+{
+    return __atomic_load_n(&committed_len, __ATOMIC_ACQUIRE);
+}
+
+int data_file_seek(unsigned int record, unsigned int offset, off_t *pos)
+{
+    return storage->seek(record, offset, pos);
+}
+
+/**
+ * Reopen the store if SIGHUP asked for it. Called by the only thread
+ * currently allowed to append.
+ */
+static void reopen_if_requested(void)
+{
+    if (reopen_requested) {
+        reopen_requested = 0;
+        // Nothing to rotate in a device or in memory
+        if (storage->reopen == NULL) {
+            return;
+        }
+        // Records waiting for a group sync were written to the old file
+        if (config.durability != DURABILITY_NONE) {
+            storage->sync();
+        }
+        if (storage->reopen(&written_len) == 0) {
+            publish_written();
+            syslog(LOG_INFO, "Reopened %s", config.storage_path);
+        }
+    }
+}
+
+/**
+ * Append a FIFO chain of at most WRITER_BATCH records and fill in each
+ * record's end offset and status. The store writes the records in one go
+ * and each lands contiguously. Nothing is published or completed here;
+ * see commit_records().
+ */
+static void append_batch(struct log_record *first, int count)
+{
+    reopen_if_requested();
+
+    size_t base = written_len;
+    size_t written = storage->append(first, count, base);
+
+    // Only records that made it to the store in full count as committed
+    size_t end = base;
+    struct log_record *record = first;
+    for (int i = 0; i < count; i++, record = record->next) {
+        if (record->spill_len > 0) {
+            close(record->spill_fd);
+        }
+        size_t size = record->spill_len + record->len;
+        if (end + size <= base + written) {
+            end += size;
+            record->status = 0;
+        } else {
+            record->status = -1;
+        }
+        record->end = base + written < end ? base + written : end;
+    }
+
+    written_len = base + written;
+}
+
+/**
+ * Make everything written so far durable as the mode requires and publish
+ * it. Records that may not have reached the disk are marked failed.
+ */
+static void commit_records(struct log_record *first, unsigned int count)
+{
+    if (config.durability != DURABILITY_NONE && storage->sync() == -1) {
+        for (struct log_record *record = first; count > 0; count--, record = record->next) {
+            record->status = -1;
+        }
+    }
+
+    publish_written();
+    subscribe_publish();
+}
+
+/**
+ * Complete a chain of committed records
+ */
+static void complete_records(struct log_record *record, unsigned int count)
+{
+    // complete() may free or reuse the record, so step first
+    for (; count > 0; count--) {
+        struct log_record *next = record->next;
+        record->complete(record);
+        record = next;
+    }
+}
+
+static uint64_t now_usec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * Push a record for the writer thread.
+ * @return true if the queue was empty and the writer must be woken
+ */
+static bool queue_push(struct log_record *record)
+{
+    struct log_record *head = __atomic_load_n(&queue_head, __ATOMIC_RELAXED);
+
+    do {
+        record->next = head;
+    } while (!__atomic_compare_exchange_n(&queue_head, &head, record, true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    return head == NULL;
+}
+
+/**
+ * Take every queued record, oldest first
+ */
+static struct log_record *queue_take_all(void)
+{
+    struct log_record *stack = __atomic_exchange_n(&queue_head, NULL, __ATOMIC_ACQUIRE);
+    struct log_record *fifo = NULL;
+
+    while (stack != NULL) {
+        struct log_record *next = stack->next;
+        stack->next = fifo;
+        fifo = stack;
+        stack = next;
+    }
+    return fifo;
+}
+
+/**
+ * Sleep until records are submitted or @param timeout_usec passes
+ * (forever if negative)
+ */
+static void writer_wait(int64_t timeout_usec)
+{
+    struct pollfd pfd = { .fd = writer_wake_fd, .events = POLLIN };
+    struct timespec timeout = {
+        .tv_sec = timeout_usec / 1000000,
+        .tv_nsec = timeout_usec % 1000000 * 1000,
+    };
+    uint64_t count;
+
+    if (ppoll(&pfd, 1, timeout_usec < 0 ? NULL : &timeout, NULL) == -1 && errno != EINTR) {
+        syslog(LOG_ERR, "Log writer failed to wait: %s", strerror(errno));
+        return;
+    }
+    if (read(writer_wake_fd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+        syslog(LOG_ERR, "Log writer failed to wait: %s", strerror(errno));
+    }
+}
+
+/**
+ * Writer thread function: drain, append, commit each group, complete it,
+ * sleep until woken or the open group is due
+ */
+static void *writer_run(void *arg)
+{
+    // Written records still waiting for their group commit, oldest first
+    struct log_record *group = NULL;
+    struct log_record *group_tail = NULL;
+    unsigned int group_count = 0;
+    uint64_t group_start = 0;
+
+    // Only group mode lets records wait; per-record syncs one at a time
+    unsigned int group_records = config.durability == DURABILITY_GROUP ? config.group_records : 1;
+    int batch_limit = config.durability == DURABILITY_RECORD ? 1 : WRITER_BATCH;
+
+    (void)arg;
+
+    for (;;) {
+        struct log_record *records = queue_take_all();
+        bool drained = records == NULL;
+
+        while (records != NULL) {
+            struct log_record *first = records;
+            struct log_record *last = records;
+            int count = 0;
+            while (records != NULL && count < batch_limit) {
+                last = records;
+                records = records->next;
+                count++;
+            }
+
+            append_batch(first, count);
+
+            if (group == NULL) {
+                group = first;
+                group_start = now_usec();
+            } else {
+                group_tail->next = first;
+            }
+            group_tail = last;
+            group_count += count;
+
+            if (group_count >= group_records) {
+                commit_records(group, group_count);
+                complete_records(group, group_count);
+                group = NULL;
+                group_count = 0;
+            }
+        }
+
+        int64_t wait_usec = -1;
+        if (group != NULL) {
+            uint64_t age = now_usec() - group_start;
+            if (age >= config.group_usec || writer_stopping) {
+                commit_records(group, group_count);
+                complete_records(group, group_count);
+                group = NULL;
+                group_count = 0;
+            } else {
+                wait_usec = config.group_usec - age;
+            }
+        }
+
+        if (drained) {
+            if (writer_stopping && group == NULL) {
+                break;
+            }
+            writer_wait(wait_usec);
+        }
+    }
+
+    return NULL;
+}
+
+int log_writer_start(void)
+{
+    writer_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (writer_wake_fd == -1) {
+        syslog(LOG_ERR, "Failed to create eventfd: %s", strerror(errno));
+        return -1;
+    }
+
+    writer_stopping = false;
+    if (pthread_create(&writer_thread, NULL, writer_run, NULL) != 0) {
+        syslog(LOG_ERR, "Failed to create log writer thread");
+        close(writer_wake_fd);
+        writer_wake_fd = -1;
+        return -1;
+    }
+    writer_running = true;
+
+    return 0;
+}
+
+void log_writer_stop(void)
+{
+    if (!writer_running) {
+        return;
+    }
+
+    // The writer drains whatever is still queued before it exits
+    uint64_t one = 1;
+    writer_stopping = true;
+    if (write(writer_wake_fd, &one, sizeof(one)) == -1) {
+        syslog(LOG_ERR, "Failed to wake log writer: %s", strerror(errno));
+    }
+    pthread_join(writer_thread, NULL);
+    writer_running = false;
+
+    close(writer_wake_fd);
+    writer_wake_fd = -1;
+}
+
+bool log_writer_running(void)
+{
+    return writer_running;
+}
+
+int log_submit(struct log_record *record)
+{
+    if (writer_running) {
+        if (queue_push(record)) {
+            uint64_t one = 1;
+            if (write(writer_wake_fd, &one, sizeof(one)) == -1) {
+                syslog(LOG_ERR, "Failed to wake log writer: %s", strerror(errno));
+            }
+        }
+        return LOG_QUEUED;
+    }
+
+    pthread_mutex_lock(&file_mutex);
+    record->next = NULL;
+    append_batch(record, 1);
+    commit_records(record, 1);
+    pthread_mutex_unlock(&file_mutex);
+
+    return LOG_COMPLETED;
+}
+
+static void sync_record_complete(struct log_record *record)
+{
+    struct sync_record *sync = (struct sync_record *)record;
+    sem_post(&sync->done);
+}
+
+int log_submit_wait(struct log_record *record)
+{
+    struct sync_record sync = {
+        .record = *record,
+    };
+
+    sync.record.complete = sync_record_complete;
+    sem_init(&sync.done, 0, 0);
+    if (log_submit(&sync.record) == LOG_QUEUED) {
+        while (sem_wait(&sync.done) == -1 && errno == EINTR) {
+            // Retry until the writer thread has committed the record
+        }
+    }
+    sem_destroy(&sync.done);
+
+    record->end = sync.record.end;
+    record->status = sync.record.status;
+    return record->status;
+}
+
+int append_packet(const char *data, size_t len, size_t *file_len)
+{
+    struct log_record record = {
+        .data = data,
+        .len = len,
+    };
+
+    int status = log_submit_wait(&record);
+    if (file_len != NULL) {
+        *file_len = record.end;
+    }
+    return status;
+}
@@ -0,0 +1,230 @@
+/**
+ * @file lz.c
+ * @brief Self-contained LZ77 block codec
+ *
+ * Matches are found through a hash table of the last position each
+ * 4-byte sequence was seen at, one probe per position; runs without a
+ * match are skipped over faster the longer they get, so data that does
+ * not compress costs little time. The decoder checks every length and
+ * back reference against both buffers, so a corrupt block is reported
+ * rather than read or written out of bounds.
+ */
+
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "lz.h"
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS 13
+// A length nibble of 15 is continued in bytes of up to 255 each
+#define LZ_LENGTH_MASK 15
+
+static uint32_t read32(const unsigned char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static unsigned int hash32(uint32_t v)
+{
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/**
+ * Write the continuation bytes of a length whose nibble saturated
+ * @return where the output continues, or NULL if it is full
+ */
+static unsigned char *put_length(unsigned char *op, const unsigned char *oend, size_t len)
+{
+    for (; len >= 255; len -= 255) {
+        if (op == oend) {
+            return NULL;
+        }
+        *op++ = 255;
+    }
+    if (op == oend) {
+        return NULL;
+    }
+    *op++ = len;
+    return op;
+}
+
+/**
+ * Write one sequence: @param lit_len literals, then a match of
+ * @param match_len bytes @param offset back, or nothing for the last one
+ * @return where the output continues, or NULL if it is full
+ */
+static unsigned char *put_sequence(unsigned char *op, const unsigned char *oend,
+                                   const unsigned char *lit, size_t lit_len,
+                                   size_t offset, size_t match_len)
+{
+    size_t match_code = match_len > 0 ? match_len - LZ_MIN_MATCH : 0;
+
+    if (op == oend) {
+        return NULL;
+    }
+    unsigned char *token = op++;
+    *token = (lit_len < LZ_LENGTH_MASK ? lit_len : LZ_LENGTH_MASK) << 4 |
+             (match_code < LZ_LENGTH_MASK ? match_code : LZ_LENGTH_MASK);
+    if (lit_len >= LZ_LENGTH_MASK && (op = put_length(op, oend, lit_len - LZ_LENGTH_MASK)) == NULL) {
+        return NULL;
+    }
+    if ((size_t)(oend - op) < lit_len) {
+        return NULL;
+    }
+    memcpy(op, lit, lit_len);
+    op += lit_len;
+    if (match_len == 0) {
+        return op;
+    }
+
+    if (oend - op < 2) {
+        return NULL;
+    }
+    *op++ = offset & 0xff;
+    *op++ = offset >> 8;
+    if (match_code >= LZ_LENGTH_MASK) {
+        op = put_length(op, oend, match_code - LZ_LENGTH_MASK);
+    }
+    return op;
+}
+
+/**
+ * Read the continuation bytes of a length whose nibble saturated
+ * @return 0 on success, -1 if the input ends first
+ */
+static int get_length(const unsigned char **ip, const unsigned char *iend, size_t *len)
+{
+    unsigned char byte;
+
+    do {
+        if (*ip == iend) {
+            return -1;
+        }
+        byte = *(*ip)++;
+        *len += byte;
+    } while (byte == 255);
+    return 0;
+}
+
+size_t lz_compress(const char *src, size_t len, char *dst, size_t cap)
+{
+    // Positions fit in 16 bits as blocks are at most LZ_BLOCK_SIZE
+    uint16_t table[1 << LZ_HASH_BITS];
+    const unsigned char *in = (const unsigned char *)src;
+    const unsigned char *iend = in + len;
+    const unsigned char *ip = in;
+    const unsigned char *anchor = in;
+    unsigned char *op = (unsigned char *)dst;
+    const unsigned char *oend = op + cap;
+
+    if (len > LZ_BLOCK_SIZE) {
+        return 0;
+    }
+    memset(table, 0, sizeof(table));
+
+    while (len >= LZ_MIN_MATCH && ip <= iend - LZ_MIN_MATCH) {
+        uint32_t seq = read32(ip);
+        unsigned int h = hash32(seq);
+        const unsigned char *ref = in + table[h];
+        table[h] = ip - in;
+        if (ref >= ip || ip - ref > LZ_MAX_OFFSET || read32(ref) != seq) {
+            // Step further the longer nothing has matched
+            ip += 1 + ((ip - anchor) >> 6);
+            continue;
+        }
+
+        const unsigned char *match_end = ip + LZ_MIN_MATCH;
+        ref += LZ_MIN_MATCH;
+        while (match_end < iend && *match_end == *ref) {
+            match_end++;
+            ref++;
+        }
+        op = put_sequence(op, oend, anchor, ip - anchor, match_end - ref, match_end - ip);
+        if (op == NULL) {
+            return 0;
+        }
+        ip = anchor = match_end;
+        // Let the next match start inside this one
+        if (ip <= iend - LZ_MIN_MATCH) {
+            table[hash32(read32(ip - 2))] = ip - 2 - in;
+        }
+    }
+
+    op = put_sequence(op, oend, anchor, iend - anchor, 0, 0);
+    return op != NULL ? (size_t)(op - (unsigned char *)dst) : 0;
+}
+
+ssize_t lz_decompress(const char *src, size_t len, char *dst, size_t cap)
+{
+    const unsigned char *ip = (const unsigned char *)src;
+    const unsigned char *iend = ip + len;
+    unsigned char *op = (unsigned char *)dst;
+    const unsigned char *oend = op + cap;
+
+    while (ip < iend) {
+        unsigned int token = *ip++;
+
+        size_t lit_len = token >> 4;
+        if (lit_len == LZ_LENGTH_MASK && get_length(&ip, iend, &lit_len) == -1) {
+            return -1;
+        }
+        if ((size_t)(iend - ip) < lit_len || (size_t)(oend - op) < lit_len) {
+            return -1;
+        }
+        memcpy(op, ip, lit_len);
+        op += lit_len;
+        ip += lit_len;
+        if (ip == iend) {
+            break;
+        }
+
+        if (iend - ip < 2) {
+            return -1;
+        }
+        size_t offset = ip[0] | ip[1] << 8;
+        ip += 2;
+        size_t match_len = token & LZ_LENGTH_MASK;
+        if (match_len == LZ_LENGTH_MASK && get_length(&ip, iend, &match_len) == -1) {
+            return -1;
+        }
+        match_len += LZ_MIN_MATCH;
+        if (offset == 0 || offset > (size_t)(op - (unsigned char *)dst) ||
+            (size_t)(oend - op) < match_len) {
+            return -1;
+        }
+
+        const unsigned char *ref = op - offset;
+        if (offset >= match_len) {
+            memcpy(op, ref, match_len);
+            op += match_len;
+        } else {
+            // Overlapping: the match repeats bytes it is writing
+            while (match_len-- > 0) {
+                *op++ = *ref++;
+            }
+        }
+    }
+
+    return op - (unsigned char *)dst;
+}
+
+size_t lz_frame_encode(const char *raw, size_t len, char *frame)
+{
+    struct lz_frame_header header;
+    char *payload = frame + sizeof(header);
+
+    // Anything not smaller than the raw bytes is stored as they are
+    size_t stored = len > 0 ? lz_compress(raw, len, payload, len - 1) : 0;
+    if (stored == 0) {
+        memcpy(payload, raw, len);
+        stored = len;
+    }
+    header.raw_len = htonl(len);
+    header.stored_len = htonl(stored);
+    memcpy(frame, &header, sizeof(header));
+    return sizeof(header) + stored;
+}
@@ -0,0 +1,57 @@
+/**
+ * @file lz.h
+ * @brief Block compression shared by aesdsocket and aesdbench
+ *
+ * A self-contained LZ77 codec in the style of LZ4: each block is a run of
+ * sequences, a token byte with the literal and match lengths, the
+ * literals, and a 16-bit back reference, the last sequence carrying
+ * literals only. Blocks are at most LZ_BLOCK_SIZE bytes and independent
+ * of each other, so any block can be decompressed on its own.
+ *
+ * Compressed replies (see COMPRESS_COMMAND) are a stream of frames: a
+ * struct lz_frame_header followed by stored_len bytes, the block itself
+ * when stored_len equals raw_len and its compressed form otherwise.
+ */
+
+#ifndef LZ_H
+#define LZ_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Largest block the codec takes, and the raw bytes of a full frame
+#define LZ_BLOCK_SIZE (64 * 1024)
+
+// Both fields in network byte order. A header of zeros with no payload
+// acknowledges COMPRESS_COMMAND.
+struct lz_frame_header {
+    uint32_t raw_len;
+    uint32_t stored_len;
+};
+
+// Largest frame: a block stored as it is
+#define LZ_FRAME_MAX (sizeof(struct lz_frame_header) + LZ_BLOCK_SIZE)
+
+/**
+ * Compress @param len bytes, at most LZ_BLOCK_SIZE, into @param dst
+ * @return the compressed length, or 0 if it would not fit in @param cap
+ */
+size_t lz_compress(const char *src, size_t len, char *dst, size_t cap);
+
+/**
+ * Decompress the block of @param len bytes in @param src into @param dst
+ * @return the decompressed length, or -1 if the block is corrupt or
+ * decompresses to more than @param cap bytes
+ */
+ssize_t lz_decompress(const char *src, size_t len, char *dst, size_t cap);
+
+/**
+ * Build the frame for @param len bytes, at most LZ_BLOCK_SIZE, in
+ * @param frame, which holds LZ_FRAME_MAX bytes; the bytes are stored as
+ * they are unless compressing makes them smaller
+ * @return the frame length
+ */
+size_t lz_frame_encode(const char *raw, size_t len, char *frame);
+
+#endif /* LZ_H */
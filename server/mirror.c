@@ -0,0 +1,299 @@
+/**
+ * @file mirror.c
+ * @brief In-memory mirror of the newest data file bytes for -M
+ *
+ * Every byte the file store appends is also copied into memory, so
+ * replies are sent straight from there instead of going back to the
+ * file. The mirror is a run of chunks of MIRROR_CHUNK_SIZE, each one huge
+ * page where the kernel allows, filled in order and never changed once
+ * written: a reply reads bytes the writer is done with, below the
+ * published length, and needs no lock beyond finding its chunk.
+ *
+ * Only the last config.mirror_bytes worth of chunks, rounded up, are
+ * kept. Once the
+ * cap is reached the oldest chunk is retired for the next one, and
+ * positions below the oldest chunk left are read from the file again. A
+ * reply still sending from a retired chunk holds a reference that keeps
+ * it mapped until the reply lets go.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "aesdsocket.h"
+
+struct mirror_chunk {
+    // Position of bytes[0]
+    size_t start;
+    unsigned int refs;
+    // Dropped for a newer chunk; unmapped once refs reaches 0
+    bool retired;
+    char bytes[];
+};
+
+#define MIRROR_CHUNK_BYTES (MIRROR_CHUNK_SIZE - offsetof(struct mirror_chunk, bytes))
+
+// Guards the chunk table and every chunk's refs and retired
+static pthread_mutex_t mirror_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Chunk k, counting from the one starting at origin, in slot k % slot_count
+static struct mirror_chunk **slots = NULL;
+static size_t slot_count = 0;
+static size_t origin = 0;
+// Oldest chunk held, and one past the newest
+static size_t oldest_chunk = 0;
+static size_t next_chunk = 0;
+
+// Bytes below this position and at or past the oldest chunk's start are
+// mirrored; written only by whoever owns the append path
+static size_t mirror_len = 0;
+
+/**
+ * Map a chunk aligned to MIRROR_CHUNK_SIZE, so it can be one huge page
+ * @return the chunk, or NULL on failure
+ */
+static struct mirror_chunk *chunk_map(size_t start)
+{
+    char *map = mmap(NULL, 2 * MIRROR_CHUNK_SIZE, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) {
+        syslog(LOG_ERR, "Failed to map data file mirror: %s", strerror(errno));
+        return NULL;
+    }
+
+    // Trim the mapping down to the aligned chunk inside it
+    uintptr_t aligned = ((uintptr_t)map + MIRROR_CHUNK_SIZE - 1) & ~(uintptr_t)(MIRROR_CHUNK_SIZE - 1);
+    size_t head = aligned - (uintptr_t)map;
+    if (head > 0) {
+        munmap(map, head);
+    }
+    munmap((char *)aligned + MIRROR_CHUNK_SIZE, MIRROR_CHUNK_SIZE - head);
+
+    // Only advice: without transparent huge pages the chunk still works
+    madvise((void *)aligned, MIRROR_CHUNK_SIZE, MADV_HUGEPAGE);
+
+    struct mirror_chunk *chunk = (struct mirror_chunk *)aligned;
+    chunk->start = start;
+    chunk->refs = 0;
+    chunk->retired = false;
+    return chunk;
+}
+
+static void chunk_unmap(struct mirror_chunk *chunk)
+{
+    munmap(chunk, MIRROR_CHUNK_SIZE);
+}
+
+/**
+ * Drop the oldest chunk held, unmapping it unless a reply still sends
+ * from it. Called with mirror_mutex held.
+ */
+static void retire_oldest(void)
+{
+    struct mirror_chunk *chunk = slots[oldest_chunk % slot_count];
+
+    slots[oldest_chunk % slot_count] = NULL;
+    oldest_chunk++;
+    if (chunk->refs == 0) {
+        chunk_unmap(chunk);
+    } else {
+        chunk->retired = true;
+    }
+}
+
+int mirror_open(size_t start)
+{
+    if (slots == NULL) {
+        slot_count = (config.mirror_bytes + MIRROR_CHUNK_SIZE - 1) / MIRROR_CHUNK_SIZE;
+        slots = calloc(slot_count, sizeof(*slots));
+        if (slots == NULL) {
+            syslog(LOG_ERR, "Failed to allocate data file mirror: %s", strerror(errno));
+            return -1;
+        }
+    }
+
+    pthread_mutex_lock(&mirror_mutex);
+    while (oldest_chunk < next_chunk) {
+        retire_oldest();
+    }
+    origin = start;
+    oldest_chunk = 0;
+    next_chunk = 0;
+    __atomic_store_n(&mirror_len, start, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&mirror_mutex);
+    return 0;
+}
+
+void mirror_close(void)
+{
+    if (slots == NULL) {
+        return;
+    }
+    mirror_open(0);
+    free(slots);
+    slots = NULL;
+    slot_count = 0;
+}
+
+/**
+ * Where the byte at @param pos goes, mapping a new chunk, and retiring
+ * the oldest past the cap, when the newest is full. Called only by
+ * whoever owns the append path, @param pos being the mirrored length.
+ * @return the address, with the room left in its chunk in @param room,
+ * or NULL on failure
+ */
+static char *mirror_space(size_t pos, size_t *room)
+{
+    size_t k = (pos - origin) / MIRROR_CHUNK_BYTES;
+
+    if (k == next_chunk) {
+        struct mirror_chunk *chunk = chunk_map(origin + k * MIRROR_CHUNK_BYTES);
+        if (chunk == NULL) {
+            return NULL;
+        }
+        pthread_mutex_lock(&mirror_mutex);
+        if (next_chunk - oldest_chunk == slot_count) {
+            retire_oldest();
+        }
+        slots[k % slot_count] = chunk;
+        next_chunk++;
+        pthread_mutex_unlock(&mirror_mutex);
+    }
+
+    // Only the append path adds or drops chunks, so no lock is needed
+    struct mirror_chunk *chunk = slots[k % slot_count];
+    size_t at = pos - chunk->start;
+    *room = MIRROR_CHUNK_BYTES - at;
+    return chunk->bytes + at;
+}
+
+/**
+ * Copy @param len bytes to the mirror at @param pos
+ * @return 0 on success, -1 on failure
+ */
+static int mirror_copy(size_t pos, const char *src, size_t len)
+{
+    while (len > 0) {
+        size_t room;
+        char *dst = mirror_space(pos, &room);
+        if (dst == NULL) {
+            return -1;
+        }
+        size_t bytes = len < room ? len : room;
+        memcpy(dst, src, bytes);
+        pos += bytes;
+        src += bytes;
+        len -= bytes;
+    }
+    return 0;
+}
+
+/**
+ * Copy the staged start of @param record to the mirror at @param pos
+ * @return 0 on success, -1 on failure
+ */
+static int mirror_copy_spill(size_t pos, const struct log_record *record)
+{
+    size_t copied = 0;
+
+    while (copied < record->spill_len) {
+        size_t room;
+        char *dst = mirror_space(pos + copied, &room);
+        if (dst == NULL) {
+            return -1;
+        }
+        size_t want = record->spill_len - copied;
+        ssize_t bytes = pread(record->spill_fd, dst, want < room ? want : room, copied);
+        if (bytes <= 0) {
+            if (bytes == -1 && errno == EINTR) {
+                continue;
+            }
+            syslog(LOG_ERR, "Failed to read staging file: %s",
+                   bytes == 0 ? "unexpected end of file" : strerror(errno));
+            return -1;
+        }
+        copied += bytes;
+    }
+    return 0;
+}
+
+void mirror_append(const struct log_record *first, int count, size_t start, size_t len)
+{
+    if (start != mirror_len && mirror_open(start) == -1) {
+        return;
+    }
+
+    size_t pos = start;
+    int ret = 0;
+    for (const struct log_record *record = first; ret == 0 && count > 0 && pos < start + len;
+         count--, record = record->next) {
+        // Only the prefix of the chain that reached the file
+        size_t left = start + len - pos;
+        size_t spill = record->spill_len < left ? record->spill_len : left;
+        if (spill > 0) {
+            struct log_record prefix = *record;
+            prefix.spill_len = spill;
+            ret = mirror_copy_spill(pos, &prefix);
+            pos += spill;
+            left -= spill;
+        }
+        size_t data = record->len < left ? record->len : left;
+        if (ret == 0 && data > 0) {
+            ret = mirror_copy(pos, record->data, data);
+            pos += data;
+        }
+    }
+
+    if (ret == -1) {
+        // Start over after these bytes; they and older ones come from the file
+        mirror_open(start + len);
+        return;
+    }
+    __atomic_store_n(&mirror_len, start + len, __ATOMIC_RELEASE);
+}
+
+const char *mirror_get(off_t pos, off_t end, size_t *len)
+{
+    const char *bytes = NULL;
+
+    pthread_mutex_lock(&mirror_mutex);
+    size_t published = __atomic_load_n(&mirror_len, __ATOMIC_ACQUIRE);
+    if (end > (off_t)published) {
+        end = published;
+    }
+    if (slots != NULL && oldest_chunk < next_chunk && pos < end &&
+        (size_t)pos >= origin + oldest_chunk * MIRROR_CHUNK_BYTES) {
+        struct mirror_chunk *chunk = slots[((size_t)pos - origin) / MIRROR_CHUNK_BYTES % slot_count];
+        size_t at = pos - chunk->start;
+        size_t room = MIRROR_CHUNK_BYTES - at;
+        chunk->refs++;
+        bytes = chunk->bytes + at;
+        *len = (size_t)(end - pos) < room ? (size_t)(end - pos) : room;
+    }
+    pthread_mutex_unlock(&mirror_mutex);
+    return bytes;
+}
+
+void mirror_put(const char *bytes)
+{
+    // Chunks are aligned to their size, so the address finds the chunk
+    struct mirror_chunk *chunk =
+        (struct mirror_chunk *)((uintptr_t)bytes & ~(uintptr_t)(MIRROR_CHUNK_SIZE - 1));
+    bool unmap;
+
+    pthread_mutex_lock(&mirror_mutex);
+    chunk->refs--;
+    unmap = chunk->retired && chunk->refs == 0;
+    pthread_mutex_unlock(&mirror_mutex);
+    if (unmap) {
+        chunk_unmap(chunk);
+    }
+}
@@ -0,0 +1,265 @@
+#!/bin/sh
+#
+# Check that the storage options answer what a plain run answers. Each
+# case runs the same aesdbench workload against aesdsocket twice, with
+# the server restarted, killed, or killed and left with a torn data file
+# in between where the option is about surviving that, then reads the
+# whole history back with a seek to record 0. The history must match a
+# plain -s file run, or with -k be a suffix of it; -P cases also seek into
+# the middle. The reply codec is checked on generated records and on the
+# history with aesdbench -C. Last, -m pool with one worker must answer a
+# single line while another client floods that worker.
+#
+# Usage: ./option-check.sh [-e "server options"]
+# e.g.   ./option-check.sh -e "-m uring"
+#
+# Cases use the default data file and port, so no other aesdsocket may be
+# running. Build with "make all bench" first.
+
+SERVER=./aesdsocket
+BENCH=./aesdbench
+DATA=/var/tmp/aesdsocketdata
+WORK=${TMPDIR:-/tmp}/option-check.$$
+SERVER_OPTS=
+# A few 64 KiB segments' worth, and more than one 2 MiB mirror chunk
+SMALL="-n 1000 -s 200 -w 50 -t"
+LARGE="-n 12000 -s 200 -w 400 -t"
+# Record and byte the -P cases seek to
+SEEK_RECORD=7
+SEEK_OFFSET=5
+# One pipelined batch the pool engine case floods its worker with, and
+# the bytes it appends
+FLOOD="-n 10000 -s 20 -w 10000"
+FLOOD_BYTES=200000
+
+if [ "$1" = "-e" ]; then
+    SERVER_OPTS=$2
+    shift 2
+fi
+
+# Acknowledged without appending anything, so it can tell when the
+# server is up without changing what it holds
+probe() {
+    $BENCH -x AESDCHAR_COMPRESS >/dev/null 2>&1
+}
+
+if probe; then
+    echo "A server is already listening on port 9000"
+    exit 1
+fi
+mkdir -p "$WORK" || exit 1
+pid=
+failed=0
+trap '[ -n "$pid" ] && kill $pid 2>/dev/null; rm -rf "$WORK"' EXIT
+
+start_once() {
+    $SERVER $SERVER_OPTS "$@" &
+    pid=$!
+    tries=0
+    until probe; do
+        tries=$((tries + 1))
+        if [ $tries -ge 50 ] || ! kill -0 $pid 2>/dev/null; then
+            kill $pid 2>/dev/null
+            wait $pid 2>/dev/null
+            pid=
+            return 1
+        fi
+        sleep 0.1
+    done
+}
+
+# After a kill the io_uring engine's listener outlives the process for a
+# moment, until the kernel tears its ring down, so binding can fail
+start() {
+    attempts=0
+    until start_once "$@"; do
+        attempts=$((attempts + 1))
+        if [ $attempts -ge 5 ]; then
+            return 1
+        fi
+        sleep 0.2
+    done
+}
+
+stop() {
+    kill -$1 $pid
+    wait $pid 2>/dev/null
+    pid=
+}
+
+fail() {
+    echo "FAIL $1: $2"
+    failed=1
+}
+
+# Read everything the server holds into $1, decoding compressed replies
+# with -z as a second argument
+history() {
+    $BENCH $2 -x AESDCHAR_IOCSEEKTO:0,0 > "$1"
+}
+
+# run_case name between workload [server options]: start the server,
+# run the workload, restart (restart), kill and restart (crash), or also
+# tear the data file (tear) if asked, run it again and leave the history
+# in $WORK/name with the server still running
+run_case() {
+    name=$1
+    between=$2
+    workload=$3
+    shift 3
+
+    rm -f "$DATA" "$DATA".*
+    if ! start "$@"; then
+        fail "$name" "server did not start"
+        return 1
+    fi
+    $BENCH -c 1 $workload >/dev/null || fail "$name" "first run failed"
+
+    case $between in
+        restart)
+            stop TERM
+            ;;
+        crash)
+            stop KILL
+            ;;
+        tear)
+            stop KILL
+            # A partial line and half a sidecar entry, as a crash mid-append leaves
+            printf 'torn partial line' >> "$DATA"
+            [ -e "$DATA.idx" ] && truncate -s -10 "$DATA.idx"
+            ;;
+    esac
+    if [ -z "$pid" ] && ! start "$@"; then
+        fail "$name" "server did not restart"
+        return 1
+    fi
+    $BENCH -c 1 $workload >/dev/null || fail "$name" "second run failed"
+    history "$WORK/$name"
+}
+
+# The lines written, leaving out the timestamps the server adds
+records() {
+    grep -av '^timestamp:' "$1"
+}
+
+same() {
+    records "$WORK/$1" > "$WORK/$1.records"
+    records "$WORK/$2" > "$WORK/$2.records"
+    if cmp -s "$WORK/$1.records" "$WORK/$2.records"; then
+        echo "ok   $1"
+    else
+        fail "$1" "history differs from $2"
+    fi
+}
+
+# Seek into the middle and compare with the same place in $2
+seek_check() {
+    $BENCH -x AESDCHAR_IOCSEEKTO:$SEEK_RECORD,$SEEK_OFFSET > "$WORK/$1.seek"
+    tail -n +$((SEEK_RECORD + 1)) "$WORK/$2" | tail -c +$((SEEK_OFFSET + 1)) > "$WORK/$1.seek.expected"
+    cmp -s "$WORK/$1.seek" "$WORK/$1.seek.expected" || fail "$1" "seek differs from $2"
+}
+
+# Wait for the background compactor to leave compressed segments
+wait_packed() {
+    tries=0
+    until ls "$DATA".*.lz >/dev/null 2>&1; do
+        tries=$((tries + 1))
+        if [ $tries -ge 50 ]; then
+            return 1
+        fi
+        sleep 0.1
+    done
+}
+
+# Plain runs every case is compared with
+run_case small none "$SMALL" -s file && stop TERM
+run_case large none "$LARGE" -s file && stop TERM
+
+# -P: the sidecar index after a clean restart and after a torn crash
+if run_case persist restart "$SMALL" -P; then
+    seek_check persist small
+    stop TERM
+    same persist small
+fi
+if run_case persist-torn tear "$SMALL" -P; then
+    seek_check persist-torn small
+    stop TERM
+    same persist-torn small
+fi
+
+# -a: the zero tail trimmed after a crash, and truncated on shutdown
+run_case prealloc-crash crash "$SMALL" -a 65536 && stop TERM && same prealloc-crash small
+if run_case prealloc restart "$SMALL" -a 65536 -P; then
+    stop TERM
+    cmp -s "$DATA" "$WORK/prealloc" || fail prealloc "data file not truncated back to its records"
+    same prealloc small
+fi
+
+# -M: more than the mirror holds, so chunks are retired under replies
+run_case mirror none "$LARGE" -M 2097152 && stop TERM && same mirror large
+
+# -s segments: plain, adopted after a restart, compressed and retained
+run_case segments none "$SMALL" -s segments:65536 && stop TERM && same segments small
+if run_case segments-persist restart "$SMALL" -s segments:65536 -P; then
+    seek_check segments-persist small
+    stop TERM
+    same segments-persist small
+fi
+if run_case segments-packed restart "$SMALL" -s segments:65536 -z -P; then
+    wait_packed || fail segments-packed "no segment was compressed"
+    history "$WORK/segments-packed" && history "$WORK/segments-framed" -z
+    stop TERM
+    same segments-packed small
+    same segments-framed small
+fi
+if run_case segments-retained none "$SMALL" -s segments:65536 -k bytes:131072; then
+    stop TERM
+    kept=$(wc -c < "$WORK/segments-retained")
+    if [ "$kept" -ge "$(wc -c < "$WORK/small")" ] ||
+       ! tail -c "$kept" "$WORK/small" | cmp -s - "$WORK/segments-retained"; then
+        fail segments-retained "history is not a shorter suffix of small"
+    else
+        echo "ok   segments-retained"
+    fi
+fi
+
+# -m pool: a line sent while another client floods the only worker must be
+# answered before the flood is done, so its reply holds only part of it.
+# With -f record every flood packet waits for an fsync, so the flood lasts
+# long enough for the line to arrive in the middle of it. The -e options
+# are left out, as -p would fold the flood into a few appends.
+rm -f "$DATA" "$DATA".*
+engine_opts=$SERVER_OPTS
+SERVER_OPTS=
+if start -m pool -t 1 -i -f record; then
+    $BENCH -c 1 $FLOOD >/dev/null &
+    flood=$!
+    tries=0
+    until [ -s "$DATA" ] || [ $tries -ge 50 ]; do
+        tries=$((tries + 1))
+        sleep 0.1
+    done
+    $BENCH -x "pool fairness probe" > "$WORK/pool-fairness"
+    wait $flood || fail pool-fairness "flood failed"
+    stop TERM
+    if [ "$(wc -c < "$WORK/pool-fairness")" -ge $FLOOD_BYTES ]; then
+        fail pool-fairness "a single line waited for the whole flood"
+    else
+        echo "ok   pool-fairness"
+    fi
+else
+    fail pool-fairness "server did not start"
+fi
+SERVER_OPTS=$engine_opts
+rm -f "$DATA" "$DATA".*
+
+# The reply and segment codec
+for input in "" "$WORK/large"; do
+    if $BENCH -C -s 200 $input > "$WORK/codec" 2>&1; then
+        echo "ok   codec ${input:-generated}"
+    else
+        fail "codec ${input:-generated}" "$(tail -n 1 "$WORK/codec")"
+    fi
+done
+
+exit $failed
@@ -0,0 +1,478 @@
+/**
+ * @file pool_engine.c
+ * @brief Worker pool engine with work-stealing for aesdsocket
+ *
+ * A fixed set of worker threads (one per core by default, -t to override)
+ * serves every connection, so accepting a client costs a queue push
+ * rather than a thread creation. Each worker owns a deque of runnable
+ * connections: it pops its own newest entry, which is most likely still
+ * in cache, and when its deque is empty it steals the oldest entry from
+ * another worker, which keeps the cores busy under skewed load. A
+ * connection that used up its turn is queued behind everything else on
+ * its deque, so one busy client cannot keep the others from their turn.
+ *
+ * The main thread accepts new clients and waits in epoll for parked
+ * connections. A worker runs a connection until its socket would block,
+ * then parks it with a one-shot epoll registration; when the socket is
+ * ready again the main thread pushes it back onto the deque of the
+ * worker that last ran it. A connection is therefore in exactly one
+ * place at a time: a deque, epoll, or the worker running it. Replies are
+ * produced one packet at a time exactly as in the thread-per-connection
+ * engine.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/queue.h>
+
+#include "aesdsocket.h"
+
+#define MAX_EVENTS 64
+// Packets a connection may handle per turn before yielding its worker
+#define POOL_TURN_BUDGET 16
+
+struct pool_conn {
+    int fd;
+    char client_ip[INET_ADDRSTRLEN];
+    struct recv_buffer rx;
+    bool peer_closed;
+    bool registered;
+
+    // Reply in flight: data file bytes [reply_pos, reply_end)
+    bool replying;
+    off_t reply_pos;
+    off_t reply_end;
+    struct reply_codec codec;
+
+    // Worker whose deque the connection returns to when it is ready
+    int home;
+
+    TAILQ_ENTRY(pool_conn) entries;
+    LIST_ENTRY(pool_conn) all_entries;
+};
+
+struct pool_worker {
+    pthread_t thread_id;
+    int id;
+    pthread_mutex_t lock;
+    TAILQ_HEAD(pool_deque, pool_conn) deque;
+    unsigned long turns;
+    unsigned long steals;
+};
+
+// Outcome of one turn of a connection on a worker
+enum turn_result {
+    TURN_PARKED,
+    TURN_YIELD,
+    TURN_CLOSE,
+    TURN_SUBSCRIBE,
+};
+
+static struct pool_worker *workers;
+static int worker_count;
+static int epoll_fd = -1;
+// One post per queued connection, plus one per worker at shutdown
+static sem_t work_available;
+static volatile bool pool_stopping;
+
+// Every open connection, so shutdown can release the parked ones
+static LIST_HEAD(, pool_conn) all_conns = LIST_HEAD_INITIALIZER(all_conns);
+static pthread_mutex_t all_conns_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void conn_close(struct pool_conn *conn)
+{
+    pthread_mutex_lock(&all_conns_lock);
+    LIST_REMOVE(conn, all_entries);
+    pthread_mutex_unlock(&all_conns_lock);
+
+    close(conn->fd);
+    syslog(LOG_INFO, "Closed connection from %s", conn->client_ip);
+    recv_buffer_release(&conn->rx);
+    reply_codec_release(&conn->codec);
+    free(conn);
+}
+
+/**
+ * Pass a subscribed connection to the fan-out thread and free the rest
+ */
+static void conn_hand_off(struct pool_conn *conn)
+{
+    pthread_mutex_lock(&all_conns_lock);
+    LIST_REMOVE(conn, all_entries);
+    pthread_mutex_unlock(&all_conns_lock);
+
+    if (conn->registered && epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL) == -1) {
+        syslog(LOG_ERR, "Failed to unregister connection: %s", strerror(errno));
+    }
+    // Every earlier reply has been sent in full
+    subscribe_follow(conn->fd, conn->client_ip, data_file_length(), conn->codec.enabled);
+    recv_buffer_release(&conn->rx);
+    reply_codec_release(&conn->codec);
+    free(conn);
+}
+
+/**
+ * Queue a runnable connection on a worker's deque and wake a worker. A
+ * connection that used up its turn goes in at the head, which its owner
+ * takes from last, so every other connection queued there runs first.
+ */
+static void pool_push(struct pool_conn *conn, int worker, bool yielded)
+{
+    struct pool_worker *w = &workers[worker];
+
+    pthread_mutex_lock(&w->lock);
+    if (yielded) {
+        TAILQ_INSERT_HEAD(&w->deque, conn, entries);
+    } else {
+        TAILQ_INSERT_TAIL(&w->deque, conn, entries);
+    }
+    pthread_mutex_unlock(&w->lock);
+    sem_post(&work_available);
+}
+
+/**
+ * Take the newest connection from our own deque, or else steal the
+ * oldest one from another worker
+ */
+static struct pool_conn *pool_take(struct pool_worker *self)
+{
+    struct pool_conn *conn;
+
+    pthread_mutex_lock(&self->lock);
+    conn = TAILQ_LAST(&self->deque, pool_deque);
+    if (conn != NULL) {
+        TAILQ_REMOVE(&self->deque, conn, entries);
+    }
+    pthread_mutex_unlock(&self->lock);
+    if (conn != NULL) {
+        return conn;
+    }
+
+    for (int i = 1; i < worker_count && conn == NULL; i++) {
+        struct pool_worker *victim = &workers[(self->id + i) % worker_count];
+
+        pthread_mutex_lock(&victim->lock);
+        conn = TAILQ_FIRST(&victim->deque);
+        if (conn != NULL) {
+            TAILQ_REMOVE(&victim->deque, conn, entries);
+        }
+        pthread_mutex_unlock(&victim->lock);
+    }
+    if (conn != NULL) {
+        self->steals++;
+        conn->home = self->id;
+    }
+    return conn;
+}
+
+/**
+ * Hand a blocked connection to epoll until its socket is ready. The
+ * connection may run on another worker before this returns, so the
+ * caller must not touch it afterwards.
+ * @return 0 on success, -1 on failure (the connection is still ours)
+ */
+static int conn_park(struct pool_conn *conn, uint32_t events)
+{
+    struct epoll_event ev = {
+        .events = events | EPOLLONESHOT | EPOLLRDHUP,
+        .data.ptr = conn,
+    };
+    int op = conn->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+
+    conn->registered = true;
+    if (epoll_ctl(epoll_fd, op, conn->fd, &ev) == -1) {
+        syslog(LOG_ERR, "Failed to park connection: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Run a connection until it blocks, closes or uses up its turn
+ */
+static enum turn_result conn_turn(struct pool_conn *conn)
+{
+    int budget = POOL_TURN_BUDGET;
+
+    for (;;) {
+        if (conn->replying) {
+            int ret = send_file_range(conn->fd, &conn->reply_pos, &conn->reply_end, &conn->codec);
+            if (ret == 1) {
+                return conn_park(conn, EPOLLOUT) == 0 ? TURN_PARKED : TURN_CLOSE;
+            }
+            if (ret == -1) {
+                return TURN_CLOSE;
+            }
+            conn->replying = false;
+        }
+
+        const char *packet;
+        size_t packet_size;
+        if ((packet = recv_buffer_next_packet(&conn->rx, &packet_size)) != NULL) {
+            if (budget-- == 0) {
+                return TURN_YIELD;
+            }
+            if (recv_buffer_packet_is(&conn->rx, packet, packet_size, SUBSCRIBE_COMMAND)) {
+                return TURN_SUBSCRIBE;
+            }
+            if (recv_buffer_packet_is(&conn->rx, packet, packet_size, COMPRESS_COMMAND)) {
+                recv_buffer_consume(&conn->rx, packet_size);
+                if (reply_codec_start(&conn->codec, conn->fd) == -1) {
+                    return TURN_CLOSE;
+                }
+                // An empty range, to send just the acknowledgement
+                conn->replying = true;
+                conn->reply_pos = conn->reply_end;
+                continue;
+            }
+
+            // A seek is answered from the record index and not appended
+            struct aesd_seekto seekto;
+            if (recv_buffer_parse_seekto(&conn->rx, packet, packet_size, &seekto)) {
+                recv_buffer_consume(&conn->rx, packet_size);
+                conn->replying = true;
+                conn->reply_pos = seekto_reply_start(&seekto, &conn->reply_end);
+                continue;
+            }
+
+            struct log_record record = {
+                .data = packet,
+                .len = packet_size,
+            };
+            record.spill_fd = recv_buffer_take_spill(&conn->rx, &record.spill_len);
+            size_t file_len = log_submit_wait(&record) == 0 ? record.end : data_file_length();
+            recv_buffer_consume(&conn->rx, packet_size);
+
+            conn->replying = true;
+            conn->reply_pos = reply_next_start(conn->reply_end);
+            conn->reply_end = file_len;
+            continue;
+        }
+
+        if (conn->peer_closed) {
+            return TURN_CLOSE;
+        }
+
+        size_t space;
+        char *recv_pos = recv_buffer_reserve(&conn->rx, BUFFER_SIZE, &space);
+        if (recv_pos == NULL) {
+            return TURN_CLOSE;
+        }
+        ssize_t bytes_received = recv(conn->fd, recv_pos, space, 0);
+        if (bytes_received > 0) {
+            if (recv_buffer_produce(&conn->rx, bytes_received) == -1) {
+                return TURN_CLOSE;
+            }
+        } else if (bytes_received == 0) {
+            conn->peer_closed = true;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return conn_park(conn, EPOLLIN) == 0 ? TURN_PARKED : TURN_CLOSE;
+        } else if (errno != EINTR) {
+            syslog(LOG_ERR, "Failed to receive data: %s", strerror(errno));
+            return TURN_CLOSE;
+        }
+    }
+}
+
+/**
+ * Worker thread function
+ */
+static void *worker_run(void *arg)
+{
+    struct pool_worker *self = arg;
+
+    for (;;) {
+        while (sem_wait(&work_available) == -1 && errno == EINTR) {
+            // Retry until there is work or shutdown
+        }
+        if (pool_stopping) {
+            break;
+        }
+
+        // Our post guarantees a queued connection; it may be on any deque
+        struct pool_conn *conn;
+        while ((conn = pool_take(self)) == NULL) {
+            sched_yield();
+        }
+
+        self->turns++;
+        switch (conn_turn(conn)) {
+            case TURN_YIELD:
+                pool_push(conn, self->id, true);
+                break;
+            case TURN_CLOSE:
+                conn_close(conn);
+                break;
+            case TURN_SUBSCRIBE:
+                conn_hand_off(conn);
+                break;
+            case TURN_PARKED:
+                break;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Accept every pending client and queue it on the workers in turn
+ */
+static void accept_connections(int *next_worker)
+{
+    for (;;) {
+        struct sockaddr_in client_addr;
+        socklen_t client_addr_len = sizeof(client_addr);
+        int client_fd = accept4(server_fd, (struct sockaddr *)&client_addr, &client_addr_len,
+                                SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_fd == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && !caught_signal) {
+                syslog(LOG_ERR, "Failed to accept connection: %s", strerror(errno));
+            }
+            return;
+        }
+
+        struct pool_conn *conn = calloc(1, sizeof(*conn));
+        if (conn == NULL) {
+            syslog(LOG_ERR, "Failed to allocate connection: %s", strerror(errno));
+            close(client_fd);
+            continue;
+        }
+        conn->fd = client_fd;
+        inet_ntop(AF_INET, &client_addr.sin_addr, conn->client_ip, sizeof(conn->client_ip));
+        syslog(LOG_INFO, "Accepted connection from %s", conn->client_ip);
+
+        pthread_mutex_lock(&all_conns_lock);
+        LIST_INSERT_HEAD(&all_conns, conn, all_entries);
+        pthread_mutex_unlock(&all_conns_lock);
+
+        conn->home = *next_worker;
+        *next_worker = (*next_worker + 1) % worker_count;
+        pool_push(conn, conn->home, false);
+    }
+}
+
+int pool_engine_run(void)
+{
+    int started = 0;
+    int ret = 0;
+    sigset_t block_mask, orig_mask;
+    struct epoll_event events[MAX_EVENTS];
+
+    int flags = fcntl(server_fd, F_GETFL);
+    if (flags == -1 || fcntl(server_fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        syslog(LOG_ERR, "Failed to make listening socket non-blocking: %s", strerror(errno));
+        return -1;
+    }
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd == -1) {
+        syslog(LOG_ERR, "Failed to create epoll instance: %s", strerror(errno));
+        return -1;
+    }
+    struct epoll_event listen_ev = {
+        .events = EPOLLIN,
+        .data.ptr = NULL,
+    };
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_fd, &listen_ev) == -1) {
+        syslog(LOG_ERR, "Failed to register with epoll: %s", strerror(errno));
+        close(epoll_fd);
+        return -1;
+    }
+
+    worker_count = config.loop_threads;
+    workers = calloc(worker_count, sizeof(*workers));
+    if (workers == NULL) {
+        syslog(LOG_ERR, "Failed to allocate workers: %s", strerror(errno));
+        close(epoll_fd);
+        return -1;
+    }
+    sem_init(&work_available, 0, 0);
+    pool_stopping = false;
+
+    // Workers inherit a mask with the termination signals blocked so they
+    // always interrupt this thread's epoll_pwait()
+    sigemptyset(&block_mask);
+    sigaddset(&block_mask, SIGINT);
+    sigaddset(&block_mask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &block_mask, &orig_mask);
+
+    for (started = 0; started < worker_count; started++) {
+        struct pool_worker *w = &workers[started];
+        w->id = started;
+        pthread_mutex_init(&w->lock, NULL);
+        TAILQ_INIT(&w->deque);
+        if (pthread_create(&w->thread_id, NULL, worker_run, w) != 0) {
+            syslog(LOG_ERR, "Failed to create worker thread");
+            pthread_mutex_destroy(&w->lock);
+            ret = -1;
+            break;
+        }
+    }
+
+    if (ret == 0) {
+        int next_worker = 0;
+
+        syslog(LOG_INFO, "Started worker pool with %d threads", worker_count);
+        while (!caught_signal) {
+            int count = epoll_pwait(epoll_fd, events, MAX_EVENTS, -1, &orig_mask);
+            if (count == -1) {
+                if (errno != EINTR) {
+                    syslog(LOG_ERR, "epoll_wait failed: %s", strerror(errno));
+                    ret = -1;
+                    break;
+                }
+                continue;
+            }
+
+            for (int i = 0; i < count; i++) {
+                struct pool_conn *conn = events[i].data.ptr;
+                if (conn == NULL) {
+                    accept_connections(&next_worker);
+                } else {
+                    pool_push(conn, conn->home, false);
+                }
+            }
+        }
+    }
+
+    // Stop the workers, then release whatever is still queued or parked
+    pool_stopping = true;
+    for (int i = 0; i < started; i++) {
+        sem_post(&work_available);
+    }
+    unsigned long turns = 0, steals = 0;
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i].thread_id, NULL);
+        pthread_mutex_destroy(&workers[i].lock);
+        turns += workers[i].turns;
+        steals += workers[i].steals;
+    }
+    while (!LIST_EMPTY(&all_conns)) {
+        conn_close(LIST_FIRST(&all_conns));
+    }
+    syslog(LOG_INFO, "Worker pool ran %lu connection turns, %lu stolen", turns, steals);
+
+    pthread_sigmask(SIG_SETMASK, &orig_mask, NULL);
+    sem_destroy(&work_available);
+    free(workers);
+    workers = NULL;
+    close(epoll_fd);
+    epoll_fd = -1;
+
+    return ret;
+}
@@ -0,0 +1,47 @@
+#!/bin/sh
+#
+# Run the same aesdbench workload against the file store with the data
+# file grown by each append and grown in preallocated extents (-a), and
+# report each one's results. Replies carry only the new bytes (-i) and
+# are sent once the record is synced (-f record), so round trip times
+# are mostly append latency.
+#
+# Usage: ./prealloc-bench.sh [-e "server options"] [aesdbench options]
+# e.g.   ./prealloc-bench.sh -e "-m epoll" -c 4 -n 2000 -s 256
+#
+# EXTENT sets the -a extent size, 64 MiB unless set. The data file is
+# the default one unless the server options name another with -s file:path.
+# Build with "make all bench" first.
+
+SERVER=./aesdsocket
+BENCH=./aesdbench
+EXTENT=${EXTENT:-67108864}
+SERVER_OPTS=
+
+if [ "$1" = "-e" ]; then
+    SERVER_OPTS=$2
+    shift 2
+fi
+
+for prealloc in "" "-a $EXTENT"; do
+    echo "== -i -f record $prealloc $SERVER_OPTS"
+    $SERVER -i -f record $prealloc $SERVER_OPTS &
+    pid=$!
+
+    # Wait for the listener with a one packet round trip
+    tries=0
+    until $BENCH -c 1 -n 1 >/dev/null 2>&1; do
+        tries=$((tries + 1))
+        if [ $tries -ge 50 ] || ! kill -0 $pid 2>/dev/null; then
+            echo "Server did not start"
+            kill $pid 2>/dev/null
+            exit 1
+        fi
+        sleep 0.1
+    done
+
+    $BENCH "$@"
+
+    kill -TERM $pid
+    wait $pid
+done
@@ -0,0 +1,233 @@
+/**
+ * @file record_index.c
+ * @brief Line start index for stores that keep files
+ *
+ * Records where each line of a store starts, so AESDCHAR_IOCSEEKTO can
+ * turn "record X, byte Y" into a position with one array lookup. Whoever
+ * owns the append path adds lines as records are appended, or scans
+ * what a file already holds; lookups take the index mutex and only see
+ * lines below the committed length. Lines of data a store has dropped
+ * are trimmed from the front, so record numbers count from the oldest
+ * line still held. With -P the lines of earlier runs are not read back
+ * at all: they are looked up in the mapped sidecar (see index_file.c).
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <errno.h>
+
+#include "aesdsocket.h"
+
+// Scan buffer for indexing what a file already holds
+#define INDEX_SCAN_SIZE (64 * 1024)
+
+/**
+ * Add the start of the next line, growing the index geometrically.
+ * Called with the index mutex held.
+ * @return 0 on success, -1 if memory ran out
+ */
+static int index_push(struct record_index *index, size_t start)
+{
+    if (index->count == index->capacity) {
+        // Reuse the room trimmed lines left at the front first
+        if (index->head >= index->capacity / 2 && index->head > 0) {
+            memmove(index->starts, index->starts + index->head,
+                    (index->count - index->head) * sizeof(*index->starts));
+            index->count -= index->head;
+            index->head = 0;
+        } else {
+            size_t new_capacity = index->capacity > 0 ? index->capacity * 2 : BUFFER_SIZE;
+            size_t *new_starts = realloc(index->starts, new_capacity * sizeof(*new_starts));
+            if (new_starts == NULL) {
+                syslog(LOG_ERR, "Failed to grow record index: %s", strerror(errno));
+                return -1;
+            }
+            index->starts = new_starts;
+            index->capacity = new_capacity;
+        }
+    }
+    index->starts[index->count++] = start;
+    return 0;
+}
+
+/**
+ * Start of line @param k, counted from the oldest line held. Called with
+ * the index mutex held.
+ */
+static size_t line_start(const struct record_index *index, size_t k)
+{
+    if (k < index->persisted_count) {
+        return index->persisted[k].start;
+    }
+    return index->starts[index->head + k - index->persisted_count];
+}
+
+void record_index_reset(struct record_index *index, size_t start)
+{
+    pthread_mutex_lock(&index->mutex);
+    index->persisted = NULL;
+    index->persisted_count = 0;
+    index->head = 0;
+    index->count = 0;
+    index->len = start;
+    index->line_start = true;
+    pthread_mutex_unlock(&index->mutex);
+}
+
+void record_index_preload(struct record_index *index, const struct index_entry *entries,
+                          size_t count, size_t len)
+{
+    pthread_mutex_lock(&index->mutex);
+    index->persisted = entries;
+    index->persisted_count = count;
+    index->head = 0;
+    index->count = 0;
+    index->len = len;
+    index->line_start = true;
+    pthread_mutex_unlock(&index->mutex);
+}
+
+size_t record_index_add(struct record_index *index, const struct log_record *record, size_t start)
+{
+    size_t lines = 1;
+
+    pthread_mutex_lock(&index->mutex);
+    index_push(index, start);
+    // Without -p a record is exactly one line; a batch is scanned for the
+    // lines inside. A staged start never holds a newline.
+    if (config.batch_packets) {
+        const char *line = record->data;
+        const char *last = record->data + record->len - 1;
+        const char *newline;
+        while ((newline = memchr(line, '\n', last - line)) != NULL) {
+            line = newline + 1;
+            index_push(index, start + record->spill_len + (line - record->data));
+            lines++;
+        }
+    }
+    index->len = start + record->spill_len + record->len;
+    index->line_start = true;
+    pthread_mutex_unlock(&index->mutex);
+
+    return lines;
+}
+
+/**
+ * Index the lines started in @param len bytes at position index->len.
+ * Called with the index mutex held.
+ * @return the lines started, or -1 if memory ran out
+ */
+static ssize_t index_bytes(struct record_index *index, const char *buf, size_t len)
+{
+    const char *p = buf;
+    size_t lines = 0;
+
+    while (p < buf + len) {
+        if (index->line_start) {
+            if (index_push(index, index->len + (p - buf)) == -1) {
+                return -1;
+            }
+            lines++;
+        }
+        const char *newline = memchr(p, '\n', buf + len - p);
+        index->line_start = newline != NULL;
+        if (newline == NULL) {
+            break;
+        }
+        p = newline + 1;
+    }
+    index->len += len;
+    return lines;
+}
+
+ssize_t record_index_scan(struct record_index *index, int fd, size_t size, const char *name)
+{
+    char buf[INDEX_SCAN_SIZE];
+    size_t pos = 0;
+    size_t lines = 0;
+    ssize_t ret = 0;
+
+    pthread_mutex_lock(&index->mutex);
+    while (ret == 0 && pos < size) {
+        size_t want = size - pos < sizeof(buf) ? size - pos : sizeof(buf);
+        ssize_t bytes = pread(fd, buf, want, pos);
+        if (bytes <= 0) {
+            if (bytes == -1 && errno == EINTR) {
+                continue;
+            }
+            syslog(LOG_ERR, "Failed to index %s: %s", name,
+                   bytes == 0 ? "unexpected end of file" : strerror(errno));
+            ret = -1;
+            break;
+        }
+
+        ssize_t started = index_bytes(index, buf, bytes);
+        if (started == -1) {
+            ret = -1;
+            break;
+        }
+        lines += started;
+        pos += bytes;
+    }
+    pthread_mutex_unlock(&index->mutex);
+
+    return ret == 0 ? (ssize_t)lines : -1;
+}
+
+ssize_t record_index_scan_buffer(struct record_index *index, const char *buf, size_t len)
+{
+    pthread_mutex_lock(&index->mutex);
+    ssize_t lines = index_bytes(index, buf, len);
+    pthread_mutex_unlock(&index->mutex);
+
+    return lines;
+}
+
+void record_index_trim(struct record_index *index, size_t pos)
+{
+    pthread_mutex_lock(&index->mutex);
+    while (index->head < index->count && index->starts[index->head] < pos) {
+        index->head++;
+    }
+    pthread_mutex_unlock(&index->mutex);
+}
+
+int record_index_seek(struct record_index *index, unsigned int record, unsigned int offset,
+                      off_t *pos)
+{
+    int ret = -1;
+
+    pthread_mutex_lock(&index->mutex);
+    // Lines past the committed length are not there for readers yet, and
+    // after rotation those of the old file no longer are
+    size_t limit = data_file_length() < index->len ? data_file_length() : index->len;
+    size_t lines = index->persisted_count + index->count - index->head;
+    if (record < lines && line_start(index, record) < limit) {
+        size_t start = line_start(index, record);
+        size_t end = record + 1 < lines ? line_start(index, record + 1) : limit;
+        if (end > limit) {
+            end = limit;
+        }
+        if (offset < end - start) {
+            *pos = start + offset;
+            ret = 0;
+        }
+    }
+    pthread_mutex_unlock(&index->mutex);
+
+    return ret;
+}
+
+void record_index_free(struct record_index *index)
+{
+    index->persisted = NULL;
+    index->persisted_count = 0;
+    free(index->starts);
+    index->starts = NULL;
+    index->head = 0;
+    index->count = 0;
+    index->capacity = 0;
+    index->len = 0;
+}
@@ -0,0 +1,265 @@
+/**
+ * @file recv_buffer.c
+ * @brief Per-connection receive buffer and packet framing for aesdsocket
+ *
+ * Unconsumed bytes live in the window [start, start + used) of one
+ * contiguous allocation, so every framed packet can be appended straight
+ * from the buffer. Consuming a packet only advances start. Free space at
+ * the front is reclaimed by sliding the window down, but only when that
+ * frees at least half of the buffer; otherwise the buffer doubles. Either
+ * way each byte is copied a bounded number of times on average, so
+ * receiving and framing cost O(bytes) however large or pipelined the
+ * input is. Once a burst has been consumed, a buffer that grew beyond
+ * RECV_BUFFER_IDLE_MAX is handed back to the allocator.
+ *
+ * With -b a partial packet that grows past config.spill_threshold bytes is
+ * moved to an unnamed staging file in SPILL_DIR, and later bytes join it
+ * each time the threshold is crossed again. When the newline arrives the
+ * staged bytes travel with the packet's log_record and the log writer
+ * appends them in one piece, so memory per connection stays bounded by
+ * the threshold however long the packet is.
+ *
+ * With -p the packets are framed in runs: everything up to the last
+ * newline received so far goes out as one record with one reply, so a
+ * pipelining client costs one append and one reply per read rather than
+ * per packet. A packet that may be a command ends the run before it and
+ * is framed alone, so engines see commands exactly as without -p.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <errno.h>
+
+#include "aesdsocket.h"
+
+// Largest buffer kept once a connection has nothing left to frame
+#define RECV_BUFFER_IDLE_MAX (16 * BUFFER_SIZE)
+
+char *recv_buffer_reserve(struct recv_buffer *buf, size_t min_space, size_t *space)
+{
+    if (buf->size - buf->start - buf->used < min_space) {
+        if (buf->used + min_space <= buf->size && buf->used <= buf->size / 2) {
+            // Sliding down frees at least as much as it copies
+            memmove(buf->data, buf->data + buf->start, buf->used);
+        } else {
+            size_t new_size = buf->size > 0 ? buf->size * 2 : BUFFER_SIZE;
+            while (new_size < buf->used + min_space) {
+                new_size *= 2;
+            }
+
+            char *new_data = malloc(new_size);
+            if (new_data == NULL) {
+                syslog(LOG_ERR, "Failed to allocate memory: %s", strerror(errno));
+                return NULL;
+            }
+            if (buf->used > 0) {
+                memcpy(new_data, buf->data + buf->start, buf->used);
+            }
+            free(buf->data);
+            buf->data = new_data;
+            buf->size = new_size;
+        }
+        buf->start = 0;
+    }
+
+    if (space != NULL) {
+        *space = buf->size - buf->start - buf->used;
+    }
+    return buf->data + buf->start + buf->used;
+}
+
+/**
+ * Create an unnamed staging file, falling back to an unlinked temporary
+ * file where O_TMPFILE is unsupported
+ * @return the descriptor, or -1 on failure
+ */
+static int spill_open(void)
+{
+    int fd = open(SPILL_DIR, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        char path[] = SPILL_DIR "/aesdsocketspill.XXXXXX";
+        fd = mkostemp(path, O_CLOEXEC);
+        if (fd != -1) {
+            unlink(path);
+        }
+    }
+    if (fd == -1) {
+        syslog(LOG_ERR, "Failed to create staging file: %s", strerror(errno));
+    }
+    return fd;
+}
+
+/**
+ * Move every buffered byte (all part of one unfinished packet) to the end
+ * of the staging file
+ * @return 0 on success, -1 on failure
+ */
+static int spill_window(struct recv_buffer *buf)
+{
+    if (buf->spill_len == 0) {
+        buf->spill_fd = spill_open();
+        if (buf->spill_fd == -1) {
+            return -1;
+        }
+    }
+
+    const char *pos = buf->data + buf->start;
+    size_t remaining = buf->used;
+    while (remaining > 0) {
+        ssize_t bytes = pwrite(buf->spill_fd, pos, remaining, buf->spill_len);
+        if (bytes == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            syslog(LOG_ERR, "Failed to write staging file: %s", strerror(errno));
+            if (buf->spill_len == 0) {
+                close(buf->spill_fd);
+            }
+            return -1;
+        }
+        pos += bytes;
+        remaining -= bytes;
+        buf->spill_len += bytes;
+    }
+
+    recv_buffer_consume(buf, buf->used);
+    return 0;
+}
+
+/**
+ * @return true if the complete packet may be a command
+ */
+static bool is_command(const char *packet, size_t packet_size)
+{
+    return packet_size > strlen(COMMAND_PREFIX) &&
+           memcmp(packet, COMMAND_PREFIX, strlen(COMMAND_PREFIX)) == 0;
+}
+
+int recv_buffer_produce(struct recv_buffer *buf, size_t len)
+{
+    buf->used += len;
+
+    if (config.spill_threshold == 0 || buf->used < config.spill_threshold) {
+        return 0;
+    }
+
+    // Spill only an unfinished packet; complete ones are framed first
+    const char *window = buf->data + buf->start;
+    if (memchr(window + buf->scanned, '\n', buf->used - buf->scanned) != NULL) {
+        return 0;
+    }
+    buf->scanned = buf->used;
+    return spill_window(buf);
+}
+
+const char *recv_buffer_next_packet(struct recv_buffer *buf, size_t *packet_size)
+{
+    const char *window = buf->data + buf->start;
+
+    if (buf->used == 0) {
+        return NULL;
+    }
+
+    const char *newline_pos = memchr(window + buf->scanned, '\n', buf->used - buf->scanned);
+    if (newline_pos == NULL) {
+        // Only bytes received after this point need scanning next time
+        buf->scanned = buf->used;
+        return NULL;
+    }
+
+    *packet_size = newline_pos - window + 1;
+    if (config.batch_packets && !is_command(window, *packet_size)) {
+        // Extend the run packet by packet up to the next possible command
+        for (;;) {
+            const char *next = window + *packet_size;
+            newline_pos = memchr(next, '\n', buf->used - *packet_size);
+            if (newline_pos == NULL || is_command(next, newline_pos - next + 1)) {
+                break;
+            }
+            *packet_size = newline_pos - window + 1;
+        }
+    }
+    return window;
+}
+
+bool recv_buffer_packet_is(const struct recv_buffer *buf, const char *packet,
+                           size_t packet_size, const char *text)
+{
+    // A staged packet is longer than its in-memory tail
+    return buf->spill_len == 0 && packet_size == strlen(text) &&
+           memcmp(packet, text, packet_size) == 0;
+}
+
+bool recv_buffer_parse_seekto(const struct recv_buffer *buf, const char *packet,
+                              size_t packet_size, struct aesd_seekto *seekto)
+{
+    size_t prefix_len = strlen(SEEKTO_COMMAND);
+    char args[32];
+    char *end;
+
+    if (buf->spill_len > 0 || packet_size <= prefix_len ||
+        packet_size - prefix_len > sizeof(args) ||
+        memcmp(packet, SEEKTO_COMMAND, prefix_len) != 0) {
+        return false;
+    }
+
+    // "X,Y\n" with X and Y plain decimal numbers
+    memcpy(args, packet + prefix_len, packet_size - prefix_len);
+    args[packet_size - prefix_len - 1] = '\0';
+    if (args[0] < '0' || args[0] > '9') {
+        return false;
+    }
+    unsigned long write_cmd = strtoul(args, &end, 10);
+    if (*end != ',' || end[1] < '0' || end[1] > '9' || write_cmd > UINT32_MAX) {
+        return false;
+    }
+    const char *offset_arg = end + 1;
+    unsigned long write_cmd_offset = strtoul(offset_arg, &end, 10);
+    if (*end != '\0' || write_cmd_offset > UINT32_MAX) {
+        return false;
+    }
+
+    seekto->write_cmd = write_cmd;
+    seekto->write_cmd_offset = write_cmd_offset;
+    return true;
+}
+
+int recv_buffer_take_spill(struct recv_buffer *buf, size_t *spill_len)
+{
+    int fd = buf->spill_len > 0 ? buf->spill_fd : -1;
+
+    *spill_len = buf->spill_len;
+    buf->spill_fd = -1;
+    buf->spill_len = 0;
+    return fd;
+}
+
+void recv_buffer_consume(struct recv_buffer *buf, size_t len)
+{
+    buf->start += len;
+    buf->used -= len;
+    buf->scanned = 0;
+
+    if (buf->used == 0) {
+        buf->start = 0;
+        if (buf->size > RECV_BUFFER_IDLE_MAX) {
+            free(buf->data);
+            buf->data = NULL;
+            buf->size = 0;
+        }
+    }
+}
+
+void recv_buffer_release(struct recv_buffer *buf)
+{
+    if (buf->spill_len > 0) {
+        close(buf->spill_fd);
+    }
+    free(buf->data);
+    memset(buf, 0, sizeof(*buf));
+}
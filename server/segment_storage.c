@@ -0,0 +1,992 @@
+/**
+ * @file segment_storage.c
+ * @brief Segmented data file storage for aesdsocket
+ *
+ * The store selected with -s segments. Records are appended to a chain of
+ * segment files named after DATA_FILE and the position of their first
+ * byte, e.g. /var/tmp/aesdsocketdata.00000000000001048576. Once the
+ * active segment holds config.segment_bytes the next record starts a new
+ * one; records are never split, so a larger one fills a segment alone.
+ * SIGHUP starts a new segment straight away. Segments a previous run left
+ * behind are adopted at startup.
+ *
+ * After every append the oldest segments are dropped as -k allows, which
+ * the timestamps appended every TIMESTAMP_INTERVAL seconds keep doing
+ * even when clients are quiet. The active segment is never dropped.
+ * Positions keep counting every byte ever appended: a reply starting
+ * before the oldest segment kept resumes at its first byte, and seek
+ * commands count records from the oldest line kept.
+ *
+ * Replies are sent from each segment's own descriptor with sendfile() or
+ * splice(). Readers borrow the descriptor with a reference count under
+ * segment_mutex, so a dropped segment is unlinked at once but closed only
+ * when the last reader hands it back.
+ *
+ * With -z a compactor thread replaces each sealed segment with a
+ * compressed copy, named like it with ".lz" appended: LZ_BLOCK_SIZE
+ * blocks compressed independently (see lz.h) behind a table of where each
+ * one starts. The copy is synced before it is swapped into the chain and
+ * the raw segment unlinked, so a crash leaves at least one of the two
+ * whole. Replies from a compressed segment go through read, which
+ * decompresses only the block they start in. Retention still counts the
+ * bytes appended, not what they compress to.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/queue.h>
+
+#include "aesdsocket.h"
+#include "lz.h"
+
+// Digits of the position in a segment file name
+#define SEGMENT_NAME_DIGITS 20
+// Appended to the name of a compressed segment
+#define PACKED_SUFFIX ".lz"
+#define PACKED_MAGIC "AESDLZS1"
+
+// Start of a compressed segment file. It is followed by block_count + 1
+// file offsets, where each block starts and where the last one ends,
+// then the blocks, each stored as it is where compressing did not make
+// it smaller.
+struct packed_header {
+    char magic[8];
+    uint64_t len;
+    uint64_t block_count;
+};
+
+struct segment {
+    int fd;
+    // Position of its first byte
+    size_t start;
+    // Bytes and lines appended to it
+    size_t len;
+    size_t records;
+    // When its newest record was appended
+    time_t last_append;
+    // Readers the descriptor is lent to
+    unsigned int refs;
+    // Off the chain, on the dropped list until the last reader is done
+    bool dropped;
+    // Compressed: file offsets of its blocks, see struct packed_header
+    uint64_t *blocks;
+    // Compressing it failed; it stays as it is
+    bool pack_failed;
+    TAILQ_ENTRY(segment) entries;
+};
+
+TAILQ_HEAD(segment_list, segment);
+
+// Segments kept, oldest first, the last one being appended to. Only
+// whoever owns the append path adds or drops segments and changes the
+// counts, and the compactor only swaps sealed ones for their compressed
+// copies; both under segment_mutex, which readers take to walk the chain
+// and borrow segments.
+static pthread_mutex_t segment_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct segment_list segments = TAILQ_HEAD_INITIALIZER(segments);
+// Dropped segments still lent to readers
+static struct segment_list dropped = TAILQ_HEAD_INITIALIZER(dropped);
+static size_t held_bytes = 0;
+static size_t held_records = 0;
+// The last segment, owned by the append path
+static struct segment *active;
+
+// Where each line of the kept segments starts
+static struct record_index line_index = RECORD_INDEX_INITIALIZER;
+
+// With -z, signalled on compactor_cond whenever a segment is sealed
+static pthread_t compactor_thread;
+static pthread_cond_t compactor_cond = PTHREAD_COND_INITIALIZER;
+static bool compactor_running;
+static bool compactor_stopping;
+
+static void segment_path(char *path, size_t size, size_t start, bool packed)
+{
+    snprintf(path, size, "%s.%0*zu%s", config.storage_path, SEGMENT_NAME_DIGITS, start,
+             packed ? PACKED_SUFFIX : "");
+}
+
+static void segment_file_path(char *path, size_t size, const struct segment *seg)
+{
+    segment_path(path, size, seg->start, seg->blocks != NULL);
+}
+
+/**
+ * Read or, if @param write, write all @param len bytes at @param pos
+ * @return 0 on success, -1 on failure, a file ending early being EIO
+ */
+static int transfer_all(int fd, void *buf, size_t len, off_t pos, bool write)
+{
+    char *p = buf;
+
+    while (len > 0) {
+        ssize_t bytes = write ? pwrite(fd, p, len, pos) : pread(fd, p, len, pos);
+        if (bytes == -1 && errno == EINTR) {
+            continue;
+        }
+        if (bytes <= 0) {
+            if (bytes == 0) {
+                errno = EIO;
+            }
+            return -1;
+        }
+        p += bytes;
+        pos += bytes;
+        len -= bytes;
+    }
+    return 0;
+}
+
+/**
+ * Open the segment file starting at position @param start, creating it
+ * empty unless @param existing
+ * @return the segment, not yet linked into the chain, or NULL on failure
+ */
+static struct segment *segment_open(size_t start, bool existing)
+{
+    char path[PATH_MAX];
+    struct stat st;
+
+    struct segment *seg = calloc(1, sizeof(*seg));
+    if (seg == NULL) {
+        syslog(LOG_ERR, "Failed to allocate segment: %s", strerror(errno));
+        return NULL;
+    }
+
+    segment_path(path, sizeof(path), start, false);
+    int flags = O_RDWR | O_APPEND | O_CLOEXEC | (existing ? 0 : O_CREAT | O_TRUNC);
+    seg->fd = open(path, flags, 0644);
+    if (seg->fd == -1 || fstat(seg->fd, &st) == -1) {
+        syslog(LOG_ERR, "Failed to open %s: %s", path, strerror(errno));
+        if (seg->fd != -1) {
+            close(seg->fd);
+        }
+        free(seg);
+        return NULL;
+    }
+    seg->start = start;
+    seg->len = st.st_size;
+    seg->last_append = existing ? st.st_mtime : time(NULL);
+    return seg;
+}
+
+/**
+ * Open the compressed segment file starting at position @param start,
+ * checking its block table against the file
+ * @return the segment, not yet linked into the chain, or NULL on failure
+ */
+static struct segment *segment_open_packed(size_t start)
+{
+    char path[PATH_MAX];
+    struct packed_header header;
+    struct stat st;
+
+    struct segment *seg = calloc(1, sizeof(*seg));
+    if (seg == NULL) {
+        syslog(LOG_ERR, "Failed to allocate segment: %s", strerror(errno));
+        return NULL;
+    }
+
+    segment_path(path, sizeof(path), start, true);
+    seg->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (seg->fd == -1 || fstat(seg->fd, &st) == -1 ||
+        transfer_all(seg->fd, &header, sizeof(header), 0, false) == -1) {
+        syslog(LOG_ERR, "Failed to open %s: %s", path, strerror(errno));
+        goto fail;
+    }
+
+    uint64_t count = header.block_count;
+    size_t table_size = (count + 1) * sizeof(*seg->blocks);
+    bool valid = memcmp(header.magic, PACKED_MAGIC, sizeof(header.magic)) == 0 &&
+                 count == (header.len + LZ_BLOCK_SIZE - 1) / LZ_BLOCK_SIZE &&
+                 count < (uint64_t)st.st_size / sizeof(*seg->blocks);
+    if (valid) {
+        seg->blocks = malloc(table_size);
+        if (seg->blocks == NULL ||
+            transfer_all(seg->fd, seg->blocks, table_size, sizeof(header), false) == -1) {
+            syslog(LOG_ERR, "Failed to read %s: %s", path, strerror(errno));
+            goto fail;
+        }
+        // Each block starts where the one before ends, none larger than raw
+        valid = seg->blocks[0] == sizeof(header) + table_size && seg->blocks[count] == (uint64_t)st.st_size;
+        for (uint64_t i = 0; valid && i < count; i++) {
+            uint64_t raw_len = header.len - i * LZ_BLOCK_SIZE;
+            valid = seg->blocks[i] <= seg->blocks[i + 1] &&
+                    seg->blocks[i + 1] - seg->blocks[i] <= (raw_len < LZ_BLOCK_SIZE ? raw_len : LZ_BLOCK_SIZE);
+        }
+    }
+    if (!valid) {
+        syslog(LOG_WARNING, "Ignoring %s: not a complete compressed segment", path);
+        goto fail;
+    }
+
+    seg->start = start;
+    seg->len = header.len;
+    seg->last_append = st.st_mtime;
+    return seg;
+
+fail:
+    if (seg->fd != -1) {
+        close(seg->fd);
+    }
+    free(seg->blocks);
+    free(seg);
+    return NULL;
+}
+
+/**
+ * Close a segment nobody borrows any more
+ */
+static void segment_free(struct segment *seg)
+{
+    close(seg->fd);
+    free(seg->blocks);
+    free(seg);
+}
+
+/**
+ * Hand back a borrowed segment, closing it if it was dropped and this was
+ * the last reader. Called with segment_mutex held.
+ */
+static void segment_put(struct segment *seg)
+{
+    if (--seg->refs == 0 && seg->dropped) {
+        TAILQ_REMOVE(&dropped, seg, entries);
+        segment_free(seg);
+    }
+}
+
+/**
+ * Decompress block @param block of a compressed segment into @param out,
+ * which holds LZ_BLOCK_SIZE bytes
+ * @return the bytes of the block, or -1 on failure
+ */
+static ssize_t segment_unpack(const struct segment *seg, size_t block, char *out)
+{
+    char packed[LZ_BLOCK_SIZE];
+    size_t raw_len = seg->len - block * LZ_BLOCK_SIZE;
+    size_t stored = seg->blocks[block + 1] - seg->blocks[block];
+
+    if (raw_len > LZ_BLOCK_SIZE) {
+        raw_len = LZ_BLOCK_SIZE;
+    }
+    // Stored as it is, or compressed
+    char *in = stored == raw_len ? out : packed;
+    if (transfer_all(seg->fd, in, stored, seg->blocks[block], false) == -1) {
+        syslog(LOG_ERR, "Failed to read segment: %s", strerror(errno));
+        return -1;
+    }
+    if (in == packed && lz_decompress(packed, stored, out, raw_len) != (ssize_t)raw_len) {
+        syslog(LOG_ERR, "Failed to read segment at %zu: block %zu is corrupt", seg->start, block);
+        return -1;
+    }
+    return raw_len;
+}
+
+/**
+ * Write a compressed copy of a sealed segment the caller borrows and sync
+ * it, giving up early if the compactor is stopped
+ * @return the copy, not yet linked into the chain, or NULL on failure
+ */
+static struct segment *segment_pack(const struct segment *seg)
+{
+    char path[PATH_MAX];
+    char raw[LZ_BLOCK_SIZE];
+    char packed[LZ_BLOCK_SIZE];
+    size_t count = (seg->len + LZ_BLOCK_SIZE - 1) / LZ_BLOCK_SIZE;
+    struct packed_header header = {
+        .magic = PACKED_MAGIC,
+        .len = seg->len,
+        .block_count = count,
+    };
+
+    struct segment *copy = calloc(1, sizeof(*copy));
+    if (copy == NULL || (copy->blocks = malloc((count + 1) * sizeof(*copy->blocks))) == NULL) {
+        syslog(LOG_ERR, "Failed to allocate segment: %s", strerror(errno));
+        free(copy);
+        return NULL;
+    }
+    segment_path(path, sizeof(path), seg->start, true);
+    copy->fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (copy->fd == -1) {
+        syslog(LOG_ERR, "Failed to open %s: %s", path, strerror(errno));
+        free(copy->blocks);
+        free(copy);
+        return NULL;
+    }
+
+    // Blocks first, then the table and header that make the copy valid
+    uint64_t at = sizeof(header) + (count + 1) * sizeof(*copy->blocks);
+    int ret = 0;
+    for (size_t i = 0; ret == 0 && i < count; i++) {
+        if (__atomic_load_n(&compactor_stopping, __ATOMIC_RELAXED)) {
+            ret = 1;
+            break;
+        }
+        size_t raw_len = seg->len - i * LZ_BLOCK_SIZE;
+        if (raw_len > LZ_BLOCK_SIZE) {
+            raw_len = LZ_BLOCK_SIZE;
+        }
+        ret = transfer_all(seg->fd, raw, raw_len, i * LZ_BLOCK_SIZE, false);
+        if (ret == 0) {
+            size_t stored = lz_compress(raw, raw_len, packed, raw_len - 1);
+            ret = stored > 0 ? transfer_all(copy->fd, packed, stored, at, true)
+                             : transfer_all(copy->fd, raw, raw_len, at, true);
+            copy->blocks[i] = at;
+            at += stored > 0 ? stored : raw_len;
+        }
+    }
+    copy->blocks[count] = at;
+    if (ret == 0) {
+        ret = transfer_all(copy->fd, copy->blocks, (count + 1) * sizeof(*copy->blocks), sizeof(header), true);
+    }
+    if (ret == 0) {
+        ret = transfer_all(copy->fd, &header, sizeof(header), 0, true);
+    }
+    if (ret == 0) {
+        ret = fdatasync(copy->fd);
+    }
+    if (ret != 0) {
+        if (ret == -1) {
+            syslog(LOG_ERR, "Failed to write %s: %s", path, strerror(errno));
+        }
+        unlink(path);
+        segment_free(copy);
+        return NULL;
+    }
+
+    copy->start = seg->start;
+    copy->len = seg->len;
+    copy->records = seg->records;
+    copy->last_append = seg->last_append;
+    syslog(LOG_DEBUG, "Compressed %s: %zu bytes to %llu", path, seg->len, (unsigned long long)at);
+    return copy;
+}
+
+/**
+ * Compress sealed segments, oldest first, until stopped
+ */
+static void *compactor_run(void *arg)
+{
+    char path[PATH_MAX];
+    (void)arg;
+
+    pthread_mutex_lock(&segment_mutex);
+    while (!compactor_stopping) {
+        struct segment *seg;
+        TAILQ_FOREACH(seg, &segments, entries) {
+            if (seg->blocks == NULL && !seg->pack_failed && TAILQ_NEXT(seg, entries) != NULL) {
+                break;
+            }
+        }
+        if (seg == NULL) {
+            pthread_cond_wait(&compactor_cond, &segment_mutex);
+            continue;
+        }
+
+        seg->refs++;
+        pthread_mutex_unlock(&segment_mutex);
+        struct segment *copy = segment_pack(seg);
+        pthread_mutex_lock(&segment_mutex);
+
+        if (copy == NULL) {
+            seg->pack_failed = true;
+            segment_put(seg);
+            continue;
+        }
+        if (seg->dropped) {
+            // Retention got to it first
+            segment_file_path(path, sizeof(path), copy);
+            segment_free(copy);
+        } else {
+            TAILQ_INSERT_AFTER(&segments, seg, copy, entries);
+            TAILQ_REMOVE(&segments, seg, entries);
+            TAILQ_INSERT_TAIL(&dropped, seg, entries);
+            seg->dropped = true;
+            segment_file_path(path, sizeof(path), seg);
+        }
+        segment_put(seg);
+        pthread_mutex_unlock(&segment_mutex);
+
+        if (unlink(path) == -1) {
+            syslog(LOG_ERR, "Failed to remove %s: %s", path, strerror(errno));
+        }
+        pthread_mutex_lock(&segment_mutex);
+    }
+    pthread_mutex_unlock(&segment_mutex);
+
+    return NULL;
+}
+
+static int compactor_start(void)
+{
+    if (pthread_create(&compactor_thread, NULL, compactor_run, NULL) != 0) {
+        syslog(LOG_ERR, "Failed to start segment compactor");
+        return -1;
+    }
+    compactor_running = true;
+    return 0;
+}
+
+/**
+ * Stop the compactor, abandoning the segment it is compressing
+ */
+static void compactor_stop(void)
+{
+    if (!compactor_running) {
+        return;
+    }
+    pthread_mutex_lock(&segment_mutex);
+    __atomic_store_n(&compactor_stopping, true, __ATOMIC_RELAXED);
+    pthread_cond_signal(&compactor_cond);
+    pthread_mutex_unlock(&segment_mutex);
+
+    pthread_join(compactor_thread, NULL);
+    compactor_running = false;
+}
+
+/**
+ * Seal the active segment and start the next one at @param start. Under
+ * a durability mode the sealed one is synced first, as later syncs only
+ * cover the active segment.
+ * @return the new active segment, or NULL on failure
+ */
+static struct segment *segment_roll(size_t start)
+{
+    if (config.durability != DURABILITY_NONE && fdatasync(active->fd) == -1) {
+        syslog(LOG_ERR, "Failed to sync segment: %s", strerror(errno));
+        return NULL;
+    }
+
+    struct segment *seg = segment_open(start, false);
+    if (seg != NULL) {
+        pthread_mutex_lock(&segment_mutex);
+        TAILQ_INSERT_TAIL(&segments, seg, entries);
+        pthread_cond_signal(&compactor_cond);
+        pthread_mutex_unlock(&segment_mutex);
+        active = seg;
+    }
+    return seg;
+}
+
+/**
+ * Unlink the oldest segment and take it off the chain; it is closed once
+ * no reader borrows it
+ */
+static void segment_drop(void)
+{
+    char path[PATH_MAX];
+
+    pthread_mutex_lock(&segment_mutex);
+    struct segment *seg = TAILQ_FIRST(&segments);
+    TAILQ_REMOVE(&segments, seg, entries);
+    held_bytes -= seg->len;
+    held_records -= seg->records;
+    segment_file_path(path, sizeof(path), seg);
+    // Once on the dropped list the last reader may free it any time
+    if (seg->refs > 0) {
+        TAILQ_INSERT_TAIL(&dropped, seg, entries);
+        seg->dropped = true;
+        seg = NULL;
+    }
+    size_t oldest = TAILQ_FIRST(&segments)->start;
+    pthread_mutex_unlock(&segment_mutex);
+
+    if (seg != NULL) {
+        segment_free(seg);
+    }
+    if (unlink(path) == -1) {
+        syslog(LOG_ERR, "Failed to remove %s: %s", path, strerror(errno));
+    } else {
+        syslog(LOG_DEBUG, "Dropped %s", path);
+    }
+    record_index_trim(&line_index, oldest);
+}
+
+/**
+ * Drop the oldest segments as the retention limits allow
+ */
+static void segment_retain(void)
+{
+    time_t now = time(NULL);
+
+    for (;;) {
+        pthread_mutex_lock(&segment_mutex);
+        struct segment *oldest = TAILQ_FIRST(&segments);
+        bool expired = oldest != active &&
+            ((config.retain_bytes > 0 && held_bytes - oldest->len >= config.retain_bytes) ||
+             (config.retain_records > 0 && held_records - oldest->records >= config.retain_records) ||
+             (config.retain_seconds > 0 && now - oldest->last_append >= (time_t)config.retain_seconds));
+        pthread_mutex_unlock(&segment_mutex);
+        if (!expired) {
+            break;
+        }
+        segment_drop();
+    }
+}
+
+// A segment file a previous run left behind
+struct segment_file {
+    size_t start;
+    bool packed;
+};
+
+static int compare_files(const void *a, const void *b)
+{
+    const struct segment_file *x = a;
+    const struct segment_file *y = b;
+
+    if (x->start != y->start) {
+        return x->start < y->start ? -1 : 1;
+    }
+    return x->packed - y->packed;
+}
+
+/**
+ * Find the segment files a previous run left behind
+ * @return how many, stored in @param files (to be freed) sorted by
+ * position, a raw segment before its compressed copy, or -1 on failure
+ */
+static ssize_t segment_find_existing(struct segment_file **files)
+{
+    char dir[PATH_MAX];
+    const char *base = strrchr(config.storage_path, '/');
+    size_t count = 0;
+    size_t capacity = 0;
+
+    if (base == NULL) {
+        snprintf(dir, sizeof(dir), ".");
+        base = config.storage_path;
+    } else {
+        snprintf(dir, sizeof(dir), "%.*s", base == config.storage_path ? 1 : (int)(base - config.storage_path),
+                 config.storage_path);
+        base++;
+    }
+    size_t base_len = strlen(base);
+
+    DIR *d = opendir(dir);
+    if (d == NULL) {
+        syslog(LOG_ERR, "Failed to open %s: %s", dir, strerror(errno));
+        return -1;
+    }
+    *files = NULL;
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL) {
+        const char *digits = entry->d_name + base_len + 1;
+        if (strncmp(entry->d_name, base, base_len) != 0 || entry->d_name[base_len] != '.' ||
+            strspn(digits, "0123456789") != SEGMENT_NAME_DIGITS) {
+            continue;
+        }
+        const char *suffix = digits + SEGMENT_NAME_DIGITS;
+        if (*suffix != '\0' && strcmp(suffix, PACKED_SUFFIX) != 0) {
+            continue;
+        }
+        if (count == capacity) {
+            capacity = capacity > 0 ? capacity * 2 : 16;
+            struct segment_file *grown = realloc(*files, capacity * sizeof(*grown));
+            if (grown == NULL) {
+                syslog(LOG_ERR, "Failed to list segments: %s", strerror(errno));
+                break;
+            }
+            *files = grown;
+        }
+        (*files)[count].start = strtoull(digits, NULL, 10);
+        (*files)[count].packed = *suffix != '\0';
+        count++;
+    }
+    closedir(d);
+
+    if (count > 0) {
+        qsort(*files, count, sizeof(**files), compare_files);
+    }
+    return count;
+}
+
+/**
+ * Open a segment a previous run left behind, preferring a complete
+ * compressed copy. A segment found in both forms was left by a compactor
+ * stopped between syncing the copy and unlinking the raw file; whichever
+ * of the two is not kept is removed.
+ * @return the segment, not yet linked into the chain, or NULL on failure
+ */
+static struct segment *segment_adopt_one(const struct segment_file *file, bool both)
+{
+    char path[PATH_MAX];
+    struct segment *seg = NULL;
+
+    if (file->packed || both) {
+        seg = segment_open_packed(file->start);
+        if (seg == NULL || both) {
+            segment_path(path, sizeof(path), file->start, seg == NULL);
+            unlink(path);
+        }
+    }
+    if (seg == NULL && !file->packed) {
+        seg = segment_open(file->start, true);
+    }
+    return seg;
+}
+
+/**
+ * Index the lines of a compressed segment, a block at a time
+ * @return the lines started in it, or -1 on failure
+ */
+static ssize_t segment_scan_packed(const struct segment *seg)
+{
+    char block[LZ_BLOCK_SIZE];
+    size_t lines = 0;
+
+    for (size_t i = 0; i * LZ_BLOCK_SIZE < seg->len; i++) {
+        ssize_t len = segment_unpack(seg, i, block);
+        ssize_t started = len == -1 ? -1 : record_index_scan_buffer(&line_index, block, len);
+        if (started == -1) {
+            return -1;
+        }
+        lines += started;
+    }
+    return lines;
+}
+
+/**
+ * Link in the segments a previous run left behind, keeping only the
+ * newest contiguous run of them, and index what they hold
+ */
+static void segment_adopt(void)
+{
+    struct segment_file *files;
+    ssize_t count = segment_find_existing(&files);
+
+    for (ssize_t i = 0; i < count; i++) {
+        bool both = i + 1 < count && files[i + 1].start == files[i].start;
+        struct segment *seg = segment_adopt_one(&files[i], both);
+        if (both) {
+            i++;
+        }
+        if (seg == NULL) {
+            continue;
+        }
+        struct segment *last = TAILQ_LAST(&segments, segment_list);
+        if (last != NULL && last->start + last->len != seg->start) {
+            // A gap: positions before it can no longer be told apart
+            while (!TAILQ_EMPTY(&segments)) {
+                struct segment *old = TAILQ_FIRST(&segments);
+                char path[PATH_MAX];
+                segment_file_path(path, sizeof(path), old);
+                syslog(LOG_WARNING, "Discarding %s: not contiguous with newer segments", path);
+                unlink(path);
+                TAILQ_REMOVE(&segments, old, entries);
+                segment_free(old);
+            }
+        }
+        TAILQ_INSERT_TAIL(&segments, seg, entries);
+    }
+    if (count > 0) {
+        free(files);
+    }
+
+    struct segment *seg;
+    if (!TAILQ_EMPTY(&segments)) {
+        record_index_reset(&line_index, TAILQ_FIRST(&segments)->start);
+    }
+    TAILQ_FOREACH(seg, &segments, entries) {
+        ssize_t lines = seg->blocks != NULL
+            ? segment_scan_packed(seg)
+            : record_index_scan(&line_index, seg->fd, seg->len, config.storage_path);
+        seg->records = lines > 0 ? lines : 0;
+        held_bytes += seg->len;
+        held_records += seg->records;
+    }
+}
+
+static int segment_storage_open(size_t *len)
+{
+    segment_adopt();
+
+    // Only a raw segment can be appended to
+    active = TAILQ_LAST(&segments, segment_list);
+    if (active == NULL || active->blocks != NULL) {
+        struct segment *seg = segment_open(active != NULL ? active->start + active->len : 0, false);
+        if (seg == NULL) {
+            return -1;
+        }
+        if (active == NULL) {
+            record_index_reset(&line_index, 0);
+        }
+        TAILQ_INSERT_TAIL(&segments, seg, entries);
+        active = seg;
+    }
+
+    *len = active->start + active->len;
+    if (config.compress_segments && compactor_start() == -1) {
+        return -1;
+    }
+    return 0;
+}
+
+static int segment_storage_reopen(size_t *len)
+{
+    *len = active->start + active->len;
+    // Nothing to seal in an empty segment
+    if (active->len > 0 && segment_roll(*len) == NULL) {
+        return -1;
+    }
+    segment_retain();
+    return 0;
+}
+
+static void segment_storage_close(void)
+{
+    struct segment *seg;
+
+    compactor_stop();
+    while ((seg = TAILQ_FIRST(&segments)) != NULL) {
+        TAILQ_REMOVE(&segments, seg, entries);
+        segment_free(seg);
+    }
+    while ((seg = TAILQ_FIRST(&dropped)) != NULL) {
+        TAILQ_REMOVE(&dropped, seg, entries);
+        segment_free(seg);
+    }
+    active = NULL;
+    held_bytes = 0;
+    held_records = 0;
+    record_index_free(&line_index);
+}
+
+static void segment_storage_remove(void)
+{
+    char path[PATH_MAX];
+    struct segment *seg;
+
+    compactor_stop();
+    TAILQ_FOREACH(seg, &segments, entries) {
+        segment_file_path(path, sizeof(path), seg);
+        unlink(path);
+    }
+}
+
+static size_t segment_storage_append(const struct log_record *first, int count, size_t start)
+{
+    const struct log_record *record = first;
+    size_t written = 0;
+
+    while (count > 0) {
+        size_t size = record->spill_len + record->len;
+        if (active->len > 0 && active->len + size > config.segment_bytes &&
+            segment_roll(start + written) == NULL) {
+            break;
+        }
+
+        // The run of records that fits in the active segment, at least one
+        const struct log_record *run = record;
+        int run_count = 0;
+        size_t run_len = 0;
+        do {
+            run_len += size;
+            run_count++;
+            record = record->next;
+            size = run_count < count ? record->spill_len + record->len : 0;
+        } while (run_count < count && active->len + run_len + size <= config.segment_bytes);
+
+        size_t bytes = storage_write_records(active->fd, run, run_count);
+
+        // Index the records that made it to the segment in full
+        size_t end = start + written;
+        for (int i = 0; i < run_count; i++, run = run->next) {
+            size_t record_size = run->spill_len + run->len;
+            if (end + record_size > start + written + bytes) {
+                break;
+            }
+            size_t lines = record_index_add(&line_index, run, end);
+            active->records += lines;
+            held_records += lines;
+            end += record_size;
+        }
+        active->len += bytes;
+        active->last_append = time(NULL);
+        held_bytes += bytes;
+        written += bytes;
+        if (bytes < run_len) {
+            break;
+        }
+        count -= run_count;
+    }
+
+    segment_retain();
+    return written;
+}
+
+static int segment_storage_sync(void)
+{
+    if (fdatasync(active->fd) == -1) {
+        syslog(LOG_ERR, "Failed to sync segment: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static int segment_storage_seek(unsigned int record, unsigned int offset, off_t *pos)
+{
+    return record_index_seek(&line_index, record, offset, pos);
+}
+
+/**
+ * Find the segment holding *pos, moving *pos and *end as for
+ * storage_ops.read, and lend it to the caller until segment_put()
+ * @return the segment, with how many bytes it holds from *pos up to *end
+ * stored in @param held
+ */
+static struct segment *segment_borrow(off_t *pos, off_t *end, size_t *held)
+{
+    struct segment *seg;
+
+    pthread_mutex_lock(&segment_mutex);
+    size_t oldest = TAILQ_FIRST(&segments)->start;
+    if ((size_t)*pos < oldest) {
+        *pos = oldest;
+        // Rather than nothing, send what is kept now
+        if ((size_t)*end <= oldest) {
+            *end = data_file_length();
+        }
+    }
+
+    // Replies mostly come from the newest segments
+    TAILQ_FOREACH_REVERSE(seg, &segments, segment_list, entries) {
+        if (seg->start <= (size_t)*pos) {
+            break;
+        }
+    }
+    struct segment *next = TAILQ_NEXT(seg, entries);
+    off_t seg_end = next != NULL && (off_t)next->start < *end ? (off_t)next->start : *end;
+
+    *held = *pos < seg_end ? (size_t)(seg_end - *pos) : 0;
+    seg->refs++;
+    pthread_mutex_unlock(&segment_mutex);
+
+    return seg;
+}
+
+static int segment_storage_get_fd(off_t *pos, off_t *end, off_t *file_pos, size_t *len)
+{
+    off_t from = *pos;
+    off_t to = *end;
+
+    struct segment *seg = segment_borrow(&from, &to, len);
+    if (seg->blocks != NULL) {
+        // Compressed: its bytes only come out of read, decompressed
+        pthread_mutex_lock(&segment_mutex);
+        segment_put(seg);
+        pthread_mutex_unlock(&segment_mutex);
+        return -1;
+    }
+
+    *pos = from;
+    *end = to;
+    *file_pos = from - seg->start;
+    return seg->fd;
+}
+
+static void segment_storage_put_fd(int fd)
+{
+    struct segment *seg;
+
+    pthread_mutex_lock(&segment_mutex);
+    TAILQ_FOREACH(seg, &segments, entries) {
+        if (seg->fd == fd) {
+            break;
+        }
+    }
+    if (seg == NULL) {
+        TAILQ_FOREACH(seg, &dropped, entries) {
+            if (seg->fd == fd) {
+                break;
+            }
+        }
+    }
+    if (seg != NULL) {
+        segment_put(seg);
+    }
+    pthread_mutex_unlock(&segment_mutex);
+}
+
+/**
+ * Copy up to @param len bytes from @param file_pos of a compressed
+ * segment, stopping at the end of the block they start in
+ * @return the bytes copied, or -1 on failure
+ */
+static ssize_t segment_read_packed(const struct segment *seg, size_t file_pos, char *buf, size_t len)
+{
+    char block[LZ_BLOCK_SIZE];
+    size_t index = file_pos / LZ_BLOCK_SIZE;
+    size_t skip = file_pos % LZ_BLOCK_SIZE;
+
+    // A whole block is decompressed straight into place
+    if (skip == 0 && len >= LZ_BLOCK_SIZE) {
+        return segment_unpack(seg, index, buf);
+    }
+    ssize_t block_len = segment_unpack(seg, index, block);
+    if (block_len == -1) {
+        return -1;
+    }
+    if (len > (size_t)block_len - skip) {
+        len = block_len - skip;
+    }
+    memcpy(buf, block + skip, len);
+    return len;
+}
+
+static ssize_t segment_storage_read(off_t *pos, off_t *end, char *buf, size_t len)
+{
+    size_t held;
+    ssize_t bytes;
+
+    struct segment *seg = segment_borrow(pos, end, &held);
+    size_t file_pos = *pos - seg->start;
+    if (held < len) {
+        len = held;
+    }
+    if (seg->blocks != NULL) {
+        bytes = len > 0 ? segment_read_packed(seg, file_pos, buf, len) : 0;
+    } else {
+        while ((bytes = pread(seg->fd, buf, len, file_pos)) == -1 && errno == EINTR) {
+            // Retry
+        }
+        if (bytes <= 0 && len > 0) {
+            syslog(LOG_ERR, "Failed to read segment: %s",
+                   bytes == 0 ? "unexpected end of file" : strerror(errno));
+            bytes = -1;
+        }
+    }
+
+    pthread_mutex_lock(&segment_mutex);
+    segment_put(seg);
+    pthread_mutex_unlock(&segment_mutex);
+
+    return bytes;
+}
+
+const struct storage_ops segment_storage = {
+    .name = "segments",
+    .open = segment_storage_open,
+    .reopen = segment_storage_reopen,
+    .close = segment_storage_close,
+    .remove = segment_storage_remove,
+    .append = segment_storage_append,
+    .sync = segment_storage_sync,
+    .seek = segment_storage_seek,
+    .read = segment_storage_read,
+    .get_fd = segment_storage_get_fd,
+    .put_fd = segment_storage_put_fd,
+};
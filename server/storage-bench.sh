@@ -0,0 +1,59 @@
+#!/bin/sh
+#
+# Run the same aesdbench workload against every store aesdsocket can keep
+# records in, one server at a time, and report each one's results along
+# with the CPU time the server used.
+#
+# Usage: ./storage-bench.sh [-e "server options"] [aesdbench options]
+# e.g.   ./storage-bench.sh -e "-m epoll -i" -c 8 -n 2000 -s 64
+#
+# The device store is benchmarked only when the device exists; DEVICE
+# names one other than /dev/aesdchar. SEGMENT_OPTS are added for the
+# segment store only, retaining 4 MiB unless set. Build with
+# "make all bench" first.
+
+SERVER=./aesdsocket
+BENCH=./aesdbench
+DEVICE=${DEVICE:-/dev/aesdchar}
+SERVER_OPTS=
+SEGMENT_OPTS=${SEGMENT_OPTS:--k bytes:4194304}
+
+if [ "$1" = "-e" ]; then
+    SERVER_OPTS=$2
+    shift 2
+fi
+
+STORES="file segments ring"
+if [ -e "$DEVICE" ]; then
+    STORES="$STORES device:$DEVICE"
+else
+    echo "Skipping device store: $DEVICE not found"
+fi
+
+for store in $STORES; do
+    store_opts=$SERVER_OPTS
+    if [ "$store" = segments ]; then
+        store_opts="$store_opts $SEGMENT_OPTS"
+    fi
+    echo "== -s $store $store_opts"
+    $SERVER -s "$store" $store_opts &
+    pid=$!
+
+    # Wait for the listener with a one packet round trip
+    tries=0
+    until $BENCH -c 1 -n 1 >/dev/null 2>&1; do
+        tries=$((tries + 1))
+        if [ $tries -ge 50 ] || ! kill -0 $pid 2>/dev/null; then
+            echo "Server did not start"
+            kill $pid 2>/dev/null
+            exit 1
+        fi
+        sleep 0.1
+    done
+
+    $BENCH "$@"
+    echo "server cpu ticks: $(awk '{print $14 + $15}' /proc/$pid/stat)"
+
+    kill -TERM $pid
+    wait $pid
+done
@@ -0,0 +1,330 @@
+/**
+ * @file subscribe.c
+ * @brief Tail-follow subscriptions for aesdsocket
+ *
+ * A client that sends SUBSCRIBE_COMMAND is handed over by its engine to a
+ * single fan-out thread, which from then on pushes it every record
+ * committed to the data file until it disconnects. The command itself is
+ * not appended.
+ *
+ * Followers share the records where they already are: in the data file's
+ * page cache. Each one is only an offset, and the fan-out thread moves
+ * the new bytes with sendfile(), so a record is never copied per
+ * subscriber however many follow it. The log writer wakes the thread
+ * through an eventfd once per commit and only while anyone is following;
+ * commits that land while the thread is busy coalesce into one wakeup,
+ * and every follower then gets everything new in one send. A follower
+ * whose socket is full waits for EPOLLOUT without holding up the rest.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/queue.h>
+#include <netinet/in.h>
+
+#include "aesdsocket.h"
+
+#define FOLLOW_MAX_EVENTS 64
+
+struct follower {
+    int fd;
+    char client_ip[INET_ADDRSTRLEN];
+    // Next data file byte owed to the client
+    off_t pos;
+    // Socket was full; resume on EPOLLOUT
+    bool blocked;
+    // Compressed frames, if the client asked for them before subscribing
+    struct reply_codec codec;
+    LIST_ENTRY(follower) entries;
+    STAILQ_ENTRY(follower) join_entries;
+};
+
+// Handed over by the engines, adopted by the fan-out thread on wakeup
+static STAILQ_HEAD(, follower) joining = STAILQ_HEAD_INITIALIZER(joining);
+static pthread_mutex_t follow_mutex = PTHREAD_MUTEX_INITIALIZER;
+static bool follow_started;
+static bool follow_stopping;
+
+static pthread_t follow_thread;
+static int follow_epoll_fd = -1;
+static int follow_wake_fd = -1;
+// Followers handed over and not yet closed; publishing is free while zero
+static unsigned int follower_count;
+
+// Owned by the fan-out thread
+static LIST_HEAD(, follower) followers = LIST_HEAD_INITIALIZER(followers);
+
+static void follow_wake(void)
+{
+    uint64_t one = 1;
+
+    if (write(follow_wake_fd, &one, sizeof(one)) == -1) {
+        syslog(LOG_ERR, "Failed to wake fan-out thread: %s", strerror(errno));
+    }
+}
+
+static void follower_close(struct follower *follower)
+{
+    LIST_REMOVE(follower, entries);
+    close(follower->fd);
+    syslog(LOG_INFO, "Closed subscription from %s", follower->client_ip);
+    reply_codec_release(&follower->codec);
+    free(follower);
+    __atomic_sub_fetch(&follower_count, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Send the follower what it is owed up to @param end.
+ * @return 0 to keep the follower, -1 to close it
+ */
+static int follower_flush(struct follower *follower, size_t end)
+{
+    off_t reply_end = end;
+    int ret = send_file_range(follower->fd, &follower->pos, &reply_end, &follower->codec);
+
+    follower->blocked = ret == 1;
+    return ret == -1 ? -1 : 0;
+}
+
+/**
+ * Discard whatever the follower sends.
+ * @return 0 while the connection is open, -1 once the client closed it
+ */
+static int follower_drain(struct follower *follower)
+{
+    char discard[BUFFER_SIZE];
+
+    for (;;) {
+        ssize_t bytes = recv(follower->fd, discard, sizeof(discard), 0);
+        if (bytes > 0) {
+            continue;
+        }
+        if (bytes == -1 && errno == EINTR) {
+            continue;
+        }
+        return bytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+    }
+}
+
+/**
+ * Register newly handed over followers with epoll
+ */
+static void follow_adopt(void)
+{
+    STAILQ_HEAD(, follower) adopted = STAILQ_HEAD_INITIALIZER(adopted);
+    struct follower *follower;
+
+    pthread_mutex_lock(&follow_mutex);
+    STAILQ_CONCAT(&adopted, &joining);
+    pthread_mutex_unlock(&follow_mutex);
+
+    while ((follower = STAILQ_FIRST(&adopted)) != NULL) {
+        STAILQ_REMOVE_HEAD(&adopted, join_entries);
+        LIST_INSERT_HEAD(&followers, follower, entries);
+
+        struct epoll_event ev = {
+            .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+            .data.ptr = follower,
+        };
+        if (epoll_ctl(follow_epoll_fd, EPOLL_CTL_ADD, follower->fd, &ev) == -1) {
+            syslog(LOG_ERR, "Failed to register subscription: %s", strerror(errno));
+            follower_close(follower);
+        }
+    }
+}
+
+/**
+ * Fan-out thread function: adopt new followers, push newly committed
+ * bytes to every follower whose socket has room, and retire followers
+ * that disconnect
+ */
+static void *follow_run(void *arg)
+{
+    struct epoll_event events[FOLLOW_MAX_EVENTS];
+    struct follower *follower;
+    bool stopping = false;
+
+    (void)arg;
+
+    while (!stopping) {
+        int count = epoll_wait(follow_epoll_fd, events, FOLLOW_MAX_EVENTS, -1);
+        if (count == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            syslog(LOG_ERR, "Fan-out epoll_wait failed: %s", strerror(errno));
+            break;
+        }
+
+        size_t end = data_file_length();
+        bool published = false;
+        for (int i = 0; i < count; i++) {
+            if (events[i].data.ptr == &follow_wake_fd) {
+                uint64_t wakeups;
+                if (read(follow_wake_fd, &wakeups, sizeof(wakeups)) == -1 && errno != EAGAIN) {
+                    syslog(LOG_ERR, "Failed to read fan-out wakeup: %s", strerror(errno));
+                }
+                published = true;
+                continue;
+            }
+
+            follower = events[i].data.ptr;
+            if ((events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) ||
+                ((events[i].events & EPOLLIN) && follower_drain(follower) == -1)) {
+                follower_close(follower);
+            } else if ((events[i].events & EPOLLOUT) && follower->blocked &&
+                       follower_flush(follower, end) == -1) {
+                follower_close(follower);
+            }
+        }
+
+        if (published) {
+            pthread_mutex_lock(&follow_mutex);
+            stopping = follow_stopping;
+            pthread_mutex_unlock(&follow_mutex);
+
+            follow_adopt();
+            end = data_file_length();
+            follower = LIST_FIRST(&followers);
+            while (follower != NULL) {
+                struct follower *next = LIST_NEXT(follower, entries);
+                if (!follower->blocked && follower_flush(follower, end) == -1) {
+                    follower_close(follower);
+                }
+                follower = next;
+            }
+        }
+    }
+
+    follow_adopt();
+    while ((follower = LIST_FIRST(&followers)) != NULL) {
+        follower_close(follower);
+    }
+
+    return NULL;
+}
+
+/**
+ * Create the fan-out thread on first use. Called with follow_mutex held.
+ * @return 0 on success, -1 on failure
+ */
+static int follow_start(void)
+{
+    follow_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (follow_epoll_fd == -1) {
+        syslog(LOG_ERR, "Failed to create epoll instance: %s", strerror(errno));
+        return -1;
+    }
+
+    follow_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (follow_wake_fd == -1) {
+        syslog(LOG_ERR, "Failed to create eventfd: %s", strerror(errno));
+        close(follow_epoll_fd);
+        follow_epoll_fd = -1;
+        return -1;
+    }
+
+    struct epoll_event ev = {
+        .events = EPOLLIN,
+        .data.ptr = &follow_wake_fd,
+    };
+    if (epoll_ctl(follow_epoll_fd, EPOLL_CTL_ADD, follow_wake_fd, &ev) == -1 ||
+        pthread_create(&follow_thread, NULL, follow_run, NULL) != 0) {
+        syslog(LOG_ERR, "Failed to start fan-out thread");
+        close(follow_wake_fd);
+        close(follow_epoll_fd);
+        follow_wake_fd = -1;
+        follow_epoll_fd = -1;
+        return -1;
+    }
+
+    follow_started = true;
+    return 0;
+}
+
+int subscribe_follow(int client_fd, const char *client_ip, size_t offset, bool compressed)
+{
+    struct follower *follower = calloc(1, sizeof(*follower));
+    if (follower == NULL) {
+        syslog(LOG_ERR, "Failed to allocate subscription: %s", strerror(errno));
+        close(client_fd);
+        return -1;
+    }
+    follower->fd = client_fd;
+    follower->pos = offset;
+    snprintf(follower->client_ip, sizeof(follower->client_ip), "%s", client_ip);
+    if (compressed) {
+        // Acknowledged already: nothing is left of the frame but its buffer
+        if (reply_codec_start(&follower->codec, client_fd) == -1) {
+            close(client_fd);
+            free(follower);
+            return -1;
+        }
+        follower->codec.frame_len = 0;
+    }
+
+    int flags = fcntl(client_fd, F_GETFL);
+    if (flags == -1 || fcntl(client_fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        syslog(LOG_ERR, "Failed to make subscription non-blocking: %s", strerror(errno));
+        close(client_fd);
+        reply_codec_release(&follower->codec);
+        free(follower);
+        return -1;
+    }
+
+    pthread_mutex_lock(&follow_mutex);
+    if (follow_stopping || (!follow_started && follow_start() == -1)) {
+        pthread_mutex_unlock(&follow_mutex);
+        close(client_fd);
+        reply_codec_release(&follower->codec);
+        free(follower);
+        return -1;
+    }
+    STAILQ_INSERT_TAIL(&joining, follower, join_entries);
+    __atomic_add_fetch(&follower_count, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&follow_mutex);
+
+    syslog(LOG_INFO, "Subscribed %s from offset %zu", client_ip, offset);
+    // Catch up on anything committed since offset
+    follow_wake();
+    return 0;
+}
+
+void subscribe_publish(void)
+{
+    if (__atomic_load_n(&follower_count, __ATOMIC_RELAXED) > 0) {
+        follow_wake();
+    }
+}
+
+void subscribe_stop(void)
+{
+    pthread_mutex_lock(&follow_mutex);
+    follow_stopping = true;
+    bool started = follow_started;
+    pthread_mutex_unlock(&follow_mutex);
+
+    if (!started) {
+        return;
+    }
+
+    follow_wake();
+    pthread_join(follow_thread, NULL);
+    close(follow_wake_fd);
+    close(follow_epoll_fd);
+    follow_wake_fd = -1;
+    follow_epoll_fd = -1;
+}
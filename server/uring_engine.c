@@ -0,0 +1,1125 @@
+/**
+ * @file uring_engine.c
+ * @brief io_uring engine for aesdsocket
+ *
+ * A single thread drives every connection through one io_uring instance:
+ * a multishot accept on the listening socket, a multishot recv per client
+ * drawing from a registered provided-buffer ring, and replies sent as a
+ * linked SPLICE (data file into a per-connection pipe) -> SPLICE (pipe into
+ * the socket) pair per chunk, so reply bytes never pass through userspace.
+ * Compressed replies are the exception: each frame is cut and written
+ * into the empty pipe, then spliced to the socket like any other chunk.
+ * Bytes the store holds in memory, such as the -M mirror, skip the pipe:
+ * they are sent to the socket straight from there.
+ * Submissions are batched and flushed with the same io_uring_enter() call
+ * that waits for completions.
+ *
+ * When the log writer thread runs, appends complete asynchronously: the
+ * writer pushes committed replies onto a completion stack and signals an
+ * eventfd the ring keeps a read armed on.
+ *
+ * The ring is driven through the raw system calls so the server has no
+ * library dependency. If the kernel lacks io_uring or any of the
+ * operations used here, uring_engine_run() returns URING_UNAVAILABLE
+ * before touching the listening socket so the caller can fall back.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/queue.h>
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+
+#include "aesdsocket.h"
+#include "lz.h"
+
+#define URING_ENTRIES 1024
+#define URING_CQ_ENTRIES 8192
+#define RECV_BUFFER_GROUP 0
+#define RECV_BUFFER_COUNT 256
+#define RECV_BUFFER_LEN 4096
+// Requested reply pipe capacity; a chunk never exceeds what the pipe holds
+// so the file->pipe splice never blocks
+#define TX_PIPE_SIZE (1024 * BUFFER_SIZE)
+#define MAX_PENDING_REPLIES 16
+#define SHUTDOWN_DRAIN_ROUNDS 10
+
+// Operation tag stored in the low bits of each SQE's user_data
+enum uring_op {
+    OP_ACCEPT = 1,
+    OP_RECV,
+    OP_SPLICE_IN,
+    OP_SPLICE_OUT,
+    OP_CANCEL,
+    OP_NOTIFY,
+    OP_SEND,
+};
+#define OP_MASK 0x7UL
+
+struct uring_conn;
+
+// A reply still owed to the client: the data file up to record.end once
+// the append has committed. While the writer thread holds the record the
+// packet bytes live in data[]. A seek command queues a reply with no
+// record, resolved once it reaches the head of the queue; so does a
+// compress command, which switches the codec there.
+struct uring_reply {
+    struct log_record record;
+    struct uring_conn *conn;
+    bool committed;
+    bool seek;
+    struct aesd_seekto seekto;
+    bool compress;
+    struct uring_reply *completed_next;
+    STAILQ_ENTRY(uring_reply) entries;
+    char data[];
+};
+
+struct uring_conn {
+    int fd;
+    char client_ip[INET_ADDRSTRLEN];
+
+    struct recv_buffer rx;
+
+    // Requests the kernel still holds a reference to this connection for
+    unsigned int inflight;
+    bool recv_armed;
+    bool peer_closed;
+    bool closing;
+
+    // Sent SUBSCRIBE_COMMAND: handed to the fan-out thread from
+    // follow_from once the kernel is done with it and earlier replies are out
+    bool subscribing;
+    size_t follow_from;
+
+    STAILQ_HEAD(, uring_reply) replies;
+    unsigned int pending;
+    bool tx_busy;
+    int pipe_fds[2];
+    size_t pipe_size;
+    size_t reply_pos;
+    size_t chunk_len;
+    size_t chunk_sent;
+    // Reply bytes the chunk moves reply_pos on by once sent; frames move
+    // it as they are cut instead
+    size_t chunk_raw;
+    // Frames are built in codec.frame, the acknowledgement left there
+    // (frame_len) until it is written to the pipe
+    struct reply_codec codec;
+    // Store descriptor and offset the current chunk is spliced in from
+    int splice_fd;
+    off_t splice_off;
+    // Store memory the current chunk is sent from instead, held until the
+    // last send of it completes
+    const char *held;
+
+    // Records the writer thread has not handed back yet
+    unsigned int uncommitted;
+    bool ready_queued;
+    SLIST_ENTRY(uring_conn) ready_entries;
+
+    LIST_ENTRY(uring_conn) entries;
+};
+
+// Userspace view of the submission and completion rings
+struct uring {
+    int ring_fd;
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    unsigned int sq_entries;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_cqe *cqes;
+    struct io_uring_sqe *sqes;
+    void *sq_ptr;
+    size_t sq_len;
+    void *cq_ptr;
+    size_t cq_len;
+    size_t sqes_len;
+    unsigned int local_tail;
+
+    struct io_uring_buf_ring *buf_ring;
+    size_t buf_ring_len;
+    char *buf_base;
+    unsigned short buf_tail;
+};
+
+static struct uring ring;
+static LIST_HEAD(, uring_conn) conn_list = LIST_HEAD_INITIALIZER(conn_list);
+static bool accept_armed;
+static bool accepted_any;
+
+// Committed replies pushed by the writer thread, signalled on notify_fd
+static struct uring_reply *completed;
+static unsigned int uncommitted_records;
+static int notify_fd = -1;
+static uint64_t notify_value;
+
+static int sys_io_uring_setup(unsigned int entries, struct io_uring_params *params)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete,
+                              unsigned int flags, void *arg, size_t argsz)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static int sys_io_uring_register(int fd, unsigned int opcode, void *arg, unsigned int nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static inline uint64_t make_user_data(void *ptr, enum uring_op op)
+{
+    return (uint64_t)(uintptr_t)ptr | op;
+}
+
+/**
+ * Hand queued submissions to the kernel and optionally wait for completions.
+ * @return number of SQEs consumed, or -errno
+ */
+static int uring_submit(unsigned int wait_nr, struct __kernel_timespec *timeout)
+{
+    unsigned int to_submit = ring.local_tail - *ring.sq_tail;
+    unsigned int flags = wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0;
+    struct io_uring_getevents_arg arg;
+    void *argp = NULL;
+    size_t argsz = 0;
+
+    __atomic_store_n(ring.sq_tail, ring.local_tail, __ATOMIC_RELEASE);
+
+    if (timeout != NULL) {
+        memset(&arg, 0, sizeof(arg));
+        arg.ts = (uint64_t)(uintptr_t)timeout;
+        argp = &arg;
+        argsz = sizeof(arg);
+        flags |= IORING_ENTER_EXT_ARG;
+    }
+
+    int ret = sys_io_uring_enter(ring.ring_fd, to_submit, wait_nr, flags, argp, argsz);
+    return ret < 0 ? -errno : ret;
+}
+
+/**
+ * Reserve the next submission queue entry, flushing the ring if it is full
+ */
+static struct io_uring_sqe *uring_get_sqe(void)
+{
+    unsigned int head = __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+
+    if (ring.local_tail - head >= ring.sq_entries) {
+        uring_submit(0, NULL);
+        head = __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+        if (ring.local_tail - head >= ring.sq_entries) {
+            return NULL;
+        }
+    }
+
+    unsigned int index = ring.local_tail & *ring.sq_mask;
+    struct io_uring_sqe *sqe = &ring.sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring.sq_array[index] = index;
+    ring.local_tail++;
+    return sqe;
+}
+
+/**
+ * Return a provided buffer to the kernel
+ */
+static void recycle_buffer(unsigned short bid)
+{
+    struct io_uring_buf *buf = &ring.buf_ring->bufs[ring.buf_tail & (RECV_BUFFER_COUNT - 1)];
+    buf->addr = (uint64_t)(uintptr_t)(ring.buf_base + (size_t)bid * RECV_BUFFER_LEN);
+    buf->len = RECV_BUFFER_LEN;
+    buf->bid = bid;
+    ring.buf_tail++;
+    __atomic_store_n(&ring.buf_ring->tail, ring.buf_tail, __ATOMIC_RELEASE);
+}
+
+/**
+ * Check that the kernel implements every opcode this engine submits
+ */
+static bool uring_probe_ops(void)
+{
+    static const unsigned char needed[] = {
+        IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SPLICE, IORING_OP_ASYNC_CANCEL,
+        IORING_OP_READ, IORING_OP_SEND,
+    };
+    size_t len = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, len);
+    bool ok = probe != NULL;
+
+    if (ok && sys_io_uring_register(ring.ring_fd, IORING_REGISTER_PROBE, probe, 256) < 0) {
+        ok = false;
+    }
+    for (size_t i = 0; ok && i < sizeof(needed); i++) {
+        if (needed[i] > probe->last_op || !(probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED)) {
+            ok = false;
+        }
+    }
+
+    free(probe);
+    return ok;
+}
+
+static void uring_teardown(void)
+{
+    // Closing the ring first cancels anything still referencing our buffers
+    if (ring.ring_fd != -1) {
+        close(ring.ring_fd);
+    }
+    if (ring.buf_base != NULL) {
+        free(ring.buf_base);
+    }
+    if (ring.buf_ring != NULL) {
+        munmap(ring.buf_ring, ring.buf_ring_len);
+    }
+    if (ring.sqes != NULL) {
+        munmap(ring.sqes, ring.sqes_len);
+    }
+    if (ring.sq_ptr != NULL) {
+        munmap(ring.sq_ptr, ring.sq_len);
+    }
+    memset(&ring, 0, sizeof(ring));
+    ring.ring_fd = -1;
+}
+
+/**
+ * Create the ring, map it and register the receive buffer pool.
+ * @return 0 on success, -1 if io_uring is not usable on this kernel
+ */
+static int uring_setup(void)
+{
+    struct io_uring_params params;
+
+    memset(&ring, 0, sizeof(ring));
+    ring.ring_fd = -1;
+
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+    params.cq_entries = URING_CQ_ENTRIES;
+    ring.ring_fd = sys_io_uring_setup(URING_ENTRIES, &params);
+    if (ring.ring_fd < 0) {
+        syslog(LOG_WARNING, "io_uring_setup failed: %s", strerror(errno));
+        ring.ring_fd = -1;
+        return -1;
+    }
+
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP)) {
+        syslog(LOG_WARNING, "io_uring lacks required features");
+        uring_teardown();
+        return -1;
+    }
+
+    ring.sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    ring.cq_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (ring.cq_len > ring.sq_len) {
+        ring.sq_len = ring.cq_len;
+    }
+    ring.sq_ptr = mmap(NULL, ring.sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       ring.ring_fd, IORING_OFF_SQ_RING);
+    if (ring.sq_ptr == MAP_FAILED) {
+        ring.sq_ptr = NULL;
+        syslog(LOG_WARNING, "Failed to map io_uring: %s", strerror(errno));
+        uring_teardown();
+        return -1;
+    }
+    ring.cq_ptr = ring.sq_ptr;
+    ring.cq_len = ring.sq_len;
+
+    ring.sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring.sqes = mmap(NULL, ring.sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     ring.ring_fd, IORING_OFF_SQES);
+    if (ring.sqes == MAP_FAILED) {
+        ring.sqes = NULL;
+        syslog(LOG_WARNING, "Failed to map io_uring SQEs: %s", strerror(errno));
+        uring_teardown();
+        return -1;
+    }
+
+    char *sq = ring.sq_ptr;
+    ring.sq_head = (unsigned int *)(sq + params.sq_off.head);
+    ring.sq_tail = (unsigned int *)(sq + params.sq_off.tail);
+    ring.sq_mask = (unsigned int *)(sq + params.sq_off.ring_mask);
+    ring.sq_array = (unsigned int *)(sq + params.sq_off.array);
+    ring.sq_entries = params.sq_entries;
+    ring.local_tail = *ring.sq_tail;
+
+    char *cq = ring.cq_ptr;
+    ring.cq_head = (unsigned int *)(cq + params.cq_off.head);
+    ring.cq_tail = (unsigned int *)(cq + params.cq_off.tail);
+    ring.cq_mask = (unsigned int *)(cq + params.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    if (!uring_probe_ops()) {
+        syslog(LOG_WARNING, "io_uring lacks required opcodes");
+        uring_teardown();
+        return -1;
+    }
+
+    // Provided buffer ring shared by every multishot recv
+    ring.buf_ring_len = RECV_BUFFER_COUNT * sizeof(struct io_uring_buf);
+    ring.buf_ring = mmap(NULL, ring.buf_ring_len, PROT_READ | PROT_WRITE,
+                         MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (ring.buf_ring == MAP_FAILED) {
+        ring.buf_ring = NULL;
+        uring_teardown();
+        return -1;
+    }
+    ring.buf_base = malloc((size_t)RECV_BUFFER_COUNT * RECV_BUFFER_LEN);
+    if (ring.buf_base == NULL) {
+        uring_teardown();
+        return -1;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)ring.buf_ring;
+    reg.ring_entries = RECV_BUFFER_COUNT;
+    reg.bgid = RECV_BUFFER_GROUP;
+    if (sys_io_uring_register(ring.ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        syslog(LOG_WARNING, "Failed to register provided buffers: %s", strerror(errno));
+        uring_teardown();
+        return -1;
+    }
+    for (unsigned short bid = 0; bid < RECV_BUFFER_COUNT; bid++) {
+        recycle_buffer(bid);
+    }
+
+    return 0;
+}
+
+static void arm_accept(void)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe();
+    if (sqe == NULL) {
+        syslog(LOG_ERR, "io_uring submission queue full, cannot arm accept");
+        return;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = server_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = make_user_data(NULL, OP_ACCEPT);
+    accept_armed = true;
+}
+
+/**
+ * Arm the connection's multishot recv. If the submission queue stays full
+ * the connection could never be read again, so it is closed instead; the
+ * caller must pass it to conn_maybe_free() afterwards.
+ */
+static void arm_recv(struct uring_conn *conn)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe();
+    if (sqe == NULL) {
+        syslog(LOG_ERR, "io_uring submission queue full, closing connection from %s",
+               conn->client_ip);
+        conn->closing = true;
+        shutdown(conn->fd, SHUT_RDWR);
+        return;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = RECV_BUFFER_GROUP;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->user_data = make_user_data(conn, OP_RECV);
+    conn->recv_armed = true;
+    conn->inflight++;
+}
+
+/**
+ * Wait for the writer thread to signal committed replies
+ */
+static void arm_notify(void)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe();
+    if (sqe == NULL) {
+        syslog(LOG_ERR, "io_uring submission queue full, cannot arm notification");
+        return;
+    }
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = notify_fd;
+    sqe->addr = (uint64_t)(uintptr_t)&notify_value;
+    sqe->len = sizeof(notify_value);
+    sqe->user_data = make_user_data(NULL, OP_NOTIFY);
+}
+
+/**
+ * Stop the multishot recv while the reply queue is full
+ */
+static void cancel_recv(struct uring_conn *conn)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe();
+    if (sqe == NULL) {
+        return;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = make_user_data(conn, OP_RECV);
+    sqe->user_data = make_user_data(NULL, OP_CANCEL);
+}
+
+/**
+ * Hand the memory the current chunk was sent from back to the store
+ */
+static void release_held(struct uring_conn *conn)
+{
+    if (conn->held != NULL) {
+        storage->put_mem(conn->held);
+        conn->held = NULL;
+    }
+}
+
+/**
+ * Queue a splice of the unsent part of the current chunk from the pipe to
+ * the socket, optionally preceded by a linked splice that fills the pipe
+ * from conn->splice_fd, handed back to the store once that completes. A
+ * chunk in conn->held is sent from there instead.
+ */
+static void submit_chunk(struct uring_conn *conn, bool fill_pipe)
+{
+    struct io_uring_sqe *in_sqe = NULL;
+
+    if (fill_pipe) {
+        in_sqe = uring_get_sqe();
+        if (in_sqe == NULL) {
+            storage->put_fd(conn->splice_fd);
+            return;
+        }
+        in_sqe->opcode = IORING_OP_SPLICE;
+        in_sqe->splice_fd_in = conn->splice_fd;
+        in_sqe->splice_off_in = conn->splice_off;
+        in_sqe->fd = conn->pipe_fds[1];
+        in_sqe->off = (uint64_t)-1;
+        in_sqe->len = conn->chunk_len;
+        in_sqe->flags = IOSQE_IO_LINK;
+        in_sqe->user_data = make_user_data(conn, OP_SPLICE_IN);
+        conn->inflight++;
+    }
+
+    struct io_uring_sqe *sqe = uring_get_sqe();
+    if (sqe == NULL) {
+        // The first splice is already queued; unlink it so it completes alone
+        if (in_sqe != NULL) {
+            in_sqe->flags = 0;
+        }
+        release_held(conn);
+        conn->closing = true;
+        shutdown(conn->fd, SHUT_RDWR);
+        return;
+    }
+    if (conn->held != NULL) {
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = conn->fd;
+        sqe->addr = (uint64_t)(uintptr_t)(conn->held + conn->chunk_sent);
+        sqe->len = conn->chunk_len - conn->chunk_sent;
+        sqe->user_data = make_user_data(conn, OP_SEND);
+        conn->inflight++;
+        conn->tx_busy = true;
+        return;
+    }
+    sqe->opcode = IORING_OP_SPLICE;
+    sqe->splice_fd_in = conn->pipe_fds[0];
+    sqe->splice_off_in = (uint64_t)-1;
+    sqe->fd = conn->fd;
+    sqe->off = (uint64_t)-1;
+    sqe->len = conn->chunk_len - conn->chunk_sent;
+    sqe->user_data = make_user_data(conn, OP_SPLICE_OUT);
+    conn->inflight++;
+    conn->tx_busy = true;
+}
+
+static void close_pipe(struct uring_conn *conn)
+{
+    if (conn->pipe_fds[0] != -1) {
+        close(conn->pipe_fds[0]);
+        close(conn->pipe_fds[1]);
+        conn->pipe_fds[0] = -1;
+        conn->pipe_fds[1] = -1;
+    }
+}
+
+/**
+ * Write the current chunk from @param bytes into the empty pipe, which
+ * holds it all without blocking, and queue its splice to the socket
+ */
+static void send_from_pipe(struct uring_conn *conn, const char *bytes)
+{
+    if (conn->chunk_len > 0 && write(conn->pipe_fds[1], bytes, conn->chunk_len) == -1) {
+        syslog(LOG_ERR, "Failed to fill reply pipe: %s", strerror(errno));
+        conn->closing = true;
+        shutdown(conn->fd, SHUT_RDWR);
+        return;
+    }
+    submit_chunk(conn, false);
+}
+
+/**
+ * Start sending the next chunk of the reply at the head of the queue
+ */
+static void start_tx(struct uring_conn *conn)
+{
+    struct uring_reply *reply = STAILQ_FIRST(&conn->replies);
+
+    if (conn->tx_busy || conn->closing || reply == NULL || !reply->committed) {
+        return;
+    }
+    if (reply->seek) {
+        off_t end;
+        conn->reply_pos = seekto_reply_start(&reply->seekto, &end);
+        reply->record.end = end;
+        reply->seek = false;
+    }
+    if (reply->compress) {
+        // Only the acknowledgement goes out for it
+        if (reply_codec_start(&conn->codec, conn->fd) == -1) {
+            conn->closing = true;
+            shutdown(conn->fd, SHUT_RDWR);
+            return;
+        }
+        reply->record.end = conn->reply_pos;
+        reply->compress = false;
+    }
+    if (conn->pipe_fds[0] == -1) {
+        if (pipe2(conn->pipe_fds, O_CLOEXEC) == -1) {
+            conn->pipe_fds[0] = -1;
+            conn->pipe_fds[1] = -1;
+            syslog(LOG_ERR, "Failed to create reply pipe: %s", strerror(errno));
+            conn->closing = true;
+            shutdown(conn->fd, SHUT_RDWR);
+            return;
+        }
+        // Larger pipes mean fewer splice round trips; keep the default if refused
+        int size = fcntl(conn->pipe_fds[1], F_SETPIPE_SZ, TX_PIPE_SIZE);
+        if (size == -1) {
+            size = fcntl(conn->pipe_fds[1], F_GETPIPE_SZ);
+        }
+        conn->pipe_size = size > 0 ? (size_t)size : BUFFER_SIZE;
+    }
+
+    if (conn->reply_pos > reply->record.end) {
+        // The data file was rotated since the previous reply
+        conn->reply_pos = 0;
+    }
+    conn->chunk_sent = 0;
+
+    off_t pos = conn->reply_pos;
+    off_t end = reply->record.end;
+    size_t len;
+    if (conn->codec.enabled) {
+        // Each frame fits in the empty pipe, as they are never larger than
+        // the bytes they carry plus a header
+        len = conn->codec.frame_len;
+        if (len == 0) {
+            ssize_t frame_len = reply_frame_next(&pos, &end, conn->codec.frame,
+                                                 conn->pipe_size - sizeof(struct lz_frame_header));
+            if (frame_len == -1) {
+                conn->closing = true;
+                shutdown(conn->fd, SHUT_RDWR);
+                return;
+            }
+            len = frame_len;
+        }
+        conn->codec.frame_len = 0;
+        conn->reply_pos = pos;
+        reply->record.end = end;
+        conn->chunk_len = len;
+        conn->chunk_raw = 0;
+        send_from_pipe(conn, conn->codec.frame);
+        return;
+    }
+
+    // Bytes the store holds in memory are sent from there
+    conn->held = storage->get_mem != NULL ? storage->get_mem(&pos, &end, &len) : NULL;
+    if (conn->held != NULL) {
+        conn->reply_pos = pos;
+        reply->record.end = end;
+        conn->chunk_len = len;
+        conn->chunk_raw = len;
+        submit_chunk(conn, false);
+        return;
+    }
+
+    conn->splice_fd = storage->get_fd(&pos, &end, &conn->splice_off, &len);
+    if (conn->splice_fd == -1) {
+        // Nothing to splice from: copy the chunk out first
+        static char copy_chunk[STORAGE_COPY_SIZE];
+        len = conn->pipe_size < sizeof(copy_chunk) ? conn->pipe_size : sizeof(copy_chunk);
+
+        ssize_t bytes = storage->read(&pos, &end, copy_chunk, len);
+        if (bytes == -1) {
+            conn->closing = true;
+            shutdown(conn->fd, SHUT_RDWR);
+            return;
+        }
+        conn->chunk_len = bytes;
+        conn->chunk_raw = conn->chunk_len;
+        conn->reply_pos = pos;
+        reply->record.end = end;
+        send_from_pipe(conn, copy_chunk);
+        return;
+    }
+
+    // Each chunk comes from one segment, at most a pipe's worth
+    conn->reply_pos = pos;
+    reply->record.end = end;
+    conn->chunk_len = len < conn->pipe_size ? len : conn->pipe_size;
+    conn->chunk_raw = conn->chunk_len;
+    submit_chunk(conn, true);
+}
+
+/**
+ * Writer thread callback: hand a committed reply back to the ring thread
+ */
+static void reply_committed(struct log_record *record)
+{
+    struct uring_reply *reply = (struct uring_reply *)record;
+    struct uring_reply *head = __atomic_load_n(&completed, __ATOMIC_RELAXED);
+
+    do {
+        reply->completed_next = head;
+    } while (!__atomic_compare_exchange_n(&completed, &head, reply, true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    // Only the push onto an empty stack needs to wake the ring
+    if (head == NULL) {
+        uint64_t one = 1;
+        if (write(notify_fd, &one, sizeof(one)) == -1) {
+            syslog(LOG_ERR, "Failed to notify io_uring engine: %s", strerror(errno));
+        }
+    }
+}
+
+/**
+ * Append every complete packet in the receive buffer and queue its reply
+ */
+static int process_packets(struct uring_conn *conn)
+{
+    const char *packet;
+    size_t packet_size;
+
+    while (conn->pending < MAX_PENDING_REPLIES && !conn->subscribing &&
+           (packet = recv_buffer_next_packet(&conn->rx, &packet_size)) != NULL) {
+        if (recv_buffer_packet_is(&conn->rx, packet, packet_size, SUBSCRIBE_COMMAND)) {
+            conn->subscribing = true;
+            conn->follow_from = data_file_length();
+            recv_buffer_consume(&conn->rx, packet_size);
+            if (conn->recv_armed) {
+                cancel_recv(conn);
+            }
+            break;
+        }
+
+        struct aesd_seekto seekto;
+        bool compress = recv_buffer_packet_is(&conn->rx, packet, packet_size, COMPRESS_COMMAND);
+        bool seek = !compress && recv_buffer_parse_seekto(&conn->rx, packet, packet_size, &seekto);
+
+        // The buffer is reused before a queued record is written, so copy it
+        size_t copy = log_writer_running() && !seek && !compress ? packet_size : 0;
+        struct uring_reply *reply = malloc(sizeof(*reply) + copy);
+        if (reply == NULL) {
+            syslog(LOG_ERR, "Failed to allocate reply: %s", strerror(errno));
+            return -1;
+        }
+        memset(reply, 0, sizeof(*reply));
+        reply->conn = conn;
+        if (seek || compress) {
+            // Nothing to append; answered in order, a seek from the
+            // record index
+            reply->committed = true;
+            reply->seek = seek;
+            if (seek) {
+                reply->seekto = seekto;
+            }
+            reply->compress = compress;
+            STAILQ_INSERT_TAIL(&conn->replies, reply, entries);
+            conn->pending++;
+            recv_buffer_consume(&conn->rx, packet_size);
+            continue;
+        }
+        reply->record.data = packet;
+        reply->record.len = packet_size;
+        reply->record.complete = reply_committed;
+        reply->record.spill_fd = recv_buffer_take_spill(&conn->rx, &reply->record.spill_len);
+        if (copy > 0) {
+            memcpy(reply->data, packet, packet_size);
+            reply->record.data = reply->data;
+        }
+        STAILQ_INSERT_TAIL(&conn->replies, reply, entries);
+        conn->pending++;
+
+        if (log_submit(&reply->record) == LOG_COMPLETED) {
+            reply->committed = true;
+        } else {
+            conn->uncommitted++;
+            uncommitted_records++;
+        }
+
+        recv_buffer_consume(&conn->rx, packet_size);
+    }
+
+    if (conn->pending >= MAX_PENDING_REPLIES && conn->recv_armed) {
+        cancel_recv(conn);
+    }
+    start_tx(conn);
+    return 0;
+}
+
+static void conn_begin_close(struct uring_conn *conn)
+{
+    if (!conn->closing) {
+        conn->closing = true;
+        shutdown(conn->fd, SHUT_RDWR);
+    }
+}
+
+/**
+ * Release a connection once neither the kernel nor the writer thread
+ * references it, or hand it to the fan-out thread if it subscribed and
+ * every earlier reply is out
+ */
+static void conn_maybe_free(struct uring_conn *conn)
+{
+    struct uring_reply *reply;
+
+    if (conn->subscribing && !conn->closing && conn->inflight == 0 &&
+        STAILQ_EMPTY(&conn->replies)) {
+        LIST_REMOVE(conn, entries);
+        close_pipe(conn);
+        recv_buffer_release(&conn->rx);
+        subscribe_follow(conn->fd, conn->client_ip, conn->follow_from, conn->codec.enabled);
+        reply_codec_release(&conn->codec);
+        free(conn);
+        return;
+    }
+
+    if (!conn->closing || conn->inflight > 0 || conn->uncommitted > 0) {
+        return;
+    }
+
+    while ((reply = STAILQ_FIRST(&conn->replies)) != NULL) {
+        STAILQ_REMOVE_HEAD(&conn->replies, entries);
+        free(reply);
+    }
+    LIST_REMOVE(conn, entries);
+    close(conn->fd);
+    syslog(LOG_INFO, "Closed connection from %s", conn->client_ip);
+    close_pipe(conn);
+    recv_buffer_release(&conn->rx);
+    reply_codec_release(&conn->codec);
+    free(conn);
+}
+
+static void handle_accept(struct io_uring_cqe *cqe)
+{
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        accept_armed = false;
+    }
+
+    if (cqe->res < 0) {
+        if (!caught_signal && cqe->res != -ECONNABORTED) {
+            syslog(LOG_ERR, "Failed to accept connection: %s", strerror(-cqe->res));
+        }
+    } else {
+        struct uring_conn *conn = calloc(1, sizeof(*conn));
+        if (conn == NULL) {
+            syslog(LOG_ERR, "Failed to allocate connection: %s", strerror(errno));
+            close(cqe->res);
+        } else {
+            struct sockaddr_in client_addr;
+            socklen_t client_addr_len = sizeof(client_addr);
+
+            accepted_any = true;
+            conn->fd = cqe->res;
+            conn->pipe_fds[0] = -1;
+            conn->pipe_fds[1] = -1;
+            STAILQ_INIT(&conn->replies);
+            if (getpeername(conn->fd, (struct sockaddr *)&client_addr, &client_addr_len) == 0) {
+                inet_ntop(AF_INET, &client_addr.sin_addr, conn->client_ip, sizeof(conn->client_ip));
+            }
+            LIST_INSERT_HEAD(&conn_list, conn, entries);
+            syslog(LOG_INFO, "Accepted connection from %s", conn->client_ip);
+            arm_recv(conn);
+            conn_maybe_free(conn);
+        }
+    }
+
+    if (!accept_armed && !caught_signal && cqe->res != -EINVAL) {
+        arm_accept();
+    }
+}
+
+static void handle_recv(struct uring_conn *conn, struct io_uring_cqe *cqe)
+{
+    bool more = cqe->flags & IORING_CQE_F_MORE;
+
+    if (!more) {
+        conn->recv_armed = false;
+        conn->inflight--;
+    }
+
+    if (cqe->res > 0) {
+        unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        const char *data = ring.buf_base + (size_t)bid * RECV_BUFFER_LEN;
+        size_t len = cqe->res;
+
+        if (!conn->closing) {
+            char *recv_pos = recv_buffer_reserve(&conn->rx, len, NULL);
+            if (recv_pos == NULL) {
+                conn_begin_close(conn);
+            } else {
+                memcpy(recv_pos, data, len);
+                if (recv_buffer_produce(&conn->rx, len) == -1) {
+                    conn_begin_close(conn);
+                }
+            }
+        }
+        recycle_buffer(bid);
+
+        if (!conn->closing && process_packets(conn) == -1) {
+            conn_begin_close(conn);
+        }
+    } else if (cqe->res == 0) {
+        conn->peer_closed = true;
+        if (STAILQ_EMPTY(&conn->replies)) {
+            conn_begin_close(conn);
+        }
+    } else if (cqe->res != -ENOBUFS && cqe->res != -ECANCELED) {
+        if (!conn->closing) {
+            syslog(LOG_ERR, "Failed to receive data: %s", strerror(-cqe->res));
+        }
+        conn_begin_close(conn);
+    }
+
+    // Re-arm after buffer exhaustion or when the kernel ended the multishot
+    if (!conn->recv_armed && !conn->closing && !conn->peer_closed && !conn->subscribing &&
+        conn->pending < MAX_PENDING_REPLIES) {
+        arm_recv(conn);
+    }
+    conn_maybe_free(conn);
+}
+
+/**
+ * Completion of a splice or send of the current chunk to the socket
+ */
+static void handle_chunk_out(struct uring_conn *conn, struct io_uring_cqe *cqe)
+{
+    conn->inflight--;
+    conn->tx_busy = false;
+
+    if (cqe->res < 0 || conn->closing || conn->chunk_sent + cqe->res >= conn->chunk_len) {
+        release_held(conn);
+    }
+    if (cqe->res < 0) {
+        if (!conn->closing && cqe->res != -ECANCELED) {
+            syslog(LOG_ERR, "Failed to send data: %s", strerror(-cqe->res));
+        }
+        conn_begin_close(conn);
+        conn_maybe_free(conn);
+        return;
+    }
+
+    conn->chunk_sent += cqe->res;
+    if (conn->closing) {
+        conn_maybe_free(conn);
+        return;
+    }
+    if (conn->chunk_sent < conn->chunk_len) {
+        submit_chunk(conn, false);
+        return;
+    }
+
+    conn->reply_pos += conn->chunk_raw;
+    struct uring_reply *reply = STAILQ_FIRST(&conn->replies);
+    if (conn->reply_pos >= reply->record.end) {
+        if (reply->record.end > conn->follow_from) {
+            conn->follow_from = reply->record.end;
+        }
+        STAILQ_REMOVE_HEAD(&conn->replies, entries);
+        conn->pending--;
+        conn->reply_pos = reply_next_start(reply->record.end);
+        free(reply);
+    }
+
+    if (process_packets(conn) == -1) {
+        conn_begin_close(conn);
+    } else if (STAILQ_EMPTY(&conn->replies)) {
+        // Idle connections do not keep a reply pipe
+        close_pipe(conn);
+        if (conn->peer_closed) {
+            conn_begin_close(conn);
+        } else if (!conn->recv_armed && !conn->subscribing) {
+            arm_recv(conn);
+        }
+    }
+    conn_maybe_free(conn);
+}
+
+/**
+ * Release replies the writer thread has committed and start sending them
+ */
+static void handle_notify(struct io_uring_cqe *cqe)
+{
+    SLIST_HEAD(, uring_conn) ready = SLIST_HEAD_INITIALIZER(ready);
+    struct uring_conn *conn;
+
+    if (cqe->res < 0 && cqe->res != -ECANCELED) {
+        syslog(LOG_ERR, "Failed to read notification: %s", strerror(-cqe->res));
+    }
+
+    struct uring_reply *reply = __atomic_exchange_n(&completed, NULL, __ATOMIC_ACQUIRE);
+    while (reply != NULL) {
+        struct uring_reply *next = reply->completed_next;
+        reply->committed = true;
+        conn = reply->conn;
+        conn->uncommitted--;
+        uncommitted_records--;
+        if (!conn->ready_queued) {
+            conn->ready_queued = true;
+            SLIST_INSERT_HEAD(&ready, conn, ready_entries);
+        }
+        reply = next;
+    }
+
+    // Each connection once, after all of its replies have been marked
+    while ((conn = SLIST_FIRST(&ready)) != NULL) {
+        SLIST_REMOVE_HEAD(&ready, ready_entries);
+        conn->ready_queued = false;
+        start_tx(conn);
+        conn_maybe_free(conn);
+    }
+
+    arm_notify();
+}
+
+/**
+ * Process every completion currently in the CQ ring
+ */
+static void reap_completions(void)
+{
+    unsigned int head = *ring.cq_head;
+    unsigned int tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+
+    while (head != tail) {
+        struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+        enum uring_op op = cqe->user_data & OP_MASK;
+        struct uring_conn *conn = (struct uring_conn *)(uintptr_t)(cqe->user_data & ~OP_MASK);
+
+        switch (op) {
+            case OP_ACCEPT:
+                handle_accept(cqe);
+                break;
+            case OP_RECV:
+                handle_recv(conn, cqe);
+                break;
+            case OP_SPLICE_IN:
+                conn->inflight--;
+                storage->put_fd(conn->splice_fd);
+                if (cqe->res != (int)conn->chunk_len && cqe->res != -ECANCELED) {
+                    syslog(LOG_ERR, "Failed to splice %s: %s", config.storage_path,
+                           cqe->res < 0 ? strerror(-cqe->res) : "short splice");
+                    conn_begin_close(conn);
+                }
+                conn_maybe_free(conn);
+                break;
+            case OP_SPLICE_OUT:
+            case OP_SEND:
+                handle_chunk_out(conn, cqe);
+                break;
+            case OP_NOTIFY:
+                handle_notify(cqe);
+                break;
+            default:
+                break;
+        }
+
+        head++;
+        if (head == tail) {
+            __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+            tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        }
+    }
+    __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+}
+
+int uring_engine_run(void)
+{
+    if (uring_setup() == -1) {
+        return URING_UNAVAILABLE;
+    }
+
+    notify_fd = eventfd(0, EFD_CLOEXEC);
+    if (notify_fd == -1) {
+        syslog(LOG_ERR, "Failed to create eventfd: %s", strerror(errno));
+        uring_teardown();
+        return -1;
+    }
+
+    accepted_any = false;
+    arm_accept();
+    arm_notify();
+    syslog(LOG_INFO, "Started io_uring engine");
+
+    int ret = 0;
+    while (!caught_signal) {
+        int submitted = uring_submit(1, NULL);
+        if (submitted < 0 && submitted != -EINTR && submitted != -EAGAIN && submitted != -EBUSY) {
+            syslog(LOG_ERR, "io_uring_enter failed: %s", strerror(-submitted));
+            ret = -1;
+            break;
+        }
+        reap_completions();
+
+        // Multishot accept rejected before any client: kernel is too old
+        if (!accept_armed && !accepted_any && !caught_signal) {
+            syslog(LOG_WARNING, "io_uring multishot accept unsupported");
+            ret = URING_UNAVAILABLE;
+            break;
+        }
+    }
+
+    // Shut every socket down so outstanding requests complete, then drain
+    struct uring_conn *conn, *next;
+    LIST_FOREACH(conn, &conn_list, entries) {
+        conn_begin_close(conn);
+    }
+    // Records still with the writer thread always come back; wait for them
+    for (int round = 0; uncommitted_records > 0 ||
+         (round < SHUTDOWN_DRAIN_ROUNDS && !LIST_EMPTY(&conn_list)); round++) {
+        struct __kernel_timespec timeout = { .tv_sec = 0, .tv_nsec = 100 * 1000 * 1000 };
+        uring_submit(1, &timeout);
+        reap_completions();
+    }
+
+    // Anything still referenced is cancelled when the ring is closed
+    uring_teardown();
+    for (conn = LIST_FIRST(&conn_list); conn != NULL; conn = next) {
+        next = LIST_NEXT(conn, entries);
+        conn->inflight = 0;
+        conn_maybe_free(conn);
+    }
+    close(notify_fd);
+    notify_fd = -1;
+    return ret;
+}